@@ -0,0 +1,146 @@
+#include "ds-fake-network-monitor.h"
+
+/* A network monitor whose state is set by the caller, so the helper's
+ * install scheduling can be exercised without changing the real
+ * network.  Every host is reachable while the network is available. */
+
+struct _DsFakeNetworkMonitor {
+    GObject parent;
+
+    gboolean available;
+    gboolean metered;
+};
+
+enum {
+    PROP_NETWORK_AVAILABLE = 1,
+    PROP_NETWORK_METERED,
+    PROP_CONNECTIVITY,
+};
+
+static void ds_fake_network_monitor_initable_init(GInitableIface *iface);
+static void ds_fake_network_monitor_network_monitor_init(GNetworkMonitorInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(DsFakeNetworkMonitor, ds_fake_network_monitor, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_INITABLE, ds_fake_network_monitor_initable_init)
+                        G_IMPLEMENT_INTERFACE(G_TYPE_NETWORK_MONITOR, ds_fake_network_monitor_network_monitor_init));
+
+static void
+ds_fake_network_monitor_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    DsFakeNetworkMonitor *self = DS_FAKE_NETWORK_MONITOR(object);
+
+    switch (prop_id) {
+    case PROP_NETWORK_AVAILABLE:
+        g_value_set_boolean(value, self->available);
+        break;
+    case PROP_NETWORK_METERED:
+        g_value_set_boolean(value, self->metered);
+        break;
+    case PROP_CONNECTIVITY:
+        g_value_set_enum(value, self->available ? G_NETWORK_CONNECTIVITY_FULL : G_NETWORK_CONNECTIVITY_LOCAL);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_fake_network_monitor_class_init(DsFakeNetworkMonitorClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->get_property = ds_fake_network_monitor_get_property;
+
+    g_object_class_override_property(gobject_class, PROP_NETWORK_AVAILABLE, "network-available");
+    g_object_class_override_property(gobject_class, PROP_NETWORK_METERED, "network-metered");
+    g_object_class_override_property(gobject_class, PROP_CONNECTIVITY, "connectivity");
+}
+
+static void
+ds_fake_network_monitor_init(DsFakeNetworkMonitor *self)
+{
+}
+
+static gboolean
+ds_fake_network_monitor_initable_init_impl(GInitable *initable, GCancellable *cancellable, GError **error)
+{
+    return TRUE;
+}
+
+static void
+ds_fake_network_monitor_initable_init(GInitableIface *iface)
+{
+    iface->init = ds_fake_network_monitor_initable_init_impl;
+}
+
+static gboolean
+ds_fake_network_monitor_can_reach(GNetworkMonitor *monitor, GSocketConnectable *connectable, GCancellable *cancellable, GError **error)
+{
+    DsFakeNetworkMonitor *self = DS_FAKE_NETWORK_MONITOR(monitor);
+
+    if (!self->available) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NETWORK_UNREACHABLE, "Network unreachable");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+ds_fake_network_monitor_can_reach_async(GNetworkMonitor *monitor, GSocketConnectable *connectable, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_autoptr(GTask) task = g_task_new(monitor, cancellable, callback, user_data);
+    GError *error = NULL;
+
+    if (ds_fake_network_monitor_can_reach(monitor, connectable, cancellable, &error)) {
+        g_task_return_boolean(task, TRUE);
+    } else {
+        g_task_return_error(task, error);
+    }
+}
+
+static gboolean
+ds_fake_network_monitor_can_reach_finish(GNetworkMonitor *monitor, GAsyncResult *result, GError **error)
+{
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+static void
+ds_fake_network_monitor_network_monitor_init(GNetworkMonitorInterface *iface)
+{
+    iface->can_reach = ds_fake_network_monitor_can_reach;
+    iface->can_reach_async = ds_fake_network_monitor_can_reach_async;
+    iface->can_reach_finish = ds_fake_network_monitor_can_reach_finish;
+}
+
+DsFakeNetworkMonitor *
+ds_fake_network_monitor_new(gboolean available, gboolean metered)
+{
+    DsFakeNetworkMonitor *self = g_object_new(DS_TYPE_FAKE_NETWORK_MONITOR, NULL);
+
+    self->available = available;
+    self->metered = metered;
+    return self;
+}
+
+/* Changes the network, notifying as GNetworkMonitor implementations do:
+ * properties that changed first, then network-changed */
+void
+ds_fake_network_monitor_set_network(DsFakeNetworkMonitor *self, gboolean available, gboolean metered)
+{
+    gboolean available_changed = self->available != available;
+    gboolean metered_changed = self->metered != metered;
+
+    self->available = available;
+    self->metered = metered;
+    if (available_changed) {
+        g_object_notify(G_OBJECT(self), "network-available");
+        g_object_notify(G_OBJECT(self), "connectivity");
+    }
+    if (metered_changed) {
+        g_object_notify(G_OBJECT(self), "network-metered");
+    }
+    if (available_changed || metered_changed) {
+        g_signal_emit_by_name(self, "network-changed", available);
+    }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define DS_TYPE_FAKE_NETWORK_MONITOR (ds_fake_network_monitor_get_type())
+G_DECLARE_FINAL_TYPE(DsFakeNetworkMonitor, ds_fake_network_monitor, DS, FAKE_NETWORK_MONITOR, GObject);
+
+DsFakeNetworkMonitor *ds_fake_network_monitor_new(gboolean available, gboolean metered);
+
+void ds_fake_network_monitor_set_network(DsFakeNetworkMonitor *self, gboolean available, gboolean metered);
+
+G_END_DECLS
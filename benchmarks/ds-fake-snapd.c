@@ -0,0 +1,714 @@
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gio/gunixsocketaddress.h>
+
+#include "ds-fake-snapd.h"
+
+/* A stand-in for snapd on a Unix socket, answering the requests the
+ * helper makes from configured state.  Each connection is served on its
+ * own thread, one request at a time as snapd does, so latency injected
+ * into a request delays the ones behind it on the same connection. */
+
+/* Longest a notices request is held open, in milliseconds */
+#define NOTICES_HOLD 1000
+
+typedef struct {
+    guint latency_ms;
+    /* Error returned instead of a result, if status_code is set */
+    guint status_code;
+    char *kind;
+    char *message;
+    guint requests;
+} path_config_t;
+
+typedef struct {
+    char *snap_name;
+    char *content;
+    char *theme_name;
+} content_slot_t;
+
+typedef struct {
+    char *snap_name;
+    gint64 download_size;
+} store_snap_t;
+
+typedef struct {
+    char *change_id;
+    char *snap_name;
+    gint64 start_time;
+    gint64 end_time;
+    /* Set once the client has been told the change is ready */
+    gboolean reported;
+} install_t;
+
+struct _DsFakeSnapd {
+    GObject parent;
+
+    char *socket_dir;
+    char *socket_path;
+    GSocketService *service;
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread;
+
+    /* Everything below is shared with the connection threads */
+    GMutex lock;
+    /* path_config_t keyed by request path, with "*" applying to all */
+    GHashTable *paths;
+    GPtrArray *slots;
+    GHashTable *store_snaps;
+    GPtrArray *change_kinds;
+    /* install_t in the order they were started */
+    GPtrArray *installs;
+    guint install_time;
+    /* Installs the client hasn't yet seen complete, and the most there
+     * have been since the count was last taken */
+    guint running_installs;
+    guint max_running_installs;
+    guint requests;
+};
+
+G_DEFINE_TYPE(DsFakeSnapd, ds_fake_snapd, G_TYPE_OBJECT);
+
+static void
+path_config_free(path_config_t *config)
+{
+    g_free(config->kind);
+    g_free(config->message);
+    g_free(config);
+}
+
+static void
+content_slot_free(content_slot_t *slot)
+{
+    g_free(slot->snap_name);
+    g_free(slot->content);
+    g_free(slot->theme_name);
+    g_free(slot);
+}
+
+static void
+store_snap_free(store_snap_t *snap)
+{
+    g_free(snap->snap_name);
+    g_free(snap);
+}
+
+static void
+install_free(install_t *install)
+{
+    g_free(install->change_id);
+    g_free(install->snap_name);
+    g_free(install);
+}
+
+static void
+ds_fake_snapd_finalize(GObject *object)
+{
+    DsFakeSnapd *self = DS_FAKE_SNAPD(object);
+
+    if (self->service != NULL) {
+        g_socket_service_stop(self->service);
+        g_socket_listener_close(G_SOCKET_LISTENER(self->service));
+    }
+    if (self->thread != NULL) {
+        g_main_loop_quit(self->loop);
+        g_thread_join(self->thread);
+    }
+    g_clear_object(&self->service);
+    g_clear_pointer(&self->loop, g_main_loop_unref);
+    g_clear_pointer(&self->context, g_main_context_unref);
+    if (self->socket_path != NULL) {
+        g_unlink(self->socket_path);
+    }
+    if (self->socket_dir != NULL) {
+        g_rmdir(self->socket_dir);
+    }
+    g_free(self->socket_path);
+    g_free(self->socket_dir);
+
+    g_mutex_clear(&self->lock);
+    g_clear_pointer(&self->paths, g_hash_table_unref);
+    g_clear_pointer(&self->slots, g_ptr_array_unref);
+    g_clear_pointer(&self->store_snaps, g_hash_table_unref);
+    g_clear_pointer(&self->change_kinds, g_ptr_array_unref);
+    g_clear_pointer(&self->installs, g_ptr_array_unref);
+
+    G_OBJECT_CLASS(ds_fake_snapd_parent_class)->finalize(object);
+}
+
+static void
+ds_fake_snapd_class_init(DsFakeSnapdClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_fake_snapd_finalize;
+}
+
+static void
+ds_fake_snapd_init(DsFakeSnapd *self)
+{
+    g_mutex_init(&self->lock);
+    self->paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)path_config_free);
+    self->slots = g_ptr_array_new_with_free_func((GDestroyNotify)content_slot_free);
+    self->store_snaps = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)store_snap_free);
+    self->change_kinds = g_ptr_array_new_with_free_func(g_free);
+    self->installs = g_ptr_array_new_with_free_func((GDestroyNotify)install_free);
+}
+
+DsFakeSnapd *
+ds_fake_snapd_new(void)
+{
+    return g_object_new(DS_TYPE_FAKE_SNAPD, NULL);
+}
+
+/* Must be called with the lock held */
+static path_config_t *
+get_path_config(DsFakeSnapd *self, const char *path)
+{
+    path_config_t *config = g_hash_table_lookup(self->paths, path);
+
+    if (config == NULL) {
+        config = g_new0(path_config_t, 1);
+        g_hash_table_insert(self->paths, g_strdup(path), config);
+    }
+    return config;
+}
+
+static void
+append_json_string(GString *json, const char *value)
+{
+    g_string_append_c(json, '"');
+    for (const char *c = value; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_string_append_printf(json, "\\%c", *c);
+        } else if ((guchar)*c < 0x20) {
+            g_string_append_printf(json, "\\u%04x", *c);
+        } else {
+            g_string_append_c(json, *c);
+        }
+    }
+    g_string_append_c(json, '"');
+}
+
+static const char *
+get_theme_dir(const char *content)
+{
+    if (g_strcmp0(content, "icon-themes") == 0 || g_strcmp0(content, "cursor-themes") == 0) {
+        return "icons";
+    } else if (g_strcmp0(content, "sound-themes") == 0) {
+        return "sounds";
+    }
+    return "themes";
+}
+
+/* Must be called with the lock held */
+static void
+append_slots(DsFakeSnapd *self, GString *json, const char *snap_name)
+{
+    gboolean first = TRUE;
+
+    g_string_append_c(json, '[');
+    for (guint i = 0; i < self->slots->len; i++) {
+        content_slot_t *slot = self->slots->pdata[i];
+        g_autofree char *slot_name = g_strdup_printf("slot%u", i);
+        g_autofree char *source = NULL;
+
+        if (snap_name != NULL && strcmp(slot->snap_name, snap_name) != 0) {
+            continue;
+        }
+        if (!first) {
+            g_string_append_c(json, ',');
+        }
+        first = FALSE;
+
+        source = g_strdup_printf("$SNAP/share/%s/%s", get_theme_dir(slot->content), slot->theme_name);
+        g_string_append(json, "{\"snap\":");
+        append_json_string(json, slot->snap_name);
+        g_string_append(json, ",\"slot\":");
+        append_json_string(json, slot_name);
+        g_string_append(json, ",\"interface\":\"content\",\"attrs\":{\"content\":");
+        append_json_string(json, slot->content);
+        g_string_append(json, ",\"source\":{\"read\":[");
+        append_json_string(json, source);
+        g_string_append(json, "]}}}");
+    }
+    g_string_append_c(json, ']');
+}
+
+static void
+append_store_snap(GString *json, store_snap_t *snap)
+{
+    g_string_append(json, "{\"name\":");
+    append_json_string(json, snap->snap_name);
+    g_string_append_printf(json,
+                           ",\"id\":\"%s-id\",\"type\":\"app\",\"channel\":\"stable\",\"version\":\"1.0\","
+                           "\"revision\":\"1\",\"confinement\":\"strict\",\"status\":\"available\","
+                           "\"download-size\":%" G_GINT64_FORMAT "}",
+                           snap->snap_name, snap->download_size);
+}
+
+/* Starts installing a snap, returning the ID of its change.  Must be
+ * called with the lock held. */
+static char *
+start_install(DsFakeSnapd *self, const char *snap_name)
+{
+    install_t *install = g_new0(install_t, 1);
+
+    /* IDs follow those of the completed changes */
+    install->change_id = g_strdup_printf("%u", 1000 + self->installs->len);
+    install->snap_name = g_strdup(snap_name);
+    install->start_time = g_get_monotonic_time();
+    install->end_time = install->start_time + self->install_time * G_TIME_SPAN_MILLISECOND;
+    g_ptr_array_add(self->installs, install);
+
+    self->running_installs++;
+    self->max_running_installs = MAX(self->max_running_installs, self->running_installs);
+    return g_strdup(install->change_id);
+}
+
+/* Must be called with the lock held */
+static install_t *
+find_install(DsFakeSnapd *self, const char *change_id)
+{
+    for (guint i = 0; i < self->installs->len; i++) {
+        install_t *install = self->installs->pdata[i];
+
+        if (strcmp(install->change_id, change_id) == 0) {
+            return install;
+        }
+    }
+    return NULL;
+}
+
+/* Describes an install's change, with its download progressing
+ * steadily until it is done.  Must be called with the lock held. */
+static void
+append_install_change(DsFakeSnapd *self, GString *json, install_t *install)
+{
+    g_autofree char *summary = g_strdup_printf("Install \"%s\" snap", install->snap_name);
+    store_snap_t *snap = g_hash_table_lookup(self->store_snaps, install->snap_name);
+    gint64 total = snap != NULL ? snap->download_size : 0;
+    gint64 now = g_get_monotonic_time();
+    gboolean ready = now >= install->end_time;
+    gint64 done = ready ? total : total * (now - install->start_time) / (install->end_time - install->start_time);
+    const char *status = ready ? "Done" : "Doing";
+
+    if (ready && !install->reported) {
+        install->reported = TRUE;
+        self->running_installs--;
+    }
+
+    g_string_append_printf(json, "{\"id\":\"%s\",\"kind\":\"install-snap\",\"summary\":", install->change_id);
+    append_json_string(json, summary);
+    g_string_append_printf(json,
+                           ",\"status\":\"%s\",\"ready\":%s,\"spawn-time\":\"2024-01-01T00:00:00Z\"%s,"
+                           "\"tasks\":[{\"id\":\"%s-1\",\"kind\":\"download-snap\",\"summary\":\"Download\","
+                           "\"status\":\"%s\",\"ready\":%s,\"progress\":{\"label\":\"\",\"done\":%" G_GINT64_FORMAT ","
+                           "\"total\":%" G_GINT64_FORMAT "},\"spawn-time\":\"2024-01-01T00:00:00Z\"}]}",
+                           status, ready ? "true" : "false",
+                           ready ? ",\"ready-time\":\"2024-01-01T00:00:01Z\"" : "",
+                           install->change_id, status, ready ? "true" : "false", done, total);
+}
+
+/* Builds the result of a request, or returns NULL if there is none.
+ * Requests that start a change set change_id instead.  Must be called
+ * with the lock held. */
+static char *
+get_result(DsFakeSnapd *self, const char *method, const char *path, GHashTable *params, guint *status_code, const char **kind, char **change_id)
+{
+    GString *json = g_string_new(NULL);
+
+    if (strcmp(method, "POST") == 0 && g_str_has_prefix(path, "/v2/snaps/")) {
+        *change_id = start_install(self, path + strlen("/v2/snaps/"));
+        *status_code = 202;
+        return g_string_free(json, TRUE);
+    } else if (g_str_has_prefix(path, "/v2/changes/")) {
+        install_t *install = find_install(self, path + strlen("/v2/changes/"));
+
+        if (install == NULL) {
+            *status_code = 404;
+            *kind = NULL;
+            return g_string_free(json, TRUE);
+        }
+        append_install_change(self, json, install);
+    } else if (strcmp(path, "/v2/changes") == 0) {
+        g_string_append_c(json, '[');
+        for (guint i = 0; i < self->change_kinds->len; i++) {
+            g_string_append_printf(json,
+                                   "%s{\"id\":\"%u\",\"kind\":\"%s\",\"summary\":\"\",\"status\":\"Done\",\"ready\":true,"
+                                   "\"spawn-time\":\"2024-01-01T00:00:00Z\",\"ready-time\":\"2024-01-01T00:00:01Z\",\"tasks\":[]}",
+                                   i > 0 ? "," : "", i + 1, (char *)self->change_kinds->pdata[i]);
+        }
+        g_string_append_c(json, ']');
+    } else if (strcmp(path, "/v2/interfaces") == 0) {
+        g_string_append(json, "[{\"name\":\"content\",\"summary\":\"\",\"slots\":");
+        append_slots(self, json, NULL);
+        g_string_append(json, "}]");
+    } else if (strcmp(path, "/v2/connections") == 0) {
+        g_string_append(json, "{\"established\":[],\"plugs\":[],\"undesired\":[],\"slots\":");
+        append_slots(self, json, g_hash_table_lookup(params, "snap"));
+        g_string_append_c(json, '}');
+    } else if (strcmp(path, "/v2/find") == 0 && g_hash_table_contains(params, "name")) {
+        store_snap_t *snap = g_hash_table_lookup(self->store_snaps, g_hash_table_lookup(params, "name"));
+
+        if (snap == NULL) {
+            *status_code = 404;
+            *kind = "snap-not-found";
+            return g_string_free(json, TRUE);
+        }
+        g_string_append_c(json, '[');
+        append_store_snap(json, snap);
+        g_string_append_c(json, ']');
+    } else if (strcmp(path, "/v2/find") == 0) {
+        const char *query = g_hash_table_lookup(params, "q");
+        GHashTableIter iter;
+        store_snap_t *snap;
+        gboolean first = TRUE;
+
+        g_string_append_c(json, '[');
+        g_hash_table_iter_init(&iter, self->store_snaps);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&snap)) {
+            if (query != NULL && strstr(snap->snap_name, query) == NULL) {
+                continue;
+            }
+            if (!first) {
+                g_string_append_c(json, ',');
+            }
+            first = FALSE;
+            append_store_snap(json, snap);
+        }
+        g_string_append_c(json, ']');
+    } else if (strcmp(path, "/v2/notices") == 0) {
+        g_string_append(json, "[]");
+    } else {
+        *status_code = 404;
+        *kind = NULL;
+        return g_string_free(json, TRUE);
+    }
+
+    *status_code = 200;
+    return g_string_free(json, FALSE);
+}
+
+static const char *
+get_reason(guint status_code)
+{
+    switch (status_code) {
+    case 200:
+        return "OK";
+    case 202:
+        return "Accepted";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+/* Answers a request, waiting for the latency configured for its path */
+static char *
+handle_request(DsFakeSnapd *self, const char *method, const char *target)
+{
+    g_autofree char *path = NULL;
+    g_autoptr(GHashTable) params = NULL;
+    g_autofree char *result = NULL;
+    g_autoptr(GString) body = g_string_new(NULL);
+    const char *query = strchr(target, '?');
+    const char *kind = NULL;
+    g_autofree char *message = NULL;
+    g_autofree char *change_id = NULL;
+    guint status_code = 200;
+    guint latency_ms = 0;
+    path_config_t *config, *all;
+
+    path = query != NULL ? g_strndup(target, query - target) : g_strdup(target);
+    params = g_uri_parse_params(query != NULL ? query + 1 : "", -1, "&", G_URI_PARAMS_NONE, NULL);
+    if (params == NULL) {
+        params = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    g_mutex_lock(&self->lock);
+    self->requests++;
+    config = get_path_config(self, path);
+    all = get_path_config(self, "*");
+    config->requests++;
+    latency_ms = config->latency_ms + all->latency_ms;
+    if (config->status_code != 0) {
+        status_code = config->status_code;
+        kind = config->kind;
+        message = g_strdup(config->message);
+    } else {
+        result = get_result(self, method, path, params, &status_code, &kind, &change_id);
+    }
+    if (kind != NULL) {
+        kind = g_intern_string(kind);
+    }
+    g_mutex_unlock(&self->lock);
+
+    /* Long polls time out with no notices */
+    if (strcmp(path, "/v2/notices") == 0 && result != NULL && g_hash_table_contains(params, "timeout")) {
+        latency_ms += NOTICES_HOLD;
+    }
+    if (latency_ms > 0) {
+        g_usleep(latency_ms * 1000);
+    }
+
+    if (change_id != NULL) {
+        g_string_append_printf(body, "{\"type\":\"async\",\"status-code\":202,\"status\":\"Accepted\",\"result\":null,\"change\":\"%s\"}", change_id);
+    } else if (result != NULL) {
+        g_string_append_printf(body, "{\"type\":\"sync\",\"status-code\":200,\"status\":\"OK\",\"result\":%s}", result);
+    } else {
+        g_string_append_printf(body, "{\"type\":\"error\",\"status-code\":%u,\"status\":\"%s\",\"result\":{\"message\":",
+                               status_code, get_reason(status_code));
+        append_json_string(body, message != NULL ? message : "injected error");
+        if (kind != NULL) {
+            g_string_append(body, ",\"kind\":");
+            append_json_string(body, kind);
+        }
+        g_string_append(body, "}}");
+    }
+
+    return g_strdup_printf("HTTP/1.1 %u %s\r\nContent-Type: application/json\r\nContent-Length: %" G_GSIZE_FORMAT "\r\n\r\n%s",
+                           status_code, get_reason(status_code), body->len, body->str);
+}
+
+/* Serves requests on a connection until the client closes it.  Runs on
+ * a thread of the service's pool. */
+static gboolean
+run_cb(GThreadedSocketService *service, GSocketConnection *connection, GObject *source_object, DsFakeSnapd *self)
+{
+    g_autoptr(GDataInputStream) input = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    GOutputStream *output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+    g_data_input_stream_set_newline_type(input, G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+    g_filter_input_stream_set_close_base_stream(G_FILTER_INPUT_STREAM(input), FALSE);
+
+    while (TRUE) {
+        g_autofree char *request_line = g_data_input_stream_read_line(input, NULL, NULL, NULL);
+        g_auto(GStrv) fields = NULL;
+        g_autofree char *response = NULL;
+        gsize content_length = 0;
+
+        if (request_line == NULL) {
+            return FALSE;
+        }
+        fields = g_strsplit(request_line, " ", 3);
+        if (g_strv_length(fields) != 3) {
+            return FALSE;
+        }
+
+        while (TRUE) {
+            g_autofree char *header = g_data_input_stream_read_line(input, NULL, NULL, NULL);
+
+            if (header == NULL) {
+                return FALSE;
+            }
+            if (header[0] == '\0') {
+                break;
+            }
+            if (g_ascii_strncasecmp(header, "Content-Length:", 15) == 0) {
+                content_length = g_ascii_strtoull(header + 15, NULL, 10);
+            }
+        }
+        if (content_length > 0 &&
+            g_input_stream_skip(G_INPUT_STREAM(input), content_length, NULL, NULL) != (gssize)content_length) {
+            return FALSE;
+        }
+
+        response = handle_request(self, fields[0], fields[1]);
+        if (!g_output_stream_write_all(output, response, strlen(response), NULL, NULL, NULL)) {
+            return FALSE;
+        }
+    }
+}
+
+static gpointer
+server_thread(DsFakeSnapd *self)
+{
+    g_main_context_push_thread_default(self->context);
+    g_main_loop_run(self->loop);
+    g_main_context_pop_thread_default(self->context);
+    return NULL;
+}
+
+/* Listens on a new socket in a temporary directory, and serves requests
+ * on a thread of its own, so it doesn't wait for the caller's main loop */
+gboolean
+ds_fake_snapd_start(DsFakeSnapd *self, GError **error)
+{
+    g_autoptr(GSocketAddress) address = NULL;
+
+    g_return_val_if_fail(self->service == NULL, FALSE);
+
+    self->socket_dir = g_dir_make_tmp("fake-snapd-XXXXXX", error);
+    if (self->socket_dir == NULL) {
+        return FALSE;
+    }
+    self->socket_path = g_build_filename(self->socket_dir, "snapd.socket", NULL);
+    address = g_unix_socket_address_new(self->socket_path);
+
+    /* Accepts are dispatched to the server thread's context */
+    self->context = g_main_context_new();
+    self->loop = g_main_loop_new(self->context, FALSE);
+    g_main_context_push_thread_default(self->context);
+    self->service = g_threaded_socket_service_new(-1);
+    g_signal_connect(self->service, "run", G_CALLBACK(run_cb), self);
+    if (!g_socket_listener_add_address(G_SOCKET_LISTENER(self->service), address,
+                                       G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                       NULL, NULL, error)) {
+        g_main_context_pop_thread_default(self->context);
+        return FALSE;
+    }
+    g_socket_service_start(self->service);
+    g_main_context_pop_thread_default(self->context);
+
+    self->thread = g_thread_new("fake-snapd", (GThreadFunc)server_thread, self);
+    return TRUE;
+}
+
+const char *
+ds_fake_snapd_get_socket_path(DsFakeSnapd *self)
+{
+    return self->socket_path;
+}
+
+/* Adds a content interface slot sharing a theme, such as
+ * ("gnome-themes", "gtk-3-themes", "Adwaita") */
+void
+ds_fake_snapd_add_content_slot(DsFakeSnapd *self, const char *snap_name, const char *content, const char *theme_name)
+{
+    content_slot_t *slot = g_new0(content_slot_t, 1);
+
+    slot->snap_name = g_strdup(snap_name);
+    slot->content = g_strdup(content);
+    slot->theme_name = g_strdup(theme_name);
+    g_mutex_lock(&self->lock);
+    g_ptr_array_add(self->slots, slot);
+    g_mutex_unlock(&self->lock);
+}
+
+/* Adds a snap to the store, on the stable channel */
+void
+ds_fake_snapd_add_store_snap(DsFakeSnapd *self, const char *snap_name, gint64 download_size)
+{
+    store_snap_t *snap = g_new0(store_snap_t, 1);
+
+    snap->snap_name = g_strdup(snap_name);
+    snap->download_size = download_size;
+    g_mutex_lock(&self->lock);
+    g_hash_table_replace(self->store_snaps, snap->snap_name, snap);
+    g_mutex_unlock(&self->lock);
+}
+
+/* Adds a completed change, which changes snapd's state revision */
+void
+ds_fake_snapd_add_change(DsFakeSnapd *self, const char *kind)
+{
+    g_mutex_lock(&self->lock);
+    g_ptr_array_add(self->change_kinds, g_strdup(kind));
+    g_mutex_unlock(&self->lock);
+}
+
+/* Delays the responses to requests for path, such as "/v2/find", or to
+ * every request if path is NULL */
+void
+ds_fake_snapd_set_latency(DsFakeSnapd *self, const char *path, guint latency_ms)
+{
+    g_mutex_lock(&self->lock);
+    get_path_config(self, path != NULL ? path : "*")->latency_ms = latency_ms;
+    g_mutex_unlock(&self->lock);
+}
+
+/* Answers requests for path with an error, or normally again if
+ * status_code is 0.  kind is a snapd error kind, and may be NULL. */
+void
+ds_fake_snapd_set_error(DsFakeSnapd *self, const char *path, guint status_code, const char *kind, const char *message)
+{
+    path_config_t *config;
+
+    g_mutex_lock(&self->lock);
+    config = get_path_config(self, path);
+    config->status_code = status_code;
+    g_free(config->kind);
+    config->kind = g_strdup(kind);
+    g_free(config->message);
+    config->message = g_strdup(message);
+    g_mutex_unlock(&self->lock);
+}
+
+/* Returns how many requests for path have been answered, or for any
+ * path if it is NULL */
+guint
+ds_fake_snapd_get_requests(DsFakeSnapd *self, const char *path)
+{
+    path_config_t *config;
+    guint requests;
+
+    g_mutex_lock(&self->lock);
+    if (path == NULL) {
+        requests = self->requests;
+    } else {
+        config = g_hash_table_lookup(self->paths, path);
+        requests = config != NULL ? config->requests : 0;
+    }
+    g_mutex_unlock(&self->lock);
+    return requests;
+}
+
+/* Sets how long installs take, from being started until their change
+ * is done */
+void
+ds_fake_snapd_set_install_time(DsFakeSnapd *self, guint install_ms)
+{
+    g_mutex_lock(&self->lock);
+    self->install_time = install_ms;
+    g_mutex_unlock(&self->lock);
+}
+
+/* Returns the names of the snaps installed, in the order they were
+ * started */
+GPtrArray *
+ds_fake_snapd_get_installs(DsFakeSnapd *self)
+{
+    GPtrArray *snap_names = g_ptr_array_new_with_free_func(g_free);
+
+    g_mutex_lock(&self->lock);
+    for (guint i = 0; i < self->installs->len; i++) {
+        install_t *install = self->installs->pdata[i];
+
+        g_ptr_array_add(snap_names, g_strdup(install->snap_name));
+    }
+    g_mutex_unlock(&self->lock);
+    return snap_names;
+}
+
+/* Returns the most installs that have run at once since the last call.
+ * An install runs until the client is told its change is done. */
+guint
+ds_fake_snapd_take_max_running_installs(DsFakeSnapd *self)
+{
+    guint max_running_installs;
+
+    g_mutex_lock(&self->lock);
+    max_running_installs = self->max_running_installs;
+    self->max_running_installs = self->running_installs;
+    g_mutex_unlock(&self->lock);
+    return max_running_installs;
+}
+
+/* Returns how many installs are running */
+guint
+ds_fake_snapd_get_running_installs(DsFakeSnapd *self)
+{
+    guint running_installs;
+
+    g_mutex_lock(&self->lock);
+    running_installs = self->running_installs;
+    g_mutex_unlock(&self->lock);
+    return running_installs;
+}
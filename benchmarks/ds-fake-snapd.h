@@ -0,0 +1,29 @@
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define DS_TYPE_FAKE_SNAPD (ds_fake_snapd_get_type())
+G_DECLARE_FINAL_TYPE(DsFakeSnapd, ds_fake_snapd, DS, FAKE_SNAPD, GObject);
+
+DsFakeSnapd *ds_fake_snapd_new(void);
+
+gboolean ds_fake_snapd_start(DsFakeSnapd *self, GError **error);
+const char *ds_fake_snapd_get_socket_path(DsFakeSnapd *self);
+
+void ds_fake_snapd_add_content_slot(DsFakeSnapd *self, const char *snap_name, const char *content, const char *theme_name);
+void ds_fake_snapd_add_store_snap(DsFakeSnapd *self, const char *snap_name, gint64 download_size);
+void ds_fake_snapd_add_change(DsFakeSnapd *self, const char *kind);
+
+void ds_fake_snapd_set_latency(DsFakeSnapd *self, const char *path, guint latency_ms);
+void ds_fake_snapd_set_error(DsFakeSnapd *self, const char *path, guint status_code, const char *kind, const char *message);
+
+guint ds_fake_snapd_get_requests(DsFakeSnapd *self, const char *path);
+
+void ds_fake_snapd_set_install_time(DsFakeSnapd *self, guint install_ms);
+GPtrArray *ds_fake_snapd_get_installs(DsFakeSnapd *self);
+guint ds_fake_snapd_take_max_running_installs(DsFakeSnapd *self);
+guint ds_fake_snapd_get_running_installs(DsFakeSnapd *self);
+
+G_END_DECLS
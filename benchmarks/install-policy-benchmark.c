@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <glib/gstdio.h>
+#include <snapd-glib/snapd-glib.h>
+
+#include "ds-fake-network-monitor.h"
+#include "ds-fake-snapd.h"
+#include "ds-snapd-helper.h"
+
+/* Checks how the helper schedules installs against a fake snapd and a
+ * fake network: which installs wait for a better network, the order
+ * they start in and how many run at once.  Exits with an error if the
+ * policy isn't followed, and reports how long each phase took. */
+
+/* How long each install takes in the fake snapd, in milliseconds */
+#define INSTALL_TIME 100
+
+/* The helper's limits on installs running at once */
+#define MAX_INSTALLS 2
+#define MAX_METERED_INSTALLS 1
+
+/* How long nothing must happen for the remaining installs to be taken
+ * as deferred, in milliseconds */
+#define SETTLE_TIME 1000
+
+/* How often the fake snapd is checked for activity, in milliseconds */
+#define POLL_INTERVAL 10
+
+#define MB (1000 * 1000)
+
+/* The store knows the size, but the snap passed to the helper doesn't,
+ * as with those from the broker before it carried sizes */
+#define UNKNOWN_SIZE 0
+
+#define MAX_SNAPS 8
+
+typedef struct {
+    const char *name;
+    gint64 download_size;
+} install_snap_t;
+
+typedef struct {
+    const char *name;
+    /* The network the installs are made on */
+    gboolean available;
+    gboolean metered;
+    /* Passed to the helper in reverse, so it has to order them */
+    install_snap_t snaps[MAX_SNAPS];
+    /* Snaps expected to be installed on that network, in order */
+    const char *installed[MAX_SNAPS];
+    /* Snaps expected to wait until the network is available and
+     * unmetered, in the order they are then installed */
+    const char *deferred[MAX_SNAPS];
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {
+        "unmetered",
+        TRUE, FALSE,
+        { { "gtk-theme-big", 300 * MB }, { "gtk-theme-small", 5 * MB }, { "icon-theme-a", 20 * MB },
+          { "icon-theme-unknown", UNKNOWN_SIZE }, { "sound-theme-a", 1 * MB }, { "other-theme", 2 * MB } },
+        { "gtk-theme-small", "gtk-theme-big", "icon-theme-a", "icon-theme-unknown", "sound-theme-a", "other-theme" },
+        { NULL },
+    },
+    {
+        "metered",
+        TRUE, TRUE,
+        { { "gtk-theme-big", 300 * MB }, { "gtk-theme-unknown", UNKNOWN_SIZE }, { "gtk-theme-small", 5 * MB },
+          { "icon-theme-a", 20 * MB }, { "sound-theme-big", 80 * MB }, { "sound-theme-unknown", UNKNOWN_SIZE } },
+        /* Unknown sizes go once nothing known to be small is left */
+        { "gtk-theme-small", "icon-theme-a", "gtk-theme-unknown", "sound-theme-unknown" },
+        { "gtk-theme-big", "sound-theme-big" },
+    },
+    {
+        "metered, sizes unknown",
+        TRUE, TRUE,
+        { { "gtk-theme-a", UNKNOWN_SIZE }, { "icon-theme-a", UNKNOWN_SIZE }, { "sound-theme-a", UNKNOWN_SIZE } },
+        { "gtk-theme-a", "icon-theme-a", "sound-theme-a" },
+        { NULL },
+    },
+    {
+        "offline",
+        FALSE, FALSE,
+        { { "gtk-theme-a", 5 * MB }, { "icon-theme-a", 20 * MB }, { "sound-theme-a", 1 * MB } },
+        { NULL },
+        { "gtk-theme-a", "icon-theme-a", "sound-theme-a" },
+    },
+};
+
+typedef struct {
+    DsFakeSnapd *snapd;
+    GMainLoop *loop;
+    gboolean done;
+    gboolean failed;
+    /* When the installs last changed */
+    guint n_installs;
+    guint running_installs;
+    gint64 last_activity_time;
+} run_t;
+
+static void
+install_done_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    run_t *run = user_data;
+    g_autoptr(GError) error = NULL;
+
+    if (!ds_snapd_helper_install_snaps_finish(DS_SNAPD_HELPER(object), result, &error)) {
+        g_printerr("Install failed: %s\n", error->message);
+        run->failed = TRUE;
+    }
+    run->done = TRUE;
+    run->last_activity_time = g_get_monotonic_time();
+}
+
+/* Stops the loop once the installs complete, or nothing has happened
+ * for SETTLE_TIME */
+static gboolean
+poll_cb(run_t *run)
+{
+    g_autoptr(GPtrArray) installs = ds_fake_snapd_get_installs(run->snapd);
+    guint running_installs = ds_fake_snapd_get_running_installs(run->snapd);
+    gint64 now = g_get_monotonic_time();
+
+    if (installs->len != run->n_installs || running_installs != run->running_installs) {
+        run->n_installs = installs->len;
+        run->running_installs = running_installs;
+        run->last_activity_time = now;
+    }
+    if (run->done || (running_installs == 0 && now - run->last_activity_time >= SETTLE_TIME * G_TIME_SPAN_MILLISECOND)) {
+        g_main_loop_quit(run->loop);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/* Runs the main loop until the installs complete or are deferred,
+ * returning how long they took in microseconds */
+static gint64
+run_installs(run_t *run)
+{
+    gint64 start_time = g_get_monotonic_time();
+    guint poll_id;
+
+    run->last_activity_time = start_time;
+    poll_id = g_timeout_add(POLL_INTERVAL, G_SOURCE_FUNC(poll_cb), run);
+    g_main_loop_run(run->loop);
+    g_source_remove(poll_id);
+    return run->last_activity_time - start_time;
+}
+
+static guint
+count_snaps(const char *const *names)
+{
+    guint n_snaps = 0;
+
+    while (n_snaps < MAX_SNAPS && names[n_snaps] != NULL) {
+        n_snaps++;
+    }
+    return n_snaps;
+}
+
+/* Checks the snaps installed from offset on are those expected, in
+ * order */
+static gboolean
+check_installs(const scenario_t *scenario, const char *phase, GPtrArray *installs, guint offset, const char *const *expected)
+{
+    guint n_expected = count_snaps(expected);
+
+    if (installs->len != offset + n_expected) {
+        g_printerr("%s: %u snaps installed %s, expected %u\n",
+                   scenario->name, installs->len - offset, phase, n_expected);
+        return FALSE;
+    }
+    for (guint i = 0; i < n_expected; i++) {
+        const char *name = installs->pdata[offset + i];
+
+        if (g_strcmp0(name, expected[i]) != 0) {
+            g_printerr("%s: install %u %s was %s, expected %s\n", scenario->name, i + 1, phase, name, expected[i]);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean
+check_max_running(const scenario_t *scenario, const char *phase, guint max_running, guint max_allowed)
+{
+    if (max_running > max_allowed) {
+        g_printerr("%s: %u installs ran at once %s, at most %u allowed\n", scenario->name, max_running, phase, max_allowed);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+remove_caches(void)
+{
+    g_autofree char *cache_dir = g_build_filename(g_get_user_cache_dir(), "snapd-desktop-integration", NULL);
+    g_autoptr(GDir) dir = g_dir_open(cache_dir, 0, NULL);
+    const char *name;
+
+    while (dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+        g_autofree char *path = g_build_filename(cache_dir, name, NULL);
+        g_unlink(path);
+    }
+}
+
+static gboolean
+run_scenario(const scenario_t *scenario)
+{
+    g_autoptr(DsFakeSnapd) snapd = ds_fake_snapd_new();
+    g_autoptr(DsFakeNetworkMonitor) monitor = ds_fake_network_monitor_new(scenario->available, scenario->metered);
+    g_autoptr(GMainLoop) loop = g_main_loop_new(NULL, FALSE);
+    g_autoptr(SnapdClient) client = snapd_client_new();
+    g_autoptr(DsSnapdHelper) helper = NULL;
+    g_autoptr(GPtrArray) snaps = g_ptr_array_new_with_free_func(g_object_unref);
+    g_autoptr(GPtrArray) installs = NULL;
+    g_autoptr(GError) error = NULL;
+    guint n_snaps = 0;
+    guint n_installed = count_snaps(scenario->installed);
+    guint n_deferred = count_snaps(scenario->deferred);
+    guint max_running, deferred_max_running = 0;
+    gint64 elapsed, deferred_elapsed = 0;
+    run_t run = { 0 };
+
+    if (!ds_fake_snapd_start(snapd, &error)) {
+        g_printerr("Could not start fake snapd: %s\n", error->message);
+        return FALSE;
+    }
+    ds_fake_snapd_set_error(snapd, "/v2/notices", 400, NULL, "notices are not supported");
+    ds_fake_snapd_set_install_time(snapd, INSTALL_TIME);
+    while (n_snaps < MAX_SNAPS && scenario->snaps[n_snaps].name != NULL) {
+        const install_snap_t *snap = &scenario->snaps[n_snaps];
+
+        ds_fake_snapd_add_store_snap(snapd, snap->name, snap->download_size != UNKNOWN_SIZE ? snap->download_size : 10 * MB);
+        n_snaps++;
+    }
+    for (guint i = n_snaps; i > 0; i--) {
+        const install_snap_t *snap = &scenario->snaps[i - 1];
+
+        g_ptr_array_add(snaps, g_object_new(SNAPD_TYPE_SNAP, "name", snap->name, "download-size", snap->download_size, NULL));
+    }
+
+    remove_caches();
+    snapd_client_set_socket_path(client, ds_fake_snapd_get_socket_path(snapd));
+    helper = g_object_new(DS_TYPE_SNAPD_HELPER, "client", client, "network-monitor", monitor, NULL);
+    run.snapd = snapd;
+    run.loop = loop;
+
+    ds_snapd_helper_install_snaps(helper, snaps, NULL, NULL, NULL, install_done_cb, &run);
+    elapsed = run_installs(&run);
+    installs = ds_fake_snapd_get_installs(snapd);
+    max_running = ds_fake_snapd_take_max_running_installs(snapd);
+    if (!check_installs(scenario, "at first", installs, 0, scenario->installed) ||
+        !check_max_running(scenario, "at first", max_running, scenario->metered ? MAX_METERED_INSTALLS : MAX_INSTALLS)) {
+        return FALSE;
+    }
+    if (run.done != (n_deferred == 0)) {
+        g_printerr("%s: installs %s, expected %u deferred\n", scenario->name, run.done ? "completed" : "deferred", n_deferred);
+        return FALSE;
+    }
+
+    if (n_deferred > 0) {
+        ds_fake_network_monitor_set_network(monitor, TRUE, FALSE);
+        deferred_elapsed = run_installs(&run);
+        g_clear_pointer(&installs, g_ptr_array_unref);
+        installs = ds_fake_snapd_get_installs(snapd);
+        deferred_max_running = ds_fake_snapd_take_max_running_installs(snapd);
+        if (!check_installs(scenario, "once unmetered", installs, n_installed, scenario->deferred) ||
+            !check_max_running(scenario, "once unmetered", deferred_max_running, MAX_INSTALLS)) {
+            return FALSE;
+        }
+        if (!run.done) {
+            g_printerr("%s: deferred installs didn't complete\n", scenario->name);
+            return FALSE;
+        }
+    }
+    if (run.failed) {
+        return FALSE;
+    }
+
+    g_print("%-25s %u installed in %7.1f ms, at most %u at once  %u deferred, installed in %7.1f ms, at most %u at once\n",
+            scenario->name, n_installed, elapsed / 1000.0, max_running,
+            n_deferred, deferred_elapsed / 1000.0, deferred_max_running);
+    return TRUE;
+}
+
+int
+main(int argc, char **argv)
+{
+    g_autofree char *cache_dir = NULL;
+    g_autofree char *helper_cache_dir = NULL;
+
+    /* Keep the helper's caches away from the user's */
+    cache_dir = g_dir_make_tmp("install-policy-benchmark-XXXXXX", NULL);
+    if (cache_dir == NULL) {
+        g_printerr("Could not create cache directory\n");
+        return 1;
+    }
+    g_setenv("XDG_CACHE_HOME", cache_dir, TRUE);
+    helper_cache_dir = g_build_filename(cache_dir, "snapd-desktop-integration", NULL);
+
+    for (guint i = 0; i < G_N_ELEMENTS(scenarios); i++) {
+        if (!run_scenario(&scenarios[i])) {
+            return 1;
+        }
+    }
+
+    remove_caches();
+    g_rmdir(helper_cache_dir);
+    g_rmdir(cache_dir);
+    return 0;
+}
@@ -0,0 +1,423 @@
+#include <math.h>
+#include <stdio.h>
+#include <glib/gstdio.h>
+#include <snapd-glib/snapd-glib.h>
+
+#include "ds-fake-snapd.h"
+#include "ds-snapd-helper.h"
+#include "ds-theme-watcher.h"
+
+/* Measures how long a theme change takes to be checked, from the
+ * settings notify to the missing snaps being known, against a fake
+ * snapd.  Each iteration uses a new helper with empty caches.  The
+ * longest the main loop goes without dispatching during the check is
+ * reported as its stall time. */
+
+#define DEFAULT_ITERATIONS 20
+
+/* How often the main loop is probed for stalls, in milliseconds */
+#define STALL_PROBE_INTERVAL 1
+
+/* Stands in for GtkSettings, which the watcher only uses through these
+ * properties, so the benchmark doesn't need a display */
+#define DS_TYPE_BENCH_SETTINGS (ds_bench_settings_get_type())
+G_DECLARE_FINAL_TYPE(DsBenchSettings, ds_bench_settings, DS, BENCH_SETTINGS, GObject);
+
+struct _DsBenchSettings {
+    GObject parent;
+
+    char *names[DS_THEME_COMPONENT_LAST];
+};
+
+G_DEFINE_TYPE(DsBenchSettings, ds_bench_settings, G_TYPE_OBJECT);
+
+static const char *settings_properties[DS_THEME_COMPONENT_LAST] = {
+    [DS_THEME_COMPONENT_GTK] = "gtk-theme-name",
+    [DS_THEME_COMPONENT_ICON] = "gtk-icon-theme-name",
+    [DS_THEME_COMPONENT_CURSOR] = "gtk-cursor-theme-name",
+    [DS_THEME_COMPONENT_SOUND] = "gtk-sound-theme-name",
+};
+
+static void
+ds_bench_settings_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    DsBenchSettings *self = DS_BENCH_SETTINGS(object);
+
+    g_value_set_string(value, self->names[prop_id - 1]);
+}
+
+static void
+ds_bench_settings_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+    DsBenchSettings *self = DS_BENCH_SETTINGS(object);
+
+    g_free(self->names[prop_id - 1]);
+    self->names[prop_id - 1] = g_value_dup_string(value);
+}
+
+static void
+ds_bench_settings_finalize(GObject *object)
+{
+    DsBenchSettings *self = DS_BENCH_SETTINGS(object);
+
+    for (int i = 0; i < DS_THEME_COMPONENT_LAST; i++) {
+        g_free(self->names[i]);
+    }
+    G_OBJECT_CLASS(ds_bench_settings_parent_class)->finalize(object);
+}
+
+static void
+ds_bench_settings_class_init(DsBenchSettingsClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_bench_settings_finalize;
+    gobject_class->get_property = ds_bench_settings_get_property;
+    gobject_class->set_property = ds_bench_settings_set_property;
+
+    for (int i = 0; i < DS_THEME_COMPONENT_LAST; i++) {
+        g_object_class_install_property(
+            gobject_class, i + 1,
+            g_param_spec_string(settings_properties[i], NULL, NULL, NULL, G_PARAM_READWRITE));
+    }
+}
+
+static void
+ds_bench_settings_init(DsBenchSettings *self)
+{
+}
+
+static void
+set_themes(GObject *settings, const char *const *names)
+{
+    g_object_set(settings,
+                 settings_properties[DS_THEME_COMPONENT_GTK], names[DS_THEME_COMPONENT_GTK],
+                 settings_properties[DS_THEME_COMPONENT_ICON], names[DS_THEME_COMPONENT_ICON],
+                 settings_properties[DS_THEME_COMPONENT_CURSOR], names[DS_THEME_COMPONENT_CURSOR],
+                 settings_properties[DS_THEME_COMPONENT_SOUND], names[DS_THEME_COMPONENT_SOUND],
+                 NULL);
+}
+
+typedef struct {
+    const char *name;
+    void (*setup)(DsFakeSnapd *snapd);
+    /* Themes in use before and after the measured change */
+    const char *before[DS_THEME_COMPONENT_LAST];
+    const char *after[DS_THEME_COMPONENT_LAST];
+    /* Whether snapd's state changes before the measured change, so the
+     * installed themes have to be indexed again */
+    gboolean stale_index;
+} scenario_t;
+
+static void
+add_content_slots(DsFakeSnapd *snapd, guint n_slots)
+{
+    static const char *contents[] = { "gtk-3-themes", "icon-themes", "sound-themes", "cursor-themes" };
+
+    for (guint i = 0; i < n_slots; i++) {
+        g_autofree char *snap_name = g_strdup_printf("theme-snap-%u", i / G_N_ELEMENTS(contents));
+        g_autofree char *theme_name = g_strdup_printf("Theme%u", i / G_N_ELEMENTS(contents));
+
+        ds_fake_snapd_add_content_slot(snapd, snap_name, contents[i % G_N_ELEMENTS(contents)], theme_name);
+    }
+}
+
+/* Notices aren't available, so the installed themes are checked with
+ * snapd on every theme change, as with older snapd releases */
+static void
+disable_notices(DsFakeSnapd *snapd)
+{
+    ds_fake_snapd_set_error(snapd, "/v2/notices", 400, NULL, "notices are not supported");
+    ds_fake_snapd_add_change(snapd, "install-snap");
+}
+
+static void
+setup_many_slots(DsFakeSnapd *snapd)
+{
+    disable_notices(snapd);
+    add_content_slots(snapd, 1000);
+}
+
+static void
+setup_huge_system(DsFakeSnapd *snapd)
+{
+    disable_notices(snapd);
+    add_content_slots(snapd, 5000);
+}
+
+static void
+setup_deep_chain(DsFakeSnapd *snapd)
+{
+    disable_notices(snapd);
+    add_content_slots(snapd, 8);
+    /* Only the least specific candidate is in the store */
+    ds_fake_snapd_add_store_snap(snapd, "gtk-theme-deep", 5 * 1000 * 1000);
+    ds_fake_snapd_add_store_snap(snapd, "icon-theme-deep", 20 * 1000 * 1000);
+    ds_fake_snapd_add_store_snap(snapd, "sound-theme-deep", 1000 * 1000);
+    ds_fake_snapd_set_latency(snapd, "/v2/find", 20);
+}
+
+static const scenario_t scenarios[] = {
+    {
+        "1000 content slots",
+        setup_many_slots,
+        { "Theme0", "Theme0", "Theme0", "Theme0" },
+        { "Theme1", "Theme1", "Theme1", "Theme1" },
+        TRUE,
+    },
+    {
+        "5000 content slots",
+        setup_huge_system,
+        { "Theme0", "Theme0", "Theme0", "Theme0" },
+        { "Theme1", "Theme1", "Theme1", "Theme1" },
+        TRUE,
+    },
+    {
+        "all four themes missing, deep shorten chain",
+        setup_deep_chain,
+        { "Theme0", "Theme0", "Theme0", "Theme0" },
+        { "Deep-Chain-Theme-Name-Variant-Dark", "Deep-Chain-Icons-Name-Variant-Dark",
+          "Deep-Chain-Cursor-Name-Variant-Dark", "Deep-Chain-Sounds-Name-Variant-Dark" },
+        FALSE,
+    },
+};
+
+typedef struct {
+    DsSnapdHelper *helper;
+    GMainLoop *loop;
+    /* Set when a check of the themes being waited for completes */
+    const char *wait_gtk_theme;
+    gboolean done;
+    gboolean failed;
+} iteration_t;
+
+static void
+check_done_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    iteration_t *iteration = user_data;
+    g_autoptr(GPtrArray) missing_snaps = NULL;
+    g_autoptr(GError) error = NULL;
+
+    missing_snaps = ds_snapd_helper_find_missing_snaps_finish(DS_SNAPD_HELPER(object), result, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    if (missing_snaps == NULL) {
+        g_printerr("Check failed: %s\n", error->message);
+        iteration->failed = TRUE;
+    }
+    iteration->done = TRUE;
+    g_main_loop_quit(iteration->loop);
+}
+
+static void
+theme_changed_cb(DsThemeWatcher *watcher, const DsThemeSet *themes, guint changed, iteration_t *iteration)
+{
+    if (g_strcmp0(themes->gtk_theme_name, iteration->wait_gtk_theme) != 0) {
+        return;
+    }
+    ds_snapd_helper_find_missing_snaps(iteration->helper, themes, changed, ds_theme_watcher_get_trace_id(watcher),
+                                       NULL, check_done_cb, iteration);
+}
+
+typedef struct {
+    GMainLoop *loop;
+    guint timeout_id;
+} wait_t;
+
+static gboolean
+timeout_cb(wait_t *wait)
+{
+    wait->timeout_id = 0;
+    g_main_loop_quit(wait->loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs the main loop for a while, or until the check completes */
+static void
+run_loop(GMainLoop *loop, guint timeout_ms)
+{
+    wait_t wait = { loop, 0 };
+
+    wait.timeout_id = g_timeout_add(timeout_ms, G_SOURCE_FUNC(timeout_cb), &wait);
+    g_main_loop_run(loop);
+    g_clear_handle_id(&wait.timeout_id, g_source_remove);
+}
+
+typedef struct {
+    gint64 last_time;
+    gint64 max_gap;
+} stall_probe_t;
+
+static gboolean
+stall_probe_cb(stall_probe_t *probe)
+{
+    gint64 now = g_get_monotonic_time();
+
+    probe->max_gap = MAX(probe->max_gap, now - probe->last_time);
+    probe->last_time = now;
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+remove_caches(void)
+{
+    g_autofree char *cache_dir = g_build_filename(g_get_user_cache_dir(), "snapd-desktop-integration", NULL);
+    g_autoptr(GDir) dir = g_dir_open(cache_dir, 0, NULL);
+    const char *name;
+
+    while (dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+        g_autofree char *path = g_build_filename(cache_dir, name, NULL);
+        g_unlink(path);
+    }
+}
+
+/* Measures one theme change, returning the latency in microseconds, or
+ * -1 if the check failed.  requests is set to the number of snapd
+ * requests the check made, other than for notices, and stall to the
+ * longest the main loop was blocked during it in microseconds. */
+static gint64
+run_iteration(DsFakeSnapd *snapd, const scenario_t *scenario, guint *requests, gint64 *stall)
+{
+    g_autoptr(GMainLoop) loop = g_main_loop_new(NULL, FALSE);
+    g_autoptr(SnapdClient) client = snapd_client_new();
+    g_autoptr(DsSnapdHelper) helper = NULL;
+    g_autoptr(GObject) settings = g_object_new(DS_TYPE_BENCH_SETTINGS, NULL);
+    g_autoptr(DsThemeWatcher) watcher = NULL;
+    iteration_t iteration = { 0 };
+    stall_probe_t probe = { 0 };
+    guint probe_id;
+    guint notify_timeout;
+    guint start_requests;
+    gint64 start_time;
+
+    remove_caches();
+    snapd_client_set_socket_path(client, ds_fake_snapd_get_socket_path(snapd));
+    helper = ds_snapd_helper_new(client);
+    iteration.helper = helper;
+    iteration.loop = loop;
+
+    /* Settle on the initial themes */
+    set_themes(settings, scenario->before);
+    iteration.wait_gtk_theme = scenario->before[DS_THEME_COMPONENT_GTK];
+    watcher = ds_theme_watcher_new(settings);
+    g_signal_connect(watcher, "theme-changed", G_CALLBACK(theme_changed_cb), &iteration);
+    run_loop(loop, 10000);
+    if (!iteration.done || iteration.failed) {
+        return -1;
+    }
+    if (scenario->stale_index) {
+        ds_fake_snapd_add_change(snapd, "install-snap");
+    }
+
+    /* Wait until the change is treated as isolated, as a user picking a
+     * new theme would be */
+    g_object_get(watcher, "notify-timeout", &notify_timeout, NULL);
+    run_loop(loop, notify_timeout + 50);
+
+    iteration.done = FALSE;
+    iteration.wait_gtk_theme = scenario->after[DS_THEME_COMPONENT_GTK];
+    start_requests = ds_fake_snapd_get_requests(snapd, NULL) - ds_fake_snapd_get_requests(snapd, "/v2/notices");
+    start_time = g_get_monotonic_time();
+    probe.last_time = start_time;
+    probe_id = g_timeout_add_full(G_PRIORITY_HIGH, STALL_PROBE_INTERVAL,
+                                  G_SOURCE_FUNC(stall_probe_cb), &probe, NULL);
+    set_themes(settings, scenario->after);
+    run_loop(loop, 30000);
+    g_source_remove(probe_id);
+    if (!iteration.done || iteration.failed) {
+        return -1;
+    }
+    *requests = ds_fake_snapd_get_requests(snapd, NULL) - ds_fake_snapd_get_requests(snapd, "/v2/notices") - start_requests;
+    stall_probe_cb(&probe);
+    *stall = MAX(probe.max_gap - STALL_PROBE_INTERVAL * G_TIME_SPAN_MILLISECOND, 0);
+    return g_get_monotonic_time() - start_time;
+}
+
+static int
+compare_latencies(gconstpointer a, gconstpointer b)
+{
+    gint64 latency_a = *(const gint64 *)a, latency_b = *(const gint64 *)b;
+
+    return latency_a < latency_b ? -1 : latency_a > latency_b ? 1 : 0;
+}
+
+/* Nearest rank percentile of sorted latencies */
+static double
+get_percentile(GArray *latencies, double percentile)
+{
+    guint rank = (guint)ceil(percentile / 100.0 * latencies->len);
+
+    return g_array_index(latencies, gint64, MAX(rank, 1) - 1) / 1000.0;
+}
+
+static gboolean
+run_scenario(const scenario_t *scenario, guint iterations)
+{
+    g_autoptr(DsFakeSnapd) snapd = ds_fake_snapd_new();
+    g_autoptr(GArray) latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_autoptr(GArray) stalls = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_autoptr(GError) error = NULL;
+    guint total_requests = 0;
+
+    if (!ds_fake_snapd_start(snapd, &error)) {
+        g_printerr("Could not start fake snapd: %s\n", error->message);
+        return FALSE;
+    }
+    scenario->setup(snapd);
+
+    for (guint i = 0; i < iterations; i++) {
+        guint requests = 0;
+        gint64 stall = 0;
+        gint64 latency = run_iteration(snapd, scenario, &requests, &stall);
+
+        if (latency < 0) {
+            g_printerr("%s: iteration %u failed\n", scenario->name, i);
+            return FALSE;
+        }
+        g_array_append_val(latencies, latency);
+        g_array_append_val(stalls, stall);
+        total_requests += requests;
+    }
+
+    g_array_sort(latencies, compare_latencies);
+    g_array_sort(stalls, compare_latencies);
+    g_print("%-45s p50 %8.1f ms  p99 %8.1f ms  stall p50 %7.1f ms  p99 %7.1f ms  %5.1f snapd requests/check  (%u checks)\n",
+            scenario->name, get_percentile(latencies, 50), get_percentile(latencies, 99),
+            get_percentile(stalls, 50), get_percentile(stalls, 99),
+            (double)total_requests / iterations, iterations);
+    return TRUE;
+}
+
+int
+main(int argc, char **argv)
+{
+    g_autofree char *cache_dir = NULL;
+    g_autofree char *helper_cache_dir = NULL;
+    guint iterations = DEFAULT_ITERATIONS;
+
+    if (argc > 1) {
+        iterations = MAX(g_ascii_strtoull(argv[1], NULL, 10), 1);
+    }
+
+    /* Keep the helper's caches away from the user's */
+    cache_dir = g_dir_make_tmp("theme-check-benchmark-XXXXXX", NULL);
+    if (cache_dir == NULL) {
+        g_printerr("Could not create cache directory\n");
+        return 1;
+    }
+    g_setenv("XDG_CACHE_HOME", cache_dir, TRUE);
+    helper_cache_dir = g_build_filename(cache_dir, "snapd-desktop-integration", NULL);
+
+    /* A failed iteration may leave a check running, so stop there */
+    for (guint i = 0; i < G_N_ELEMENTS(scenarios); i++) {
+        if (!run_scenario(&scenarios[i], iterations)) {
+            return 1;
+        }
+    }
+
+    remove_caches();
+    g_rmdir(helper_cache_dir);
+    g_rmdir(cache_dir);
+    return 0;
+}
@@ -0,0 +1,248 @@
+#include "ds-broker.h"
+
+/* The broker lets a single process resolve theme sets on behalf of
+ * every session on a host, so identical queries from many sessions are
+ * answered from one resolution and one set of caches. */
+
+static const char introspection_xml[] =
+    "<node>"
+    "  <interface name='" DS_BROKER_INTERFACE "'>"
+    "    <method name='FindMissingSnaps'>"
+    "      <!-- Empty for themes that aren't set -->"
+    "      <arg type='s' name='gtk_theme' direction='in'/>"
+    "      <arg type='s' name='icon_theme' direction='in'/>"
+    "      <arg type='s' name='cursor_theme' direction='in'/>"
+    "      <arg type='s' name='sound_theme' direction='in'/>"
+    "      <!-- Each snap's name and download size in bytes, or 0 if the"
+    "           size isn't known -->"
+    "      <arg type='a(sx)' name='snaps' direction='out'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+struct _DsBroker {
+    GObject parent;
+
+    DsSnapdHelper *helper;
+
+    GDBusNodeInfo *node_info;
+    GDBusConnection *connection;
+    guint registration_id;
+};
+
+G_DEFINE_TYPE(DsBroker, ds_broker, G_TYPE_OBJECT);
+
+enum {
+    PROP_HELPER = 1,
+    PROP_LAST,
+};
+
+static void
+ds_broker_finalize(GObject *object)
+{
+    DsBroker *self = DS_BROKER(object);
+
+    if (self->registration_id != 0) {
+        g_dbus_connection_unregister_object(self->connection, self->registration_id);
+    }
+    g_clear_object(&self->connection);
+    g_clear_pointer(&self->node_info, g_dbus_node_info_unref);
+    g_clear_object(&self->helper);
+    G_OBJECT_CLASS(ds_broker_parent_class)->finalize(object);
+}
+
+static void
+ds_broker_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    DsBroker *self = DS_BROKER(object);
+
+    switch (prop_id) {
+    case PROP_HELPER:
+        g_value_set_object(value, self->helper);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_broker_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+    DsBroker *self = DS_BROKER(object);
+
+    switch (prop_id) {
+    case PROP_HELPER:
+        g_clear_object(&self->helper);
+        self->helper = g_value_dup_object(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_broker_class_init(DsBrokerClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_broker_finalize;
+    gobject_class->get_property = ds_broker_get_property;
+    gobject_class->set_property = ds_broker_set_property;
+
+    g_object_class_install_property(
+        gobject_class, PROP_HELPER,
+        g_param_spec_object("helper", "helper", "DsSnapdHelper used to resolve themes",
+                            DS_TYPE_SNAPD_HELPER, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+}
+
+static void
+ds_broker_init(DsBroker *self)
+{
+}
+
+DsBroker *
+ds_broker_new(DsSnapdHelper *helper)
+{
+    return g_object_new(DS_TYPE_BROKER, "helper", helper, NULL);
+}
+
+static void
+query_missing_snaps_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DsSnapdHelper *helper = DS_SNAPD_HELPER(object);
+    g_autoptr(GDBusMethodInvocation) invocation = user_data;
+    g_autoptr(GPtrArray) missing_snaps = NULL;
+    g_autoptr(GError) error = NULL;
+    GVariantBuilder builder;
+
+    missing_snaps = ds_snapd_helper_query_missing_snaps_finish(helper, result, &error);
+    if (missing_snaps == NULL) {
+        g_dbus_method_invocation_return_gerror(invocation, error);
+        return;
+    }
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sx)"));
+    for (guint i = 0; i < missing_snaps->len; i++) {
+        SnapdSnap *snap = missing_snaps->pdata[i];
+
+        g_variant_builder_add(&builder, "(sx)", snapd_snap_get_name(snap), snapd_snap_get_download_size(snap));
+    }
+    g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(sx))", &builder));
+}
+
+/* Clients send an empty string for a theme that isn't set */
+static const char *
+unset_if_empty(const char *theme_name)
+{
+    return theme_name[0] != '\0' ? theme_name : NULL;
+}
+
+static void
+handle_method_call(GDBusConnection *connection, const char *sender,
+                   const char *object_path, const char *interface_name,
+                   const char *method_name, GVariant *parameters,
+                   GDBusMethodInvocation *invocation, gpointer user_data)
+{
+    DsBroker *self = DS_BROKER(user_data);
+
+    if (g_strcmp0(method_name, "FindMissingSnaps") == 0) {
+        const char *gtk_theme_name, *icon_theme_name, *cursor_theme_name, *sound_theme_name;
+        g_autoptr(DsThemeSet) themes = NULL;
+
+        g_variant_get(parameters, "(&s&s&s&s)",
+                      &gtk_theme_name, &icon_theme_name, &cursor_theme_name, &sound_theme_name);
+        g_message("Broker query from %s: gtk=%s icon=%s cursor=%s, sound=%s", sender,
+                  gtk_theme_name, icon_theme_name, cursor_theme_name, sound_theme_name);
+        themes = ds_theme_set_new(unset_if_empty(gtk_theme_name), unset_if_empty(icon_theme_name),
+                                  unset_if_empty(cursor_theme_name), unset_if_empty(sound_theme_name));
+        ds_snapd_helper_query_missing_snaps(self->helper, themes, NULL,
+                                            query_missing_snaps_cb, g_object_ref(invocation));
+        return;
+    }
+
+    g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                          "Unknown method %s", method_name);
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+    handle_method_call,
+    NULL,
+    NULL,
+};
+
+/* Exports the broker on connection.  The caller is responsible for
+ * owning DS_BROKER_BUS_NAME. */
+gboolean
+ds_broker_register(DsBroker *self, GDBusConnection *connection, GError **error)
+{
+    g_return_val_if_fail(self->registration_id == 0, FALSE);
+
+    self->node_info = g_dbus_node_info_new_for_xml(introspection_xml, error);
+    if (self->node_info == NULL) {
+        return FALSE;
+    }
+
+    self->registration_id = g_dbus_connection_register_object(
+        connection, DS_BROKER_OBJECT_PATH, self->node_info->interfaces[0],
+        &interface_vtable, self, NULL, error);
+    if (self->registration_id == 0) {
+        return FALSE;
+    }
+    self->connection = g_object_ref(connection);
+    return TRUE;
+}
+
+static void
+find_missing_snaps_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    GDBusConnection *connection = G_DBUS_CONNECTION(object);
+    g_autoptr(GTask) task = user_data;
+    g_autoptr(GVariant) reply = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GVariantIter) iter = NULL;
+    g_autoptr(GPtrArray) missing_snaps = NULL;
+    const char *snap_name;
+    gint64 download_size;
+
+    reply = g_dbus_connection_call_finish(connection, result, &error);
+    if (reply == NULL) {
+        g_task_return_error(task, g_steal_pointer(&error));
+        return;
+    }
+
+    missing_snaps = g_ptr_array_new_with_free_func(g_object_unref);
+    g_variant_get(reply, "(a(sx))", &iter);
+    while (g_variant_iter_next(iter, "(&sx)", &snap_name, &download_size)) {
+        g_ptr_array_add(missing_snaps,
+                        g_object_new(SNAPD_TYPE_SNAP, "name", snap_name, "channel", "stable",
+                                     "download-size", download_size, NULL));
+    }
+    g_task_return_pointer(task, g_steal_pointer(&missing_snaps), (GDestroyNotify)g_ptr_array_unref);
+}
+
+/* Asks the broker on connection which snaps are missing for themes */
+void
+ds_broker_find_missing_snaps(GDBusConnection *connection, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_autoptr(GTask) task = g_task_new(connection, cancellable, callback, user_data);
+
+    /* Store lookups can be slow, so don't time out */
+    g_dbus_connection_call(
+        connection, DS_BROKER_BUS_NAME, DS_BROKER_OBJECT_PATH, DS_BROKER_INTERFACE,
+        "FindMissingSnaps",
+        g_variant_new("(ssss)",
+                      themes->gtk_theme_name != NULL ? themes->gtk_theme_name : "",
+                      themes->icon_theme_name != NULL ? themes->icon_theme_name : "",
+                      themes->cursor_theme_name != NULL ? themes->cursor_theme_name : "",
+                      themes->sound_theme_name != NULL ? themes->sound_theme_name : ""),
+        G_VARIANT_TYPE("(a(sx))"), G_DBUS_CALL_FLAGS_NO_AUTO_START, G_MAXINT,
+        cancellable, find_missing_snaps_cb, g_steal_pointer(&task));
+}
+
+GPtrArray *
+ds_broker_find_missing_snaps_finish(GAsyncResult *result, GError **error)
+{
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <gio/gio.h>
+
+#include "ds-snapd-helper.h"
+#include "ds-theme-set.h"
+
+G_BEGIN_DECLS
+
+#define DS_BROKER_BUS_NAME "io.snapcraft.SnapdDesktopIntegration"
+#define DS_BROKER_OBJECT_PATH "/io/snapcraft/SnapdDesktopIntegration/Broker"
+#define DS_BROKER_INTERFACE "io.snapcraft.SnapdDesktopIntegration.Broker"
+
+#define DS_TYPE_BROKER (ds_broker_get_type())
+G_DECLARE_FINAL_TYPE(DsBroker, ds_broker, DS, BROKER, GObject);
+
+DsBroker *ds_broker_new(DsSnapdHelper *helper);
+
+gboolean ds_broker_register(DsBroker *self, GDBusConnection *connection, GError **error);
+
+void ds_broker_find_missing_snaps(GDBusConnection *connection, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GPtrArray *ds_broker_find_missing_snaps_finish(GAsyncResult *result, GError **error);
+
+G_END_DECLS
@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "ds-circuit-breaker.h"
+#include "ds-metrics.h"
+
+#define GROUP "circuit-breaker"
+
+/* Consecutive failures that open the breaker */
+#define FAILURE_THRESHOLD 3
+
+/* Time requests are held off for after the first trip, doubling with
+ * each failed probe up to the maximum, in seconds */
+#define BASE_DELAY 5
+#define MAX_DELAY (10 * 60)
+
+/* While closed, requests are made as normal.  After FAILURE_THRESHOLD
+ * consecutive failures the breaker opens, and requests fail straight
+ * away.  Once the delay has passed, a single probe request is let
+ * through: if it succeeds the breaker closes, otherwise it opens again
+ * for longer.  The state is saved, so restarting doesn't reset it.
+ *
+ * Each allowed request gets a ticket, passed back with its outcome, so
+ * requests made before the breaker last opened or closed can't affect
+ * it, and only the probe ends the probe. */
+struct _DsCircuitBreaker {
+    GObject parent;
+
+    char *name;
+    char *path;
+
+    guint failures;
+    /* Times the breaker has opened since it was last closed */
+    guint trips;
+    /* Wall clock time the breaker is open until, in seconds */
+    gint64 open_until;
+
+    guint64 next_ticket;
+    /* Ticket of the probe in progress, or 0 */
+    guint64 probe_ticket;
+    /* First ticket given out since the breaker last closed */
+    guint64 closed_ticket;
+
+    guint32 jitter_seed;
+    guint save_id;
+};
+
+G_DEFINE_TYPE(DsCircuitBreaker, ds_circuit_breaker, G_TYPE_OBJECT);
+
+enum {
+    PROP_NAME = 1,
+    PROP_PATH,
+    PROP_LAST,
+};
+
+static gint64
+now_seconds(void)
+{
+    return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+/* Seeds the jitter from the machine and user, so sessions that lose
+ * snapd at the same moment don't all retry together */
+static guint32
+get_jitter_seed(void)
+{
+    g_autofree char *machine_id = NULL;
+    g_autofree char *seed = NULL;
+
+    if (!g_file_get_contents("/etc/machine-id", &machine_id, NULL, NULL)) {
+        machine_id = g_strdup(g_get_host_name());
+    }
+    seed = g_strdup_printf("%s:%u", g_strstrip(machine_id), getuid());
+    return g_str_hash(seed);
+}
+
+/* Returns the delay for the current trip, scaled by a per-host factor
+ * between 0.5 and 1.5 */
+static guint
+get_trip_delay(DsCircuitBreaker *self)
+{
+    guint delay = BASE_DELAY;
+    guint32 hash;
+
+    for (guint i = 1; i < self->trips && delay < MAX_DELAY; i++) {
+        delay *= 2;
+    }
+    delay = MIN(delay, MAX_DELAY);
+
+    /* Vary the factor between trips as well as between hosts */
+    hash = (self->jitter_seed ^ (self->trips * 2654435761u)) * 2246822519u;
+    return delay / 2 + (guint)((guint64)delay * (hash >> 16) / 65536);
+}
+
+static void
+ds_circuit_breaker_load(DsCircuitBreaker *self)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_autoptr(GError) error = NULL;
+
+    if (!g_key_file_load_from_file(key_file, self->path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning("Could not load %s circuit breaker state: %s", self->name, error->message);
+        }
+        return;
+    }
+
+    self->trips = g_key_file_get_integer(key_file, GROUP, "trips", NULL);
+    self->open_until = g_key_file_get_int64(key_file, GROUP, "open-until", NULL);
+}
+
+static gboolean
+ds_circuit_breaker_save(DsCircuitBreaker *self)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_autofree char *dir = g_path_get_dirname(self->path);
+    g_autoptr(GError) error = NULL;
+
+    self->save_id = 0;
+
+    g_key_file_set_integer(key_file, GROUP, "trips", self->trips);
+    g_key_file_set_int64(key_file, GROUP, "open-until", self->open_until);
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_warning("Could not create %s: %s", dir, g_strerror(errno));
+        return G_SOURCE_REMOVE;
+    }
+    if (!g_key_file_save_to_file(key_file, self->path, &error)) {
+        g_warning("Could not save %s circuit breaker state: %s", self->name, error->message);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void
+queue_save(DsCircuitBreaker *self)
+{
+    if (self->path != NULL && self->save_id == 0) {
+        self->save_id = g_idle_add(G_SOURCE_FUNC(ds_circuit_breaker_save), self);
+    }
+}
+
+static void
+ds_circuit_breaker_finalize(GObject *object)
+{
+    DsCircuitBreaker *self = DS_CIRCUIT_BREAKER(object);
+
+    /* Flush any pending write before going away */
+    if (self->save_id != 0) {
+        g_clear_handle_id(&self->save_id, g_source_remove);
+        ds_circuit_breaker_save(self);
+    }
+    g_clear_pointer(&self->name, g_free);
+    g_clear_pointer(&self->path, g_free);
+    G_OBJECT_CLASS(ds_circuit_breaker_parent_class)->finalize(object);
+}
+
+static void
+ds_circuit_breaker_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    DsCircuitBreaker *self = DS_CIRCUIT_BREAKER(object);
+
+    switch (prop_id) {
+    case PROP_NAME:
+        g_value_set_string(value, self->name);
+        break;
+    case PROP_PATH:
+        g_value_set_string(value, self->path);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_circuit_breaker_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+    DsCircuitBreaker *self = DS_CIRCUIT_BREAKER(object);
+
+    switch (prop_id) {
+    case PROP_NAME:
+        g_clear_pointer(&self->name, g_free);
+        self->name = g_value_dup_string(value);
+        break;
+    case PROP_PATH:
+        g_clear_pointer(&self->path, g_free);
+        self->path = g_value_dup_string(value);
+        if (self->path != NULL) {
+            ds_circuit_breaker_load(self);
+        }
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_circuit_breaker_class_init(DsCircuitBreakerClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_circuit_breaker_finalize;
+    gobject_class->get_property = ds_circuit_breaker_get_property;
+    gobject_class->set_property = ds_circuit_breaker_set_property;
+
+    g_object_class_install_property(
+        gobject_class, PROP_NAME,
+        g_param_spec_string("name", "name", "Name of the service, used in messages and metrics",
+                            NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(
+        gobject_class, PROP_PATH,
+        g_param_spec_string("path", "path", "File the state is persisted to",
+                            NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+}
+
+static void
+ds_circuit_breaker_init(DsCircuitBreaker *self)
+{
+    self->jitter_seed = get_jitter_seed();
+    self->next_ticket = 1;
+}
+
+DsCircuitBreaker *
+ds_circuit_breaker_new(const char *name, const char *path)
+{
+    return g_object_new(DS_TYPE_CIRCUIT_BREAKER, "name", name, "path", path, NULL);
+}
+
+static void
+increment_metric(DsCircuitBreaker *self, const char *event)
+{
+    g_autofree char *name = g_strdup_printf("circuit-%s-%s", self->name, event);
+
+    ds_metrics_increment(name);
+}
+
+/* Returns TRUE if a request may be made, setting ticket to identify it.
+ * Every allowed request must be followed by a call to
+ * ds_circuit_breaker_succeeded(), _failed() or _abandoned() with its
+ * ticket. */
+gboolean
+ds_circuit_breaker_allow(DsCircuitBreaker *self, guint64 *ticket, GError **error)
+{
+    if (self->trips == 0) {
+        *ticket = self->next_ticket++;
+        return TRUE;
+    }
+
+    if (now_seconds() < self->open_until || self->probe_ticket != 0) {
+        increment_metric(self, "rejected");
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_BUSY,
+                    "%s is unavailable, retrying in %u seconds",
+                    self->name, ds_circuit_breaker_get_retry_delay(self));
+        return FALSE;
+    }
+
+    g_message("Probing %s after %u failed attempts", self->name, self->trips);
+    increment_metric(self, "probes");
+    *ticket = self->probe_ticket = self->next_ticket++;
+    return TRUE;
+}
+
+/* Returns TRUE if the service hasn't failed, so requests aren't being
+ * held off or probed */
+gboolean
+ds_circuit_breaker_is_closed(DsCircuitBreaker *self)
+{
+    return self->trips == 0;
+}
+
+/* Returns how many seconds until a request will be allowed again, or 0
+ * if one can be made now */
+guint
+ds_circuit_breaker_get_retry_delay(DsCircuitBreaker *self)
+{
+    gint64 now = now_seconds();
+
+    if (self->trips == 0) {
+        return 0;
+    }
+    /* Give the probe in progress a moment to finish */
+    if (self->probe_ticket != 0) {
+        return BASE_DELAY;
+    }
+    return self->open_until > now ? self->open_until - now : 0;
+}
+
+/* Whether the outcome of a request says anything about the current
+ * state: while open only the probe counts, and while closed only the
+ * requests made since */
+static gboolean
+is_current(DsCircuitBreaker *self, guint64 ticket)
+{
+    if (self->trips > 0) {
+        return ticket == self->probe_ticket;
+    }
+    return ticket >= self->closed_ticket;
+}
+
+void
+ds_circuit_breaker_succeeded(DsCircuitBreaker *self, guint64 ticket)
+{
+    if (!is_current(self, ticket)) {
+        return;
+    }
+    self->failures = 0;
+    if (self->trips == 0) {
+        return;
+    }
+
+    g_message("%s is available again", self->name);
+    increment_metric(self, "closed");
+    self->trips = 0;
+    self->open_until = 0;
+    self->probe_ticket = 0;
+    self->closed_ticket = self->next_ticket;
+    queue_save(self);
+}
+
+void
+ds_circuit_breaker_failed(DsCircuitBreaker *self, guint64 ticket)
+{
+    guint delay;
+
+    if (!is_current(self, ticket)) {
+        return;
+    }
+    if (self->trips == 0 && ++self->failures < FAILURE_THRESHOLD) {
+        return;
+    }
+
+    self->failures = 0;
+    self->probe_ticket = 0;
+    self->trips++;
+    delay = get_trip_delay(self);
+    self->open_until = now_seconds() + delay;
+    g_warning("%s is failing, holding off requests for %u seconds", self->name, delay);
+    increment_metric(self, "opened");
+    queue_save(self);
+}
+
+/* The request was cancelled, so says nothing about the service.  If it
+ * was the probe, another may be made. */
+void
+ds_circuit_breaker_abandoned(DsCircuitBreaker *self, guint64 ticket)
+{
+    if (self->probe_ticket != 0 && ticket == self->probe_ticket) {
+        self->probe_ticket = 0;
+    }
+}
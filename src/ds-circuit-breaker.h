@@ -0,0 +1,20 @@
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define DS_TYPE_CIRCUIT_BREAKER (ds_circuit_breaker_get_type())
+G_DECLARE_FINAL_TYPE(DsCircuitBreaker, ds_circuit_breaker, DS, CIRCUIT_BREAKER, GObject);
+
+DsCircuitBreaker *ds_circuit_breaker_new(const char *name, const char *path);
+
+gboolean ds_circuit_breaker_allow(DsCircuitBreaker *self, guint64 *ticket, GError **error);
+gboolean ds_circuit_breaker_is_closed(DsCircuitBreaker *self);
+guint ds_circuit_breaker_get_retry_delay(DsCircuitBreaker *self);
+
+void ds_circuit_breaker_succeeded(DsCircuitBreaker *self, guint64 ticket);
+void ds_circuit_breaker_failed(DsCircuitBreaker *self, guint64 ticket);
+void ds_circuit_breaker_abandoned(DsCircuitBreaker *self, guint64 ticket);
+
+G_END_DECLS
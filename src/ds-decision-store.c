@@ -0,0 +1,366 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <snapd-glib/snapd-glib.h>
+
+#include "ds-decision-store.h"
+
+#define GROUP_PREFIX "declined "
+
+/* The user declined to install a set of snaps */
+typedef struct {
+    /* Wall clock time of the decision, in seconds */
+    gint64 time;
+    /* Theme sets known to resolve to the snaps */
+    GPtrArray *themes;
+} decision_t;
+
+struct _DsDecisionStore {
+    GObject parent;
+
+    char *path;
+    guint expiry;
+
+    /* Sorted snap names joined with spaces -> decision_t */
+    GHashTable *decisions;
+    /* DsThemeSet -> key in decisions */
+    GHashTable *themes;
+    guint save_id;
+};
+
+G_DEFINE_TYPE(DsDecisionStore, ds_decision_store, G_TYPE_OBJECT);
+
+enum {
+    PROP_PATH = 1,
+    PROP_EXPIRY,
+    PROP_LAST,
+};
+
+static gint64
+now_seconds(void)
+{
+    return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+static void
+decision_free(decision_t *decision)
+{
+    g_clear_pointer(&decision->themes, g_ptr_array_unref);
+    g_free(decision);
+}
+
+static int
+compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* The key for a set of snaps doesn't depend on their order */
+static char *
+make_snaps_key(GPtrArray *snaps)
+{
+    g_autoptr(GPtrArray) names = g_ptr_array_new();
+
+    for (guint i = 0; i < snaps->len; i++) {
+        g_ptr_array_add(names, (gpointer)snapd_snap_get_name(snaps->pdata[i]));
+    }
+    g_ptr_array_sort(names, compare_names);
+    g_ptr_array_add(names, NULL);
+    return g_strjoinv(" ", (char **)names->pdata);
+}
+
+/* Theme sets are stored as their names separated by tabs */
+static char *
+make_themes_key(const DsThemeSet *themes)
+{
+    return g_strjoin("\t",
+                     themes->gtk_theme_name != NULL ? themes->gtk_theme_name : "",
+                     themes->icon_theme_name != NULL ? themes->icon_theme_name : "",
+                     themes->cursor_theme_name != NULL ? themes->cursor_theme_name : "",
+                     themes->sound_theme_name != NULL ? themes->sound_theme_name : "",
+                     NULL);
+}
+
+static DsThemeSet *
+parse_themes_key(const char *key)
+{
+    g_auto(GStrv) names = g_strsplit(key, "\t", -1);
+
+    if (g_strv_length(names) != 4) {
+        return NULL;
+    }
+    return ds_theme_set_new(names[0], names[1], names[2], names[3]);
+}
+
+static void
+add_themes(DsDecisionStore *self, const char *snaps_key, decision_t *decision, const DsThemeSet *themes)
+{
+    const char *old_key = g_hash_table_lookup(self->themes, themes);
+
+    if (g_strcmp0(old_key, snaps_key) == 0) {
+        return;
+    }
+    g_ptr_array_add(decision->themes, ds_theme_set_ref(themes));
+    g_hash_table_insert(self->themes, ds_theme_set_ref(themes), g_strdup(snaps_key));
+}
+
+static void
+remove_decision(DsDecisionStore *self, const char *snaps_key)
+{
+    decision_t *decision = g_hash_table_lookup(self->decisions, snaps_key);
+
+    for (guint i = 0; i < decision->themes->len; i++) {
+        DsThemeSet *themes = decision->themes->pdata[i];
+
+        /* A theme set may have been moved to a newer decision since */
+        if (g_strcmp0(g_hash_table_lookup(self->themes, themes), snaps_key) == 0) {
+            g_hash_table_remove(self->themes, themes);
+        }
+    }
+    g_hash_table_remove(self->decisions, snaps_key);
+}
+
+static decision_t *
+insert_decision(DsDecisionStore *self, const char *snaps_key, gint64 time)
+{
+    decision_t *decision = g_new0(decision_t, 1);
+
+    decision->time = time;
+    decision->themes = g_ptr_array_new_with_free_func((GDestroyNotify)ds_theme_set_unref);
+    if (g_hash_table_contains(self->decisions, snaps_key)) {
+        remove_decision(self, snaps_key);
+    }
+    g_hash_table_insert(self->decisions, g_strdup(snaps_key), decision);
+    return decision;
+}
+
+static void
+ds_decision_store_load(DsDecisionStore *self)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_auto(GStrv) groups = NULL;
+    g_autoptr(GError) error = NULL;
+
+    if (!g_key_file_load_from_file(key_file, self->path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning("Could not load declined snaps: %s", error->message);
+        }
+        return;
+    }
+
+    groups = g_key_file_get_groups(key_file, NULL);
+    for (guint i = 0; groups[i] != NULL; i++) {
+        const char *snaps_key;
+        g_auto(GStrv) theme_keys = NULL;
+        decision_t *decision;
+
+        if (!g_str_has_prefix(groups[i], GROUP_PREFIX)) {
+            continue;
+        }
+        snaps_key = groups[i] + strlen(GROUP_PREFIX);
+
+        decision = insert_decision(self, snaps_key, g_key_file_get_int64(key_file, groups[i], "time", NULL));
+        theme_keys = g_key_file_get_string_list(key_file, groups[i], "themes", NULL, NULL);
+        for (guint j = 0; theme_keys != NULL && theme_keys[j] != NULL; j++) {
+            g_autoptr(DsThemeSet) themes = parse_themes_key(theme_keys[j]);
+
+            if (themes != NULL) {
+                add_themes(self, snaps_key, decision, themes);
+            }
+        }
+    }
+}
+
+static gboolean
+ds_decision_store_save(DsDecisionStore *self)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_autofree char *dir = g_path_get_dirname(self->path);
+    g_autoptr(GError) error = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    self->save_id = 0;
+
+    g_hash_table_iter_init(&iter, self->decisions);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        decision_t *decision = value;
+        g_autofree char *group = g_strconcat(GROUP_PREFIX, key, NULL);
+        g_autoptr(GPtrArray) theme_keys = g_ptr_array_new_with_free_func(g_free);
+
+        for (guint i = 0; i < decision->themes->len; i++) {
+            if (g_strcmp0(g_hash_table_lookup(self->themes, decision->themes->pdata[i]), key) == 0) {
+                g_ptr_array_add(theme_keys, make_themes_key(decision->themes->pdata[i]));
+            }
+        }
+
+        g_key_file_set_int64(key_file, group, "time", decision->time);
+        g_key_file_set_string_list(key_file, group, "themes",
+                                   (const char * const *)theme_keys->pdata, theme_keys->len);
+    }
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_warning("Could not create %s: %s", dir, g_strerror(errno));
+        return G_SOURCE_REMOVE;
+    }
+    if (!g_key_file_save_to_file(key_file, self->path, &error)) {
+        g_warning("Could not save declined snaps: %s", error->message);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void
+queue_save(DsDecisionStore *self)
+{
+    if (self->path != NULL && self->save_id == 0) {
+        self->save_id = g_idle_add(G_SOURCE_FUNC(ds_decision_store_save), self);
+    }
+}
+
+static void
+ds_decision_store_finalize(GObject *object)
+{
+    DsDecisionStore *self = DS_DECISION_STORE(object);
+
+    /* Flush any pending write before going away */
+    if (self->save_id != 0) {
+        g_clear_handle_id(&self->save_id, g_source_remove);
+        ds_decision_store_save(self);
+    }
+    g_clear_pointer(&self->themes, g_hash_table_unref);
+    g_clear_pointer(&self->decisions, g_hash_table_unref);
+    g_clear_pointer(&self->path, g_free);
+    G_OBJECT_CLASS(ds_decision_store_parent_class)->finalize(object);
+}
+
+static void
+ds_decision_store_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    DsDecisionStore *self = DS_DECISION_STORE(object);
+
+    switch (prop_id) {
+    case PROP_PATH:
+        g_value_set_string(value, self->path);
+        break;
+    case PROP_EXPIRY:
+        g_value_set_uint(value, self->expiry);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_decision_store_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+    DsDecisionStore *self = DS_DECISION_STORE(object);
+
+    switch (prop_id) {
+    case PROP_PATH:
+        g_clear_pointer(&self->path, g_free);
+        self->path = g_value_dup_string(value);
+        if (self->path != NULL) {
+            ds_decision_store_load(self);
+        }
+        break;
+    case PROP_EXPIRY:
+        self->expiry = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_decision_store_class_init(DsDecisionStoreClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_decision_store_finalize;
+    gobject_class->get_property = ds_decision_store_get_property;
+    gobject_class->set_property = ds_decision_store_set_property;
+
+    g_object_class_install_property(
+        gobject_class, PROP_PATH,
+        g_param_spec_string("path", "path", "File the decisions are persisted to",
+                            NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(
+        gobject_class, PROP_EXPIRY,
+        g_param_spec_uint("expiry", "expiry", "seconds before the user is asked again",
+                          0, G_MAXUINT, 7 * 24 * 60 * 60, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+}
+
+static void
+ds_decision_store_init(DsDecisionStore *self)
+{
+    self->decisions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)decision_free);
+    self->themes = g_hash_table_new_full((GHashFunc)ds_theme_set_hash, (GEqualFunc)ds_theme_set_equal,
+                                         (GDestroyNotify)ds_theme_set_unref, g_free);
+}
+
+/* Remembers which snaps the user declined to install, so they aren't
+ * asked about them again until the decision expires */
+DsDecisionStore *
+ds_decision_store_new(const char *path)
+{
+    return g_object_new(DS_TYPE_DECISION_STORE, "path", path, NULL);
+}
+
+/* Records that the user declined to install snaps, the missing snaps
+ * for themes */
+void
+ds_decision_store_decline(DsDecisionStore *self, const DsThemeSet *themes, GPtrArray *snaps)
+{
+    g_autofree char *snaps_key = make_snaps_key(snaps);
+    decision_t *decision = insert_decision(self, snaps_key, now_seconds());
+
+    add_themes(self, snaps_key, decision, themes);
+    queue_save(self);
+}
+
+/* Looks up the unexpired decision for snaps_key, dropping it if it has
+ * expired */
+static decision_t *
+lookup_decision(DsDecisionStore *self, const char *snaps_key)
+{
+    decision_t *decision = g_hash_table_lookup(self->decisions, snaps_key);
+
+    if (decision == NULL) {
+        return NULL;
+    }
+    if (now_seconds() - decision->time >= self->expiry) {
+        remove_decision(self, snaps_key);
+        queue_save(self);
+        return NULL;
+    }
+    return decision;
+}
+
+/* Returns TRUE if the snaps missing for themes were declined.  This
+ * needs no lookups, so is checked before resolving themes. */
+gboolean
+ds_decision_store_is_declined(DsDecisionStore *self, const DsThemeSet *themes)
+{
+    /* Copied, as an expired decision is removed along with the key */
+    g_autofree char *snaps_key = g_strdup(g_hash_table_lookup(self->themes, themes));
+
+    return snaps_key != NULL && lookup_decision(self, snaps_key) != NULL;
+}
+
+/* Returns TRUE if snaps, the missing snaps for themes, were declined.
+ * themes is then remembered as declined too. */
+gboolean
+ds_decision_store_snaps_declined(DsDecisionStore *self, const DsThemeSet *themes, GPtrArray *snaps)
+{
+    g_autofree char *snaps_key = make_snaps_key(snaps);
+    decision_t *decision = lookup_decision(self, snaps_key);
+
+    if (decision == NULL) {
+        return FALSE;
+    }
+    add_themes(self, snaps_key, decision, themes);
+    queue_save(self);
+    return TRUE;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <glib-object.h>
+
+#include "ds-theme-set.h"
+
+G_BEGIN_DECLS
+
+#define DS_TYPE_DECISION_STORE (ds_decision_store_get_type())
+G_DECLARE_FINAL_TYPE(DsDecisionStore, ds_decision_store, DS, DECISION_STORE, GObject);
+
+DsDecisionStore *ds_decision_store_new(const char *path);
+
+void ds_decision_store_decline(DsDecisionStore *self, const DsThemeSet *themes, GPtrArray *snaps);
+gboolean ds_decision_store_is_declined(DsDecisionStore *self, const DsThemeSet *themes);
+gboolean ds_decision_store_snaps_declined(DsDecisionStore *self, const DsThemeSet *themes, GPtrArray *snaps);
+
+G_END_DECLS
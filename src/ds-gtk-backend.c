@@ -0,0 +1,62 @@
+#include <gmodule.h>
+
+#include "ds-gtk-backend.h"
+
+#define GTK_MODULE_NAME "ds-gtk-backend"
+
+/* Returns the directories the GTK backend module may be in: next to the
+ * executable when running from the build tree, then where it is
+ * installed relative to the executable, so the snap can be relocated */
+static GStrv
+get_module_dirs(void)
+{
+    g_autoptr(GStrvBuilder) builder = g_strv_builder_new();
+    g_autofree char *exe = g_file_read_link("/proc/self/exe", NULL);
+    g_autofree char *exe_dir = NULL;
+    g_autofree char *installed_dir = NULL;
+
+    if (exe != NULL) {
+        exe_dir = g_path_get_dirname(exe);
+        installed_dir = g_build_filename(exe_dir, BINDIR_TO_MODULEDIR, NULL);
+        g_strv_builder_add(builder, exe_dir);
+        g_strv_builder_add(builder, installed_dir);
+    }
+    g_strv_builder_add(builder, MODULEDIR);
+    return g_strv_builder_end(builder);
+}
+
+/* Loads the GTK backend module, initialises GTK and returns its
+ * GtkSettings, without this process linking against GTK itself */
+GObject *
+ds_gtk_backend_get_settings(int *argc, char ***argv, GError **error)
+{
+    g_auto(GStrv) dirs = get_module_dirs();
+    GModule *module = NULL;
+    DsGtkModuleEntry entry;
+
+    for (guint i = 0; dirs[i] != NULL && module == NULL; i++) {
+        g_autofree char *path = g_module_build_path(dirs[i], GTK_MODULE_NAME);
+
+        if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+            module = g_module_open(path, G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+            if (module == NULL) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not load GTK backend: %s", g_module_error());
+                return NULL;
+            }
+        }
+    }
+    if (module == NULL) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "GTK backend module is not installed");
+        return NULL;
+    }
+
+    if (!g_module_symbol(module, DS_GTK_MODULE_ENTRY, (gpointer *)&entry)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not load GTK backend: %s", g_module_error());
+        g_module_close(module);
+        return NULL;
+    }
+
+    /* GTK can't be unloaded once initialised */
+    g_module_make_resident(module);
+    return entry(argc, argv, error);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Name of the function the GTK backend module exports */
+#define DS_GTK_MODULE_ENTRY "ds_gtk_module_get_settings"
+
+typedef GObject *(*DsGtkModuleEntry)(int *argc, char ***argv, GError **error);
+
+GObject *ds_gtk_backend_get_settings(int *argc, char ***argv, GError **error);
+
+G_END_DECLS
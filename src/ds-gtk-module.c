@@ -0,0 +1,17 @@
+#include <gtk/gtk.h>
+#include <gmodule.h>
+
+#include "ds-gtk-backend.h"
+
+/* Initialises GTK and returns a reference to its settings.  This is the
+ * only code that links against GTK, so the GSettings backend never maps
+ * it. */
+G_MODULE_EXPORT GObject *
+ds_gtk_module_get_settings(int *argc, char ***argv, GError **error)
+{
+    if (!gtk_init_check(argc, argv)) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not open display");
+        return NULL;
+    }
+    return g_object_ref(G_OBJECT(gtk_settings_get_default()));
+}
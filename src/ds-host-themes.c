@@ -0,0 +1,386 @@
+#include "ds-host-themes.h"
+
+/* How long to let a directory settle after a change before scanning it
+ * again, in milliseconds */
+#define RESCAN_DELAY 500
+
+#define HOSTFS_DATA_DIR "/var/lib/snapd/hostfs/usr/share"
+
+/* A directory containing themes of one kind.  A subdirectory is a
+ * theme if it contains the marker file. */
+typedef struct {
+    DsHostThemes *self;
+    DsThemeKind kind;
+    char *path;
+    const char *marker;
+    GFileMonitor *monitor;
+
+    /* Set of theme names, or NULL until the first scan completes */
+    GHashTable *themes;
+    /* Set if the last scan couldn't read the directory, so what it
+     * holds is unknown */
+    gboolean failed;
+    gboolean scanning;
+    gboolean dirty;
+} theme_dir_t;
+
+/* A scan of one directory, run on the thread pool */
+typedef struct {
+    DsHostThemes *self;
+    theme_dir_t *dir;
+    GHashTable *themes;
+    gboolean failed;
+} scan_t;
+
+struct _DsHostThemes {
+    GObject parent;
+
+    GMainContext *context;
+    GThreadPool *pool;
+    GPtrArray *dirs;
+    guint rescan_id;
+};
+
+G_DEFINE_TYPE(DsHostThemes, ds_host_themes, G_TYPE_OBJECT);
+
+enum {
+    CHANGED,
+    LAST_SIGNAL,
+};
+
+static guint host_themes_signals[LAST_SIGNAL] = { 0 };
+
+static const struct {
+    DsThemeKind kind;
+    const char *subdir;
+    /* Directory in the home directory that predates the XDG one */
+    const char *home_subdir;
+    const char *marker;
+} theme_dir_types[] = {
+    { DS_THEME_KIND_GTK, "themes", ".themes", "gtk-3.0" },
+    { DS_THEME_KIND_ICON, "icons", ".icons", "index.theme" },
+    { DS_THEME_KIND_SOUND, "sounds", NULL, "index.theme" },
+    { DS_THEME_KIND_GTK4, "themes", ".themes", "gtk-4.0" },
+    { DS_THEME_KIND_CURSOR, "icons", ".icons", "cursors" },
+};
+
+static void
+theme_dir_free(theme_dir_t *dir)
+{
+    if (dir->monitor != NULL) {
+        g_file_monitor_cancel(dir->monitor);
+        g_signal_handlers_disconnect_by_data(dir->monitor, dir);
+    }
+    g_clear_object(&dir->monitor);
+    g_clear_pointer(&dir->themes, g_hash_table_unref);
+    g_free(dir->path);
+    g_free(dir);
+}
+
+static gboolean
+scan_done_cb(scan_t *scan)
+{
+    DsHostThemes *self = scan->self;
+    theme_dir_t *dir = scan->dir;
+    gboolean idle = TRUE;
+
+    g_clear_pointer(&dir->themes, g_hash_table_unref);
+    dir->themes = g_steal_pointer(&scan->themes);
+    dir->failed = scan->failed;
+    dir->scanning = FALSE;
+    if (!dir->failed) {
+        g_debug("Found %u themes in %s", g_hash_table_size(dir->themes), dir->path);
+    }
+
+    for (guint i = 0; i < self->dirs->len; i++) {
+        theme_dir_t *d = self->dirs->pdata[i];
+
+        if (d->scanning || d->dirty) {
+            idle = FALSE;
+        }
+    }
+    if (idle) {
+        g_signal_emit(self, host_themes_signals[CHANGED], 0);
+    }
+
+    g_object_unref(scan->self);
+    g_free(scan);
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs on the thread pool, touching nothing but the scan */
+static void
+scan_dir(scan_t *scan, DsHostThemes *self)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GDir) dir = g_dir_open(scan->dir->path, 0, &error);
+    const char *name;
+
+    scan->themes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    /* A missing directory has no themes, but one that can't be read
+     * may have any */
+    if (dir == NULL && !g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT) &&
+        !g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOTDIR)) {
+        g_warning("Could not scan %s: %s", scan->dir->path, error->message);
+        scan->failed = TRUE;
+    }
+    while (dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+        g_autofree char *marker_path = g_build_filename(scan->dir->path, name, scan->dir->marker, NULL);
+
+        if (g_file_test(marker_path, G_FILE_TEST_EXISTS)) {
+            g_hash_table_add(scan->themes, g_strdup(name));
+        }
+    }
+
+    g_main_context_invoke(self->context, G_SOURCE_FUNC(scan_done_cb), scan);
+}
+
+static void
+queue_scan(DsHostThemes *self, theme_dir_t *dir)
+{
+    scan_t *scan;
+
+    /* Changes during a scan are picked up by the next one */
+    if (dir->scanning) {
+        dir->dirty = TRUE;
+        return;
+    }
+
+    scan = g_new0(scan_t, 1);
+    scan->self = g_object_ref(self);
+    scan->dir = dir;
+    dir->scanning = TRUE;
+    dir->dirty = FALSE;
+    g_thread_pool_push(self->pool, scan, NULL);
+}
+
+static gboolean
+rescan_cb(DsHostThemes *self)
+{
+    self->rescan_id = 0;
+    for (guint i = 0; i < self->dirs->len; i++) {
+        theme_dir_t *dir = self->dirs->pdata[i];
+
+        if (dir->dirty && !dir->scanning) {
+            queue_scan(self, dir);
+        }
+    }
+
+    /* Some directories are still being scanned */
+    for (guint i = 0; i < self->dirs->len; i++) {
+        theme_dir_t *dir = self->dirs->pdata[i];
+
+        if (dir->dirty) {
+            self->rescan_id = g_timeout_add(RESCAN_DELAY, G_SOURCE_FUNC(rescan_cb), self);
+            break;
+        }
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void
+dir_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event, theme_dir_t *dir)
+{
+    DsHostThemes *self = dir->self;
+
+    switch (event) {
+    case G_FILE_MONITOR_EVENT_CREATED:
+    case G_FILE_MONITOR_EVENT_DELETED:
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+    case G_FILE_MONITOR_EVENT_MOVED_OUT:
+    case G_FILE_MONITOR_EVENT_RENAMED:
+        break;
+    default:
+        return;
+    }
+
+    dir->dirty = TRUE;
+    if (self->rescan_id == 0) {
+        self->rescan_id = g_timeout_add(RESCAN_DELAY, G_SOURCE_FUNC(rescan_cb), self);
+    }
+}
+
+static void
+add_theme_dir(DsHostThemes *self, GHashTable *seen, const char *path, guint type)
+{
+    g_autoptr(GFile) file = NULL;
+    g_autoptr(GError) error = NULL;
+    theme_dir_t *dir;
+
+    /* A directory can hold themes of more than one kind */
+    if (!g_hash_table_add(seen, g_build_filename(path, theme_dir_types[type].marker, NULL))) {
+        return;
+    }
+
+    dir = g_new0(theme_dir_t, 1);
+    dir->self = self;
+    dir->kind = theme_dir_types[type].kind;
+    dir->path = g_strdup(path);
+    dir->marker = theme_dir_types[type].marker;
+
+    /* Only the top level is watched, however many themes there are */
+    file = g_file_new_for_path(dir->path);
+    dir->monitor = g_file_monitor_directory(file, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+    if (dir->monitor == NULL) {
+        g_warning("Could not watch %s: %s", dir->path, error->message);
+    } else {
+        g_signal_connect(dir->monitor, "changed", G_CALLBACK(dir_changed_cb), dir);
+    }
+
+    g_ptr_array_add(self->dirs, dir);
+    queue_scan(self, dir);
+}
+
+static void
+add_data_dir(DsHostThemes *self, GHashTable *seen, const char *data_dir, guint type)
+{
+    g_autofree char *path = g_build_filename(data_dir, theme_dir_types[type].subdir, NULL);
+
+    add_theme_dir(self, seen, path, type);
+}
+
+static void
+ds_host_themes_finalize(GObject *object)
+{
+    DsHostThemes *self = DS_HOST_THEMES(object);
+
+    /* Pending scans hold a reference, so at most the thread that
+     * completed the last one can still be finishing */
+    if (self->pool != NULL) {
+        g_thread_pool_free(g_steal_pointer(&self->pool), FALSE, TRUE);
+    }
+    g_clear_handle_id(&self->rescan_id, g_source_remove);
+    g_clear_pointer(&self->dirs, g_ptr_array_unref);
+    g_clear_pointer(&self->context, g_main_context_unref);
+    G_OBJECT_CLASS(ds_host_themes_parent_class)->finalize(object);
+}
+
+static void
+ds_host_themes_class_init(DsHostThemesClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_host_themes_finalize;
+
+    /* Emitted when a scan of the theme directories has completed */
+    host_themes_signals[CHANGED] = g_signal_new(
+        "changed", G_TYPE_FROM_CLASS (gobject_class),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+        G_TYPE_NONE, 0);
+}
+
+static void
+ds_host_themes_init(DsHostThemes *self)
+{
+    const char * const *data_dirs = g_get_system_data_dirs();
+    const char *real_home = g_getenv("SNAP_REAL_HOME");
+    g_autofree char *user_data_dir = NULL;
+    g_autoptr(GHashTable) seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    self->context = g_main_context_ref_thread_default();
+    self->pool = g_thread_pool_new((GFunc)scan_dir, self, g_get_num_processors(), FALSE, NULL);
+    self->dirs = g_ptr_array_new_with_free_func((GDestroyNotify)theme_dir_free);
+
+    /* Inside a snap, the home and data dirs are the snap's own, so
+     * the host's are found through $SNAP_REAL_HOME and the hostfs */
+    if (real_home != NULL) {
+        user_data_dir = g_build_filename(real_home, ".local", "share", NULL);
+    } else {
+        real_home = g_get_home_dir();
+        user_data_dir = g_strdup(g_get_user_data_dir());
+    }
+
+    for (guint type = 0; type < G_N_ELEMENTS(theme_dir_types); type++) {
+        add_data_dir(self, seen, user_data_dir, type);
+        if (theme_dir_types[type].home_subdir != NULL) {
+            g_autofree char *path = g_build_filename(real_home, theme_dir_types[type].home_subdir, NULL);
+            add_theme_dir(self, seen, path, type);
+        }
+        for (guint i = 0; data_dirs[i] != NULL; i++) {
+            add_data_dir(self, seen, data_dirs[i], type);
+        }
+        if (g_getenv("SNAP") != NULL) {
+            add_data_dir(self, seen, HOSTFS_DATA_DIR, type);
+        }
+    }
+}
+
+/* Indexes the themes in the XDG data directories, and in ~/.themes and
+ * ~/.icons.  Each directory is
+ * scanned on a thread pool, and scanned again when it changes. */
+DsHostThemes *
+ds_host_themes_new(void)
+{
+    return g_object_new(DS_TYPE_HOST_THEMES, NULL);
+}
+
+/* Returns whether every theme directory has been scanned */
+gboolean
+ds_host_themes_is_ready(DsHostThemes *self)
+{
+    for (guint i = 0; i < self->dirs->len; i++) {
+        theme_dir_t *dir = self->dirs->pdata[i];
+
+        if (dir->themes == NULL) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Returns whether every directory with themes of this kind has been
+ * scanned successfully, so a theme missing from them isn't on the host */
+gboolean
+ds_host_themes_is_known(DsHostThemes *self, DsThemeKind kind)
+{
+    for (guint i = 0; i < self->dirs->len; i++) {
+        theme_dir_t *dir = self->dirs->pdata[i];
+
+        if (dir->kind == kind && (dir->themes == NULL || dir->failed)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+gboolean
+ds_host_themes_contains(DsHostThemes *self, DsThemeKind kind, const char *theme_name)
+{
+    if (theme_name == NULL) {
+        return FALSE;
+    }
+    for (guint i = 0; i < self->dirs->len; i++) {
+        theme_dir_t *dir = self->dirs->pdata[i];
+
+        if (dir->kind == kind && dir->themes != NULL && g_hash_table_contains(dir->themes, theme_name)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Returns the names of the themes of one kind on the host */
+GPtrArray *
+ds_host_themes_get_themes(DsHostThemes *self, DsThemeKind kind)
+{
+    g_autoptr(GHashTable) names = g_hash_table_new(g_str_hash, g_str_equal);
+    GPtrArray *themes = g_ptr_array_new_with_free_func(g_free);
+    GHashTableIter iter;
+    gpointer key;
+
+    for (guint i = 0; i < self->dirs->len; i++) {
+        theme_dir_t *dir = self->dirs->pdata[i];
+
+        if (dir->kind != kind || dir->themes == NULL) {
+            continue;
+        }
+        g_hash_table_iter_init(&iter, dir->themes);
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            if (g_hash_table_add(names, key)) {
+                g_ptr_array_add(themes, g_strdup(key));
+            }
+        }
+    }
+    return themes;
+}
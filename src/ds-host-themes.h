@@ -0,0 +1,19 @@
+#pragma once
+
+#include <gio/gio.h>
+
+#include "ds-theme-index.h"
+
+G_BEGIN_DECLS
+
+#define DS_TYPE_HOST_THEMES (ds_host_themes_get_type())
+G_DECLARE_FINAL_TYPE(DsHostThemes, ds_host_themes, DS, HOST_THEMES, GObject);
+
+DsHostThemes *ds_host_themes_new(void);
+
+gboolean ds_host_themes_is_ready(DsHostThemes *self);
+gboolean ds_host_themes_is_known(DsHostThemes *self, DsThemeKind kind);
+gboolean ds_host_themes_contains(DsHostThemes *self, DsThemeKind kind, const char *theme_name);
+GPtrArray *ds_host_themes_get_themes(DsHostThemes *self, DsThemeKind kind);
+
+G_END_DECLS
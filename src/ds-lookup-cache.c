@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "ds-lookup-cache.h"
+#include "ds-metrics.h"
+
+typedef struct {
+    DsLookupResult result;
+    /* Size of the snap's download, or 0 if unknown */
+    gint64 download_size;
+    /* Wall clock time the result was stored, in seconds */
+    gint64 time;
+} cache_entry_t;
+
+struct _DsLookupCache {
+    GObject parent;
+
+    char *path;
+    guint ttl;
+    guint negative_ttl;
+
+    GHashTable *entries;
+    guint save_id;
+};
+
+G_DEFINE_TYPE(DsLookupCache, ds_lookup_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_PATH = 1,
+    PROP_TTL,
+    PROP_NEGATIVE_TTL,
+    PROP_LAST,
+};
+
+static const char *result_names[] = {
+    [DS_LOOKUP_RESULT_NOT_FOUND] = "not-found",
+    [DS_LOOKUP_RESULT_FOUND] = "found",
+    [DS_LOOKUP_RESULT_UNAVAILABLE] = "unavailable",
+};
+
+static gint64
+now_seconds(void)
+{
+    return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+static gboolean
+parse_result(const char *name, DsLookupResult *result)
+{
+    for (guint i = 0; i < G_N_ELEMENTS(result_names); i++) {
+        if (g_strcmp0(name, result_names[i]) == 0) {
+            *result = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void
+ds_lookup_cache_load(DsLookupCache *self)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_auto(GStrv) groups = NULL;
+    g_autoptr(GError) error = NULL;
+
+    if (!g_key_file_load_from_file(key_file, self->path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning("Could not load lookup cache: %s", error->message);
+        }
+        return;
+    }
+
+    groups = g_key_file_get_groups(key_file, NULL);
+    for (guint i = 0; groups[i] != NULL; i++) {
+        g_autofree char *result_name = g_key_file_get_string(key_file, groups[i], "result", NULL);
+        cache_entry_t *entry = g_new0(cache_entry_t, 1);
+
+        if (!parse_result(result_name, &entry->result)) {
+            g_free(entry);
+            continue;
+        }
+        entry->download_size = g_key_file_get_int64(key_file, groups[i], "download-size", NULL);
+        entry->time = g_key_file_get_int64(key_file, groups[i], "time", NULL);
+        g_hash_table_replace(self->entries, g_strdup(groups[i]), entry);
+    }
+}
+
+static gboolean
+ds_lookup_cache_save(DsLookupCache *self)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_autofree char *dir = g_path_get_dirname(self->path);
+    g_autoptr(GError) error = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    self->save_id = 0;
+
+    g_hash_table_iter_init(&iter, self->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        cache_entry_t *entry = value;
+
+        g_key_file_set_string(key_file, key, "result", result_names[entry->result]);
+        if (entry->download_size > 0) {
+            g_key_file_set_int64(key_file, key, "download-size", entry->download_size);
+        }
+        g_key_file_set_int64(key_file, key, "time", entry->time);
+    }
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_warning("Could not create %s: %s", dir, g_strerror(errno));
+        return G_SOURCE_REMOVE;
+    }
+    if (!g_key_file_save_to_file(key_file, self->path, &error)) {
+        g_warning("Could not save lookup cache: %s", error->message);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void
+ds_lookup_cache_finalize(GObject *object)
+{
+    DsLookupCache *self = DS_LOOKUP_CACHE(object);
+
+    /* Flush any pending write before going away */
+    if (self->save_id != 0) {
+        g_clear_handle_id(&self->save_id, g_source_remove);
+        ds_lookup_cache_save(self);
+    }
+    g_clear_pointer(&self->entries, g_hash_table_unref);
+    g_clear_pointer(&self->path, g_free);
+    G_OBJECT_CLASS(ds_lookup_cache_parent_class)->finalize(object);
+}
+
+static void
+ds_lookup_cache_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    DsLookupCache *self = DS_LOOKUP_CACHE(object);
+
+    switch (prop_id) {
+    case PROP_PATH:
+        g_value_set_string(value, self->path);
+        break;
+    case PROP_TTL:
+        g_value_set_uint(value, self->ttl);
+        break;
+    case PROP_NEGATIVE_TTL:
+        g_value_set_uint(value, self->negative_ttl);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_lookup_cache_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+    DsLookupCache *self = DS_LOOKUP_CACHE(object);
+
+    switch (prop_id) {
+    case PROP_PATH:
+        g_clear_pointer(&self->path, g_free);
+        self->path = g_value_dup_string(value);
+        if (self->path != NULL) {
+            ds_lookup_cache_load(self);
+        }
+        break;
+    case PROP_TTL:
+        self->ttl = g_value_get_uint(value);
+        break;
+    case PROP_NEGATIVE_TTL:
+        self->negative_ttl = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_lookup_cache_class_init(DsLookupCacheClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_lookup_cache_finalize;
+    gobject_class->get_property = ds_lookup_cache_get_property;
+    gobject_class->set_property = ds_lookup_cache_set_property;
+
+    g_object_class_install_property(
+        gobject_class, PROP_PATH,
+        g_param_spec_string("path", "path", "File the cache is persisted to",
+                            NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(
+        gobject_class, PROP_TTL,
+        g_param_spec_uint("ttl", "ttl", "seconds to keep results for snaps that were found",
+                          0, G_MAXUINT, 24 * 60 * 60, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+    g_object_class_install_property(
+        gobject_class, PROP_NEGATIVE_TTL,
+        g_param_spec_uint("negative-ttl", "negative ttl", "seconds to keep results for snaps that were not found",
+                          0, G_MAXUINT, 60 * 60, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+}
+
+static void
+ds_lookup_cache_init(DsLookupCache *self)
+{
+    self->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+DsLookupCache *
+ds_lookup_cache_new(const char *path)
+{
+    return g_object_new(DS_TYPE_LOOKUP_CACHE, "path", path, NULL);
+}
+
+/* Looks up the store result for snap_name, and the size of its
+ * download if known.  Returns FALSE if there is no result, or the
+ * result has expired. */
+gboolean
+ds_lookup_cache_lookup(DsLookupCache *self, const char *snap_name, DsLookupResult *result, gint64 *download_size)
+{
+    cache_entry_t *entry = g_hash_table_lookup(self->entries, snap_name);
+    guint ttl;
+
+    if (entry == NULL) {
+        ds_metrics_increment("lookup-cache-misses");
+        return FALSE;
+    }
+
+    ttl = entry->result == DS_LOOKUP_RESULT_FOUND ? self->ttl : self->negative_ttl;
+    if (now_seconds() - entry->time >= ttl) {
+        g_hash_table_remove(self->entries, snap_name);
+        ds_metrics_increment("lookup-cache-misses");
+        return FALSE;
+    }
+
+    ds_metrics_increment("lookup-cache-hits");
+    *result = entry->result;
+    if (download_size != NULL) {
+        *download_size = entry->download_size;
+    }
+    return TRUE;
+}
+
+/* Returns whether there is an unexpired result for snap_name, without
+ * counting it as a lookup */
+gboolean
+ds_lookup_cache_contains(DsLookupCache *self, const char *snap_name)
+{
+    cache_entry_t *entry = g_hash_table_lookup(self->entries, snap_name);
+
+    if (entry == NULL) {
+        return FALSE;
+    }
+    return now_seconds() - entry->time < (entry->result == DS_LOOKUP_RESULT_FOUND ? self->ttl : self->negative_ttl);
+}
+
+/* Stores the store result for snap_name.  download_size is 0 if it
+ * isn't known. */
+void
+ds_lookup_cache_insert(DsLookupCache *self, const char *snap_name, DsLookupResult result, gint64 download_size)
+{
+    cache_entry_t *entry = g_new0(cache_entry_t, 1);
+
+    entry->result = result;
+    entry->download_size = download_size;
+    entry->time = now_seconds();
+    g_hash_table_replace(self->entries, g_strdup(snap_name), entry);
+
+    if (self->path != NULL && self->save_id == 0) {
+        self->save_id = g_idle_add(G_SOURCE_FUNC(ds_lookup_cache_save), self);
+    }
+}
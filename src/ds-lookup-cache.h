@@ -0,0 +1,25 @@
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    /* No snap with this name exists in the store */
+    DS_LOOKUP_RESULT_NOT_FOUND,
+    /* The snap exists and is available on the stable channel */
+    DS_LOOKUP_RESULT_FOUND,
+    /* The snap exists, but is not available on the stable channel */
+    DS_LOOKUP_RESULT_UNAVAILABLE,
+} DsLookupResult;
+
+#define DS_TYPE_LOOKUP_CACHE (ds_lookup_cache_get_type())
+G_DECLARE_FINAL_TYPE(DsLookupCache, ds_lookup_cache, DS, LOOKUP_CACHE, GObject);
+
+DsLookupCache *ds_lookup_cache_new(const char *path);
+
+gboolean ds_lookup_cache_lookup(DsLookupCache *self, const char *snap_name, DsLookupResult *result, gint64 *download_size);
+gboolean ds_lookup_cache_contains(DsLookupCache *self, const char *snap_name);
+void ds_lookup_cache_insert(DsLookupCache *self, const char *snap_name, DsLookupResult result, gint64 download_size);
+
+G_END_DECLS
@@ -0,0 +1,207 @@
+#include "ds-metrics.h"
+
+/* Durations are recorded in microseconds, and counted in power of two
+ * millisecond buckets, the last of which holds everything over 32
+ * seconds */
+#define N_BUCKETS 17
+
+typedef struct {
+    guint64 counts[N_BUCKETS];
+    guint64 total;
+    gint64 max_duration;
+} histogram_t;
+
+/* Name -> guint64 count */
+static GHashTable *counters = NULL;
+/* Name -> histogram_t */
+static GHashTable *histograms = NULL;
+
+static const char introspection_xml[] =
+    "<node>"
+    "  <interface name='" DS_METRICS_INTERFACE "'>"
+    "    <method name='GetCounters'>"
+    "      <arg type='a{st}' name='counters' direction='out'/>"
+    "    </method>"
+    "    <!-- All durations are in microseconds.  Bucket i counts durations"
+    "         below bucket_limits_us[i], and the last bucket the rest."
+    "         Histograms are (samples, max duration, bucket counts). -->"
+    "    <method name='GetHistograms'>"
+    "      <arg type='at' name='bucket_limits_us' direction='out'/>"
+    "      <arg type='a{s(ttat)}' name='histograms' direction='out'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+void
+ds_metrics_increment(const char *name)
+{
+    guint64 *count;
+
+    if (counters == NULL) {
+        counters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    count = g_hash_table_lookup(counters, name);
+    if (count == NULL) {
+        count = g_new0(guint64, 1);
+        g_hash_table_insert(counters, g_strdup(name), count);
+    }
+    (*count)++;
+}
+
+static guint
+get_bucket(gint64 duration)
+{
+    guint bucket = 0;
+
+    for (gint64 ms = duration / 1000; ms > 0 && bucket < N_BUCKETS - 1; ms >>= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+/* Records a duration, in microseconds */
+void
+ds_metrics_observe(const char *name, gint64 duration)
+{
+    histogram_t *histogram;
+
+    if (histograms == NULL) {
+        histograms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    histogram = g_hash_table_lookup(histograms, name);
+    if (histogram == NULL) {
+        histogram = g_new0(histogram_t, 1);
+        g_hash_table_insert(histograms, g_strdup(name), histogram);
+    }
+    histogram->counts[get_bucket(duration)]++;
+    histogram->total++;
+    histogram->max_duration = MAX(histogram->max_duration, duration);
+}
+
+void
+ds_metrics_timer_clear(DsMetricsTimer *timer)
+{
+    ds_metrics_observe(timer->name, g_get_monotonic_time() - timer->begin_time);
+}
+
+/* Logs the counters, and a histogram of each kind of duration */
+void
+ds_metrics_log_summary(void)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (counters != NULL) {
+        g_hash_table_iter_init(&iter, counters);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            g_message("%s: %" G_GUINT64_FORMAT, (const char *)key, *(guint64 *)value);
+        }
+    }
+
+    if (histograms == NULL) {
+        return;
+    }
+    g_hash_table_iter_init(&iter, histograms);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        histogram_t *histogram = value;
+        g_autoptr(GString) text = g_string_new(NULL);
+
+        for (guint i = 0; i < N_BUCKETS; i++) {
+            if (histogram->counts[i] == 0) {
+                continue;
+            }
+            if (i == 0) {
+                g_string_append_printf(text, " <1ms:%" G_GUINT64_FORMAT, histogram->counts[i]);
+            } else if (i == N_BUCKETS - 1) {
+                g_string_append_printf(text, " >=%ums:%" G_GUINT64_FORMAT, 1u << (i - 1), histogram->counts[i]);
+            } else {
+                g_string_append_printf(text, " <%ums:%" G_GUINT64_FORMAT, 1u << i, histogram->counts[i]);
+            }
+        }
+        g_message("%s: %" G_GUINT64_FORMAT " samples, max %.1f ms,%s", (const char *)key,
+                  histogram->total, histogram->max_duration / 1000.0, text->str);
+    }
+}
+
+static GVariant *
+get_counters(void)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+    if (counters != NULL) {
+        g_hash_table_iter_init(&iter, counters);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            g_variant_builder_add(&builder, "{st}", key, *(guint64 *)value);
+        }
+    }
+    return g_variant_new("(a{st})", &builder);
+}
+
+/* Bucket i holds durations below limit i, except the last which has
+ * no upper limit.  Limits and durations are both in microseconds. */
+static GVariant *
+get_histograms(void)
+{
+    GVariantBuilder limits_builder, builder;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_variant_builder_init(&limits_builder, G_VARIANT_TYPE("at"));
+    for (guint i = 0; i < N_BUCKETS - 1; i++) {
+        g_variant_builder_add(&limits_builder, "t", (guint64)G_TIME_SPAN_MILLISECOND << i);
+    }
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(ttat)}"));
+    if (histograms != NULL) {
+        g_hash_table_iter_init(&iter, histograms);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            histogram_t *histogram = value;
+
+            g_variant_builder_add(&builder, "{s(tt@at)}", key,
+                                  histogram->total, (guint64)histogram->max_duration,
+                                  g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, histogram->counts,
+                                                            N_BUCKETS, sizeof(guint64)));
+        }
+    }
+    return g_variant_new("(at@a{s(ttat)})", &limits_builder, g_variant_builder_end(&builder));
+}
+
+static void
+handle_method_call(GDBusConnection *connection, const char *sender,
+                   const char *object_path, const char *interface_name,
+                   const char *method_name, GVariant *parameters,
+                   GDBusMethodInvocation *invocation, gpointer user_data)
+{
+    if (g_strcmp0(method_name, "GetCounters") == 0) {
+        g_dbus_method_invocation_return_value(invocation, get_counters());
+    } else if (g_strcmp0(method_name, "GetHistograms") == 0) {
+        g_dbus_method_invocation_return_value(invocation, get_histograms());
+    } else {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "Unknown method %s", method_name);
+    }
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+    handle_method_call,
+    NULL,
+    NULL,
+};
+
+/* Exports the metrics on connection, returning the registration ID or
+ * 0 on error */
+guint
+ds_metrics_register(GDBusConnection *connection, GError **error)
+{
+    g_autoptr(GDBusNodeInfo) node_info = g_dbus_node_info_new_for_xml(introspection_xml, error);
+
+    if (node_info == NULL) {
+        return 0;
+    }
+    return g_dbus_connection_register_object(connection, DS_METRICS_OBJECT_PATH,
+                                             node_info->interfaces[0], &interface_vtable,
+                                             NULL, NULL, error);
+}
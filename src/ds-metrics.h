@@ -0,0 +1,32 @@
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define DS_METRICS_OBJECT_PATH "/io/snapcraft/SnapdDesktopIntegration/Metrics"
+#define DS_METRICS_INTERFACE "io.snapcraft.SnapdDesktopIntegration.Metrics"
+
+/* Process wide counters and duration histograms */
+
+void ds_metrics_increment(const char *name);
+void ds_metrics_observe(const char *name, gint64 duration);
+
+void ds_metrics_log_summary(void);
+
+guint ds_metrics_register(GDBusConnection *connection, GError **error);
+
+/* Records the time until the end of the enclosing scope */
+typedef struct {
+    const char *name;
+    gint64 begin_time;
+} DsMetricsTimer;
+
+void ds_metrics_timer_clear(DsMetricsTimer *timer);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(DsMetricsTimer, ds_metrics_timer_clear);
+
+#define DS_METRICS_TIME_CALLBACK() \
+    G_GNUC_UNUSED g_auto(DsMetricsTimer) callback_timer = { G_STRFUNC, g_get_monotonic_time() }
+
+G_END_DECLS
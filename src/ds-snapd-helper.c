@@ -1,27 +1,206 @@
 #include "ds-snapd-helper.h"
+#include "ds-circuit-breaker.h"
+#include "ds-decision-store.h"
+#include "ds-metrics.h"
+#include "ds-store-catalog.h"
+#include "ds-theme-index.h"
+#include "ds-trace.h"
+
+/* How long snapd may hold a notices request open, and how long to wait
+ * before resubscribing after an error */
+#define NOTICES_TIMEOUT (60 * G_TIME_SPAN_SECOND)
+#define NOTICES_RETRY_DELAY 30
+/* How many completed changes to remember, so each is only handled once */
+#define MAX_HANDLED_CHANGES 64
+
+/* Host themes are looked up after startup has settled, one search at a
+ * time with a gap between them.  Times are in seconds and
+ * milliseconds, respectively. */
+#define PREFETCH_START_DELAY 30
+#define PREFETCH_INTERVAL 500
+#define PREFETCH_MAX_NAMES 500
+
+/* Maximum number of store lookups made at once */
+#define MAX_CONCURRENT_LOOKUPS 8
+
+/* Minimum time between install progress reports, in milliseconds */
+#define PROGRESS_INTERVAL 500
+
+/* Maximum number of installs made at once, and on a metered network */
+#define MAX_CONCURRENT_INSTALLS 2
+#define MAX_METERED_INSTALLS 1
+
+/* Larger downloads wait for an unmetered network, in bytes */
+#define MAX_METERED_DOWNLOAD (50 * 1000 * 1000)
+/* Size of a download that isn't known, sorting after every other */
+#define UNKNOWN_DOWNLOAD_SIZE G_MAXUINT64
+
+typedef struct _check_t check_t;
+typedef struct _lookup_t lookup_t;
+
+typedef struct {
+    /* Theme set the component was last resolved for, which keeps its
+     * interned name alive */
+    DsThemeSet *themes;
+    /* The snap providing the theme, or NULL if there is none */
+    SnapdSnap *snap;
+} component_result_t;
+
+/* Identifies a request to the circuit breakers that allowed it */
+typedef struct {
+    guint64 snapd;
+    guint64 store;
+} request_ticket_t;
+
+/* A request whose callback doesn't hold a reference to the helper, as
+ * it is cancelled when the helper is finalized */
+typedef struct {
+    DsSnapdHelper *self;
+    request_ticket_t ticket;
+} helper_request_t;
 
 struct _DsSnapdHelper {
     GObject parent;
 
     SnapdClient *client;
+
+    /* Installed theme index, and where it is cached between runs */
+    DsThemeIndex *installed_themes;
+    char *installed_themes_path;
+    /* Whether installed_themes is known to match snapd's state */
+    gboolean installed_themes_current;
+    /* Tasks waiting for the installed themes being fetched, if any */
+    GPtrArray *installed_themes_waiters;
+    request_ticket_t installed_themes_ticket;
+
+    /* Subscription to snapd notices, used to keep the index current */
+    GCancellable *notices_cancellable;
+    GDateTime *notices_since;
+    guint notices_retry_id;
+    /* Recently handled changes, oldest first */
+    GHashTable *handled_changes;
+    GQueue *handled_order;
+    /* Whether content slots are being fetched, and need fetching again */
+    gboolean content_refresh_running;
+    gboolean content_refresh_pending;
+
+    /* Results of recent store lookups */
+    DsLookupCache *lookup_cache;
+    /* Snaps the user declined to install */
+    DsDecisionStore *decisions;
+    /* Store lookups in progress or waiting to start, keyed by snap name */
+    GHashTable *lookups;
+    GQueue *lookup_queue;
+    guint running_lookups;
+    /* Number of requests made to snapd */
+    guint snapd_requests;
+    /* Hold off requests while snapd or the store are failing */
+    DsCircuitBreaker *snapd_breaker;
+    DsCircuitBreaker *store_breaker;
+
+    /* Local index of theme snaps in the store, if enabled */
+    DsStoreCatalog *store_catalog;
+    GCancellable *catalog_cancellable;
+
+    /* Themes installed on the host, if known */
+    DsHostThemes *host_themes;
+
+    /* Snap names still to be looked up ahead of time */
+    GQueue *prefetch_queue;
+    guint prefetch_id;
+    GCancellable *prefetch_cancellable;
+
+    /* The check for missing snaps currently in progress */
+    check_t *current_check;
+    /* Components changed for checks that were abandoned unresolved */
+    guint unresolved_changed;
+    /* Independent queries in progress, keyed by theme set */
+    GHashTable *queries;
+    /* Resolves theme sets elsewhere, such as in the broker, if set */
+    GObject *resolver;
+    DsSnapdHelperResolveFunc resolve;
+    DsSnapdHelperResolveFinishFunc resolve_finish;
+
+    /* How each theme component was last resolved */
+    component_result_t resolved[DS_THEME_COMPONENT_LAST];
+    /* The theme set most recently checked */
+    DsThemeSet *last_themes;
+
+    /* Names of the snaps being installed */
+    GHashTable *installing;
+    /* Installs waiting to start, in the order they should be made */
+    GQueue *install_queue;
+    guint running_installs;
+    /* Decides when downloads can be made */
+    GNetworkMonitor *network_monitor;
 };
 
 G_DEFINE_TYPE(DsSnapdHelper, ds_snapd_helper, G_TYPE_OBJECT);
 
 enum {
     PROP_CLIENT = 1,
+    PROP_NETWORK_MONITOR,
     PROP_LAST,
 };
 
+enum {
+    NEEDED_THEMES_INSTALLED,
+    LAST_SIGNAL,
+};
+
+static guint helper_signals[LAST_SIGNAL] = { 0 };
+
 static void
 ds_snapd_helper_finalize(GObject *object)
 {
     DsSnapdHelper *self = DS_SNAPD_HELPER(object);
 
+    if (self->notices_cancellable != NULL) {
+        g_cancellable_cancel(self->notices_cancellable);
+    }
+    g_clear_object(&self->notices_cancellable);
+    g_clear_handle_id(&self->notices_retry_id, g_source_remove);
+    g_clear_pointer(&self->notices_since, g_date_time_unref);
+    g_clear_pointer(&self->handled_changes, g_hash_table_unref);
+    g_clear_pointer(&self->handled_order, g_queue_free);
+    g_clear_pointer(&self->last_themes, ds_theme_set_unref);
+    g_clear_pointer(&self->queries, g_hash_table_unref);
+    g_clear_pointer(&self->lookups, g_hash_table_unref);
+    g_clear_pointer(&self->lookup_queue, g_queue_free);
+    g_clear_pointer(&self->installing, g_hash_table_unref);
+    g_clear_pointer(&self->install_queue, g_queue_free);
+    if (self->network_monitor != NULL) {
+        g_signal_handlers_disconnect_by_data(self->network_monitor, self);
+    }
+    g_clear_object(&self->network_monitor);
+    g_clear_object(&self->resolver);
+    g_cancellable_cancel(self->catalog_cancellable);
+    g_clear_object(&self->catalog_cancellable);
+    g_clear_object(&self->store_catalog);
+    g_clear_handle_id(&self->prefetch_id, g_source_remove);
+    g_clear_object(&self->host_themes);
+    g_cancellable_cancel(self->prefetch_cancellable);
+    g_clear_object(&self->prefetch_cancellable);
+    if (self->prefetch_queue != NULL) {
+        g_queue_free_full(g_steal_pointer(&self->prefetch_queue), g_free);
+    }
+
     g_clear_object(&self->client);
+    g_clear_pointer(&self->installed_themes, ds_theme_index_unref);
+    g_clear_pointer(&self->installed_themes_path, g_free);
+    g_clear_object(&self->lookup_cache);
+    g_clear_object(&self->decisions);
+    g_clear_object(&self->snapd_breaker);
+    g_clear_object(&self->store_breaker);
+    for (int component = 0; component < DS_THEME_COMPONENT_LAST; component++) {
+        g_clear_pointer(&self->resolved[component].themes, ds_theme_set_unref);
+        g_clear_object(&self->resolved[component].snap);
+    }
     G_OBJECT_CLASS(ds_snapd_helper_parent_class)->finalize(object);
 }
 
+static void set_network_monitor(DsSnapdHelper *self, GNetworkMonitor *network_monitor);
+
 static void
 ds_snapd_helper_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
 {
@@ -31,6 +210,9 @@ ds_snapd_helper_get_property(GObject *object, guint prop_id, GValue *value, GPar
     case PROP_CLIENT:
         g_value_set_object(value, self->client);
         break;
+    case PROP_NETWORK_MONITOR:
+        g_value_set_object(value, self->network_monitor);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -47,6 +229,9 @@ ds_snapd_helper_set_property(GObject *object, guint prop_id, const GValue *value
         g_clear_object(&self->client);
         self->client = g_value_dup_object(value);
         break;
+    case PROP_NETWORK_MONITOR:
+        set_network_monitor(self, g_value_get_object(value));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -66,11 +251,57 @@ ds_snapd_helper_class_init(DsSnapdHelperClass *klass)
         gobject_class, PROP_CLIENT,
         g_param_spec_object("client", "client", "SnapdClient to use",
                             SNAPD_TYPE_CLIENT, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(
+        gobject_class, PROP_NETWORK_MONITOR,
+        g_param_spec_object("network-monitor", "network monitor", "GNetworkMonitor to schedule installs by, or NULL for the default",
+                            G_TYPE_NETWORK_MONITOR, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    /* Emitted when a snap providing a theme from the most recently
+     * checked theme set has been installed */
+    helper_signals[NEEDED_THEMES_INSTALLED] = g_signal_new(
+        "needed-themes-installed", G_TYPE_FROM_CLASS (gobject_class),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+        G_TYPE_NONE, 1, DS_TYPE_THEME_SET);
 }
 
 static void
 ds_snapd_helper_init(DsSnapdHelper *self)
 {
+    g_autoptr(GError) error = NULL;
+    g_autofree char *lookup_cache_path = NULL;
+    g_autofree char *decisions_path = NULL;
+    g_autofree char *snapd_breaker_path = NULL;
+    g_autofree char *store_breaker_path = NULL;
+
+    self->handled_changes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    self->handled_order = g_queue_new();
+    self->queries = g_hash_table_new((GHashFunc)ds_theme_set_hash, (GEqualFunc)ds_theme_set_equal);
+    self->lookups = g_hash_table_new(g_str_hash, g_str_equal);
+    self->lookup_queue = g_queue_new();
+    self->installing = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    self->install_queue = g_queue_new();
+
+    self->installed_themes_path = g_build_filename(
+        g_get_user_cache_dir(), "snapd-desktop-integration", "installed-themes", NULL);
+    self->installed_themes = ds_theme_index_load(self->installed_themes_path, &error);
+    if (self->installed_themes == NULL && !g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        g_warning("Could not load installed theme cache: %s", error->message);
+    }
+
+    lookup_cache_path = g_build_filename(
+        g_get_user_cache_dir(), "snapd-desktop-integration", "store-lookups", NULL);
+    self->lookup_cache = ds_lookup_cache_new(lookup_cache_path);
+
+    decisions_path = g_build_filename(
+        g_get_user_cache_dir(), "snapd-desktop-integration", "declined-snaps", NULL);
+    self->decisions = ds_decision_store_new(decisions_path);
+
+    snapd_breaker_path = g_build_filename(
+        g_get_user_cache_dir(), "snapd-desktop-integration", "snapd-breaker", NULL);
+    self->snapd_breaker = ds_circuit_breaker_new("snapd", snapd_breaker_path);
+    store_breaker_path = g_build_filename(
+        g_get_user_cache_dir(), "snapd-desktop-integration", "store-breaker", NULL);
+    self->store_breaker = ds_circuit_breaker_new("store", store_breaker_path);
 }
 
 DsSnapdHelper *
@@ -79,24 +310,176 @@ ds_snapd_helper_new(SnapdClient *client)
     return g_object_new(DS_TYPE_SNAPD_HELPER, "client", client, NULL);
 }
 
-static int
-string_compare(gconstpointer a, gconstpointer b)
+DsLookupCache *
+ds_snapd_helper_get_lookup_cache(DsSnapdHelper *self)
+{
+    return self->lookup_cache;
+}
+
+static void
+count_snapd_request(DsSnapdHelper *self, const char *type)
+{
+    g_autofree char *name = g_strconcat("snapd-requests-", type, NULL);
+
+    self->snapd_requests++;
+    ds_metrics_increment(name);
+}
+
+/* Checks a request to snapd may be made, and counts it.  Returns FALSE,
+ * setting error, while snapd is failing.  The outcome must be passed
+ * to snapd_request_done() with the ticket. */
+static gboolean
+snapd_request_allowed(DsSnapdHelper *self, const char *type, request_ticket_t *ticket, GError **error)
+{
+    if (!ds_circuit_breaker_allow(self->snapd_breaker, &ticket->snapd, error)) {
+        return FALSE;
+    }
+    ticket->store = 0;
+    count_snapd_request(self, type);
+    return TRUE;
+}
+
+static helper_request_t *
+helper_request_new(DsSnapdHelper *self, const request_ticket_t *ticket)
+{
+    helper_request_t *request = g_new0(helper_request_t, 1);
+
+    request->self = self;
+    request->ticket = *ticket;
+    return request;
+}
+
+/* Whether snapd couldn't be reached, rather than reporting an error */
+static gboolean
+is_snapd_outage(const GError *error)
+{
+    return g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_CONNECTION_FAILED) ||
+           g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_WRITE_FAILED) ||
+           g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_READ_FAILED) ||
+           g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_BAD_RESPONSE);
+}
+
+static void
+report_request(DsCircuitBreaker *breaker, guint64 ticket, gboolean failed, const GError *error)
 {
-    const char *name1 = *((const char **)a);
-    const char *name2 = *((const char **)b);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        ds_circuit_breaker_abandoned(breaker, ticket);
+    } else if (failed) {
+        ds_circuit_breaker_failed(breaker, ticket);
+    } else {
+        ds_circuit_breaker_succeeded(breaker, ticket);
+    }
+}
 
-    return strcmp(name1, name2);
+static void
+snapd_request_done(DsSnapdHelper *self, const request_ticket_t *ticket, const GError *error)
+{
+    report_request(self->snapd_breaker, ticket->snapd, is_snapd_outage(error), error);
 }
 
+/* As snapd_request_allowed(), for requests snapd passes on to the
+ * store.  These are held off if either is failing. */
 static gboolean
-array_contains(const char *key, const GPtrArray *array)
+store_request_allowed(DsSnapdHelper *self, const char *type, request_ticket_t *ticket, GError **error)
+{
+    if (!ds_circuit_breaker_allow(self->snapd_breaker, &ticket->snapd, error)) {
+        return FALSE;
+    }
+    if (!ds_circuit_breaker_allow(self->store_breaker, &ticket->store, error)) {
+        ds_circuit_breaker_abandoned(self->snapd_breaker, ticket->snapd);
+        return FALSE;
+    }
+    if (type != NULL) {
+        count_snapd_request(self, type);
+    }
+    return TRUE;
+}
+
+/* Any error but the snap not existing means the store is failing */
+static void
+store_request_done(DsSnapdHelper *self, const request_ticket_t *ticket, const GError *error)
+{
+    if (is_snapd_outage(error)) {
+        ds_circuit_breaker_failed(self->snapd_breaker, ticket->snapd);
+        ds_circuit_breaker_abandoned(self->store_breaker, ticket->store);
+        return;
+    }
+    report_request(self->snapd_breaker, ticket->snapd, FALSE, error);
+    report_request(self->store_breaker, ticket->store,
+                   error != NULL && !g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_NOT_FOUND), error);
+}
+
+guint
+ds_snapd_helper_get_snapd_requests(DsSnapdHelper *self)
+{
+    return self->snapd_requests;
+}
+
+/* Skip store lookups for themes that aren't installed on the host, and
+ * allow host themes to be prefetched */
+void
+ds_snapd_helper_set_host_themes(DsSnapdHelper *self, DsHostThemes *host_themes)
+{
+    g_set_object(&self->host_themes, host_themes);
+}
+
+/* Resolve theme snaps from a local catalog of the store's theme snaps,
+ * refreshed periodically, rather than searching for each name */
+void
+ds_snapd_helper_use_store_catalog(DsSnapdHelper *self)
+{
+    g_autofree char *path = NULL;
+
+    if (self->store_catalog != NULL) {
+        return;
+    }
+    path = g_build_filename(g_get_user_cache_dir(), "snapd-desktop-integration", "store-catalog", NULL);
+    self->store_catalog = ds_store_catalog_new(path);
+}
+
+static void
+refresh_catalog_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    g_autofree helper_request_t *request = user_data;
+    DsSnapdHelper *self = request->self;
+    g_autoptr(GError) error = NULL;
+
+    /* Only cancelled when the helper is finalized */
+    if (!ds_store_catalog_refresh_finish(DS_STORE_CATALOG(object), result, &error) &&
+        g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    store_request_done(self, &request->ticket, error);
+    if (error != NULL) {
+        g_warning("Could not refresh store catalog: %s", error->message);
+    }
+    g_clear_object(&self->catalog_cancellable);
+}
+
+/* Refreshes the catalog in the background when it is out of date.  The
+ * callback doesn't hold a reference to the helper: the refresh is
+ * cancelled when it is finalized. */
+static void
+maybe_refresh_catalog(DsSnapdHelper *self)
 {
-    return bsearch(&key, array->pdata, array->len, sizeof(char *), string_compare) != NULL;
+    request_ticket_t ticket;
+
+    if (self->store_catalog == NULL || self->catalog_cancellable != NULL ||
+        !ds_store_catalog_needs_refresh(self->store_catalog) ||
+        !store_request_allowed(self, NULL, &ticket, NULL)) {
+        return;
+    }
+
+    self->catalog_cancellable = g_cancellable_new();
+    ds_store_catalog_refresh(self->store_catalog, self->client, self->catalog_cancellable,
+                             refresh_catalog_cb, helper_request_new(self, &ticket));
 }
 
 static void
-extract_themes(SnapdSlot *slot, GPtrArray *themes)
+extract_themes(SnapdSlot *slot, DsThemeIndex *index, DsThemeKind kind)
 {
+    const char *snap_name = snapd_slot_get_snap(slot);
     GVariant *source, *read, *entry;
     GVariantIter iter;
 
@@ -115,379 +498,2313 @@ extract_themes(SnapdSlot *slot, GPtrArray *themes)
         GVariant *inner = g_variant_get_variant(entry);
         if (g_variant_is_of_type(inner, G_VARIANT_TYPE_STRING)) {
             const char *path = g_variant_get_string(inner, NULL);
-            g_ptr_array_add(themes, g_path_get_basename(path));
+            g_autofree char *theme_name = g_path_get_basename(path);
+            ds_theme_index_add(index, snap_name, kind, theme_name);
         }
         g_variant_unref(entry);
     }
 }
 
+/* Adds the themes provided by a content interface slot to the index */
 static void
-get_interfaces_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+index_slot(DsThemeIndex *index, SnapdSlot *slot)
 {
-    SnapdClient *client = SNAPD_CLIENT(object);
-    g_autoptr(GTask) task = user_data;
-    g_autoptr(GError) error = NULL;
-    g_autoptr(GPtrArray) interfaces = NULL;
-    g_autoptr(GPtrArray) gtk_themes = NULL;
-    g_autoptr(GPtrArray) icon_themes = NULL;
-    g_autoptr(GPtrArray) sound_themes = NULL;
-
-    interfaces = snapd_client_get_interfaces2_finish(client, result, &error);
-    if (!interfaces) {
-        g_task_return_error(task, g_steal_pointer(&error));
-        return;
+    GVariant *value;
+    const char *content = NULL;
+    DsThemeKind kind;
+
+    /* Get the ID for this content interface slot */
+    value = snapd_slot_get_attribute(slot, "content");
+    if (value != NULL && g_variant_is_of_type(value, G_VARIANT_TYPE_STRING)) {
+        content = g_variant_get_string(value, NULL);
     }
+    if (ds_theme_index_get_content_kind(content, &kind)) {
+        extract_themes(slot, index, kind);
+    }
+}
 
-    gtk_themes = g_ptr_array_new_with_free_func(g_free);
-    icon_themes = g_ptr_array_new_with_free_func(g_free);
-    sound_themes = g_ptr_array_new_with_free_func(g_free);
+/* Computes a revision string for snapd's interface state from its list
+ * of changes.  Change IDs only ever increase, so any install, removal,
+ * refresh or connection bumps the revision.  Returns NULL if a change
+ * is still in progress, in which case the state cannot be cached. */
+static char *
+get_changes_revision(GPtrArray *changes)
+{
+    guint64 last_id = 0;
 
-    for (guint i = 0; i < interfaces->len; i++) {
-        SnapdInterface *iface = interfaces->pdata[i];
-        GPtrArray *slots = snapd_interface_get_slots(iface);
+    for (guint i = 0; i < changes->len; i++) {
+        SnapdChange *change = changes->pdata[i];
+        guint64 id;
 
-        if (strcmp(snapd_interface_get_name(iface), "content") != 0) {
-            continue;
+        if (!snapd_change_get_ready(change)) {
+            return NULL;
         }
+        id = g_ascii_strtoull(snapd_change_get_id(change), NULL, 10);
+        last_id = MAX(last_id, id);
+    }
+    return g_strdup_printf("%" G_GUINT64_FORMAT, last_id);
+}
 
-        for (guint j = 0; j < slots->len; j++) {
-            SnapdSlot *slot = slots->pdata[j];
-            GVariant *value;
-            const char *content = NULL;
-
-            /* Get the ID for this content interface slot */
-            value = snapd_slot_get_attribute(slot, "content");
-            if (value != NULL && g_variant_is_of_type(value, G_VARIANT_TYPE_STRING)) {
-                content = g_variant_get_string(value, NULL);
-            }
-            if (content == NULL) {
-                continue;
-            }
+static DsThemeKind
+component_kind(DsThemeComponent component)
+{
+    switch (component) {
+    case DS_THEME_COMPONENT_GTK:
+        return DS_THEME_KIND_GTK;
+    case DS_THEME_COMPONENT_ICON:
+    case DS_THEME_COMPONENT_CURSOR:
+        return DS_THEME_KIND_ICON;
+    case DS_THEME_COMPONENT_SOUND:
+    default:
+        return DS_THEME_KIND_SOUND;
+    }
+}
 
-            if (!strcmp(content, "gtk-3-themes")) {
-                extract_themes(slot, gtk_themes);
-            } else if (!strcmp(content, "icon-themes")) {
-                extract_themes(slot, icon_themes);
-            } else if (!strcmp(content, "sound-themes")) {
-                extract_themes(slot, sound_themes);
-            }
-        }
+/* Returns the other kind of theme that can provide a component, if
+ * there is one: cursors also come from cursor-only themes, and a GTK
+ * theme packaged for GTK 4 only is still the user's GTK theme */
+static gboolean
+component_other_kind(DsThemeComponent component, DsThemeKind *kind)
+{
+    switch (component) {
+    case DS_THEME_COMPONENT_GTK:
+        *kind = DS_THEME_KIND_GTK4;
+        return TRUE;
+    case DS_THEME_COMPONENT_CURSOR:
+        *kind = DS_THEME_KIND_CURSOR;
+        return TRUE;
+    default:
+        return FALSE;
     }
-    g_ptr_array_sort(gtk_themes, string_compare);
-    g_ptr_array_sort(icon_themes, string_compare);
-    g_ptr_array_sort(sound_themes, string_compare);
+}
 
-    g_object_set_data_full(G_OBJECT(task), "gtk-themes", g_steal_pointer(&gtk_themes), (GDestroyNotify)g_ptr_array_unref);
-    g_object_set_data_full(G_OBJECT(task), "icon-themes", g_steal_pointer(&icon_themes), (GDestroyNotify)g_ptr_array_unref);
-    g_object_set_data_full(G_OBJECT(task), "sound-themes", g_steal_pointer(&sound_themes), (GDestroyNotify)g_ptr_array_unref);
-    g_task_return_boolean(task, TRUE);
+static gboolean
+index_has_component(const DsThemeIndex *index, DsThemeComponent component, const char *theme_name)
+{
+    DsThemeKind other_kind;
+
+    if (component_other_kind(component, &other_kind) &&
+        ds_theme_index_contains(index, other_kind, theme_name)) {
+        return TRUE;
+    }
+    return ds_theme_index_contains(index, component_kind(component), theme_name);
 }
 
-void
-ds_snapd_helper_get_installed_themes(DsSnapdHelper *self, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+static gboolean
+host_has_component(DsHostThemes *host_themes, DsThemeComponent component, const char *theme_name)
 {
-    char *interfaces[] = { "content", NULL };
-    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    DsThemeKind other_kind;
 
-    snapd_client_get_interfaces2_async(
-        self->client, SNAPD_GET_INTERFACES_FLAGS_INCLUDE_SLOTS, interfaces,
-        cancellable, get_interfaces_cb, g_steal_pointer(&task));
+    if (component_other_kind(component, &other_kind) &&
+        ds_host_themes_contains(host_themes, other_kind, theme_name)) {
+        return TRUE;
+    }
+    return ds_host_themes_contains(host_themes, component_kind(component), theme_name);
 }
 
-gboolean
-ds_snapd_helper_get_installed_themes_finish(DsSnapdHelper *self, GAsyncResult *result, GPtrArray **gtk_themes, GPtrArray **icon_themes, GPtrArray **sound_themes, GError **error)
+/* Whether the host theme directories a component can come from have
+ * all been read, so a theme missing from them really is missing */
+static gboolean
+host_knows_component(DsHostThemes *host_themes, DsThemeComponent component)
 {
-    GTask *task = G_TASK(result);
+    DsThemeKind other_kind;
 
-    if (!g_task_propagate_boolean(task, error)) {
+    if (component_other_kind(component, &other_kind) &&
+        !ds_host_themes_is_known(host_themes, other_kind)) {
         return FALSE;
     }
+    return ds_host_themes_is_known(host_themes, component_kind(component));
+}
 
-    if (gtk_themes != NULL) {
-        *gtk_themes = g_ptr_array_ref(g_object_get_data(G_OBJECT(task), "gtk-themes"));
+/* Replaces the installed theme index.  If announce is set, and a theme
+ * component missing from the last check is now installed, the user is
+ * told about it. */
+static void
+set_installed_themes(DsSnapdHelper *self, DsThemeIndex *index, gboolean announce)
+{
+    g_autoptr(DsThemeIndex) old_index = g_steal_pointer(&self->installed_themes);
+    g_autoptr(GError) error = NULL;
+
+    self->installed_themes = ds_theme_index_ref(index);
+    if (ds_theme_index_get_revision(index) != NULL &&
+        !ds_theme_index_save(index, self->installed_themes_path, &error)) {
+        g_warning("Could not save installed theme cache: %s", error->message);
     }
-    if (icon_themes != NULL) {
-        *icon_themes = g_ptr_array_ref(g_object_get_data(G_OBJECT(task), "icon-themes"));
+
+    if (!announce || old_index == NULL || self->last_themes == NULL) {
+        return;
     }
-    if (gtk_themes != NULL) {
-        *sound_themes = g_ptr_array_ref(g_object_get_data(G_OBJECT(task), "sound-themes"));
+
+    /* Let the user know if something they were missing is now there */
+    for (int component = 0; component < DS_THEME_COMPONENT_LAST; component++) {
+        const char *theme_name = ds_theme_set_get_component(self->last_themes, component);
+        if (!index_has_component(old_index, component, theme_name) &&
+            index_has_component(index, component, theme_name)) {
+            /* A check in progress may be using the old index, so a
+             * new check mustn't join it and report the theme again */
+            if (self->current_check != NULL) {
+                self->current_check->stale = TRUE;
+            }
+            g_signal_emit(self, helper_signals[NEEDED_THEMES_INSTALLED], 0, self->last_themes);
+            return;
+        }
     }
-    return TRUE;
 }
 
-typedef struct  {
-    DsThemeSet *themes;
+static gboolean
+notices_active(DsSnapdHelper *self)
+{
+    return self->notices_cancellable != NULL && self->notices_retry_id == 0;
+}
 
-    int pending_lookups;
-    GPtrArray *missing_snaps;
-    GError *error;
-} find_missing_data_t;
+/* The content slots an index is built from on a worker thread */
+typedef struct {
+    GPtrArray *slots;
+    char *revision;
+    gint64 start_time;
+} build_index_data_t;
 
-void
-find_missing_data_free(find_missing_data_t *data)
+static void
+build_index_data_free(build_index_data_t *data)
 {
-    g_clear_pointer(&data->themes, ds_theme_set_free);
-    g_clear_pointer(&data->missing_snaps, g_ptr_array_unref);
-    g_clear_pointer(&data->error, g_error_free);
+    g_clear_pointer(&data->slots, g_ptr_array_unref);
+    g_free(data->revision);
     g_free(data);
 }
 
-void
-maybe_complete_find_missing_task(GTask *task)
+/* Runs in a thread, so it only uses the task data, which nothing else
+ * refers to, and the new index, which isn't published until it
+ * returns */
+static void
+build_index_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
 {
-    find_missing_data_t *data = g_task_get_task_data(task);
+    build_index_data_t *data = task_data;
+    g_autoptr(DsThemeIndex) index = ds_theme_index_new(data->revision);
 
-    /* If there are pending lookups, don't do anything */
-    if (data->pending_lookups > 0) {
-        return;
-    }
-    if (data->error == NULL) {
-        g_task_return_pointer(task, g_steal_pointer(&data->missing_snaps),
-                              (GDestroyNotify)g_ptr_array_unref);
-    } else {
-        g_task_return_error(task, g_steal_pointer(&data->error));
+    for (guint i = 0; i < data->slots->len; i++) {
+        index_slot(index, data->slots->pdata[i]);
     }
+
+    g_task_return_pointer(task, g_steal_pointer(&index), (GDestroyNotify)ds_theme_index_unref);
 }
 
-char *
-make_package_name(const char *prefix, const char *theme_name)
+/* Builds an index of content slots.  Walking thousands of slots would
+ * stall the main loop, so it is done on a worker thread. */
+static void
+build_index_async(DsSnapdHelper *self, GPtrArray *slots, const char *revision, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
 {
-    g_autofree char *name = g_ascii_strdown(theme_name, -1);
-    char *a, *b;
+    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    build_index_data_t *data = g_new0(build_index_data_t, 1);
 
-    /* strip out non alphanumeric characters from name */
-    for (a = b = name; *a != '\0'; a++) {
-        if (g_ascii_isalnum(*a)) {
-            *b = *a;
-            b++;
-        } else if (*a == '-' && b != name && *(b-1) != '-') {
-            /* Allow dashes, provided they aren't at the beginning or
-             * preceded by another dash */
-            *b = '-';
-            b++;
-        }
-    }
-    *b = '\0';
-    /* trim trailing dashes */
-    while (b != name && *(b-1) == '-') {
-        b--;
-        *b = '\0';
-    }
-    return g_strconcat(prefix, name, NULL);
+    data->slots = g_ptr_array_ref(slots);
+    data->revision = g_strdup(revision);
+    data->start_time = g_get_monotonic_time();
+    g_task_set_task_data(task, data, (GDestroyNotify)build_index_data_free);
+    g_task_run_in_thread(task, build_index_thread);
 }
 
-/* trim off last dash separated segment of the snap name, provided the
- * result has three or more portions. */
-char *
-shorten_package_name(const char *snap_name)
+static DsThemeIndex *
+build_index_finish(GAsyncResult *result, GError **error)
 {
-    const char *pos = snap_name, *last_dash = NULL;
-    int dash_count = 0;
+    build_index_data_t *data = g_task_get_task_data(G_TASK(result));
 
-    while (pos != NULL) {
-        pos = strchr(pos, '-');
-        if (pos != NULL) {
-            last_dash = pos;
-            dash_count++;
-            pos++;
-        }
+    ds_metrics_observe("build-theme-index", g_get_monotonic_time() - data->start_time);
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/* Kinds of change that install, remove or replace snaps, and so may
+ * change their content slots */
+static const char *snap_change_kinds[] = {
+    "install-snap",
+    "refresh-snap",
+    "auto-refresh",
+    "revert-snap",
+    "enable-snap",
+    "try-snap",
+    "remove-snap",
+    "disable-snap",
+    NULL,
+};
+
+/* Records a change as handled.  Returns FALSE if it already was.  Only
+ * the most recent changes are remembered, as notices are only fetched
+ * for changes since the last one seen. */
+static gboolean
+mark_change_handled(DsSnapdHelper *self, const char *change_id)
+{
+    char *id;
+
+    if (g_hash_table_contains(self->handled_changes, change_id)) {
+        return FALSE;
     }
-    if (dash_count < 3) {
-        return NULL;
+
+    id = g_strdup(change_id);
+    g_hash_table_add(self->handled_changes, id);
+    g_queue_push_tail(self->handled_order, id);
+    while (g_queue_get_length(self->handled_order) > MAX_HANDLED_CHANGES) {
+        g_hash_table_remove(self->handled_changes, g_queue_pop_head(self->handled_order));
     }
-    return g_strndup(snap_name, last_dash - snap_name);
+    return TRUE;
 }
 
 typedef struct {
-    GTask *task;
+    DsSnapdHelper *self;
     char *snap_name;
-} find_package_data_t;
+    /* Whether the snap was installed by the helper, and is marked as
+     * being installed until the index has been updated */
+    gboolean installed;
+    request_ticket_t ticket;
+} snap_slots_data_t;
 
-void find_package_data_free(find_package_data_t *data)
+static void
+snap_slots_data_free(snap_slots_data_t *data)
 {
-    g_clear_object(&data->task);
+    if (data->installed) {
+        g_hash_table_remove(data->self->installing, data->snap_name);
+    }
+    g_clear_object(&data->self);
     g_free(data->snap_name);
     g_free(data);
 }
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC(find_package_data_t, find_package_data_free);
-
-static void find_package(GTask *task, const char *snap_name);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(snap_slots_data_t, snap_slots_data_free);
 
 static void
-find_package_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+get_snap_slots_cb(GObject *object, GAsyncResult *result, gpointer user_data)
 {
+    DS_METRICS_TIME_CALLBACK();
     SnapdClient *client = SNAPD_CLIENT(object);
-    g_autoptr(find_package_data_t) find_data = user_data;
-    find_missing_data_t *data = g_task_get_task_data(find_data->task);
-    g_autoptr(GPtrArray) snaps = NULL;
+    g_autoptr(snap_slots_data_t) data = user_data;
+    DsSnapdHelper *self = data->self;
+    g_autoptr(GPtrArray) slots = NULL;
     g_autoptr(GError) error = NULL;
-    SnapdSnap *snap;
-
-    data->pending_lookups--;
+    g_autoptr(DsThemeIndex) index = NULL;
 
-    snaps = snapd_client_find_finish(client, result, NULL, &error);
-    if (snaps == NULL) {
-        if (g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_NOT_FOUND)) {
-            g_print("Snap: %s not found\n", find_data->snap_name);
-            g_autofree char *shorter_snap_name = shorten_package_name(find_data->snap_name);
-            if (shorter_snap_name != NULL) {
-                find_package(find_data->task, shorter_snap_name);
-            }
-        } else if (data->error != NULL) {
-            data->error = g_steal_pointer(&error);
+    snapd_client_get_connections2_finish(client, result, NULL, NULL, NULL, &slots, &error);
+    snapd_request_done(self, &data->ticket, error);
+    if (error != NULL) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            return;
         }
-        goto end;
+        g_warning("Could not get slots of snap %s: %s", data->snap_name, error->message);
+        self->installed_themes_current = FALSE;
+        return;
     }
-
-    if (snaps->len == 0) {
-        goto end;
+    if (self->installed_themes == NULL) {
+        return;
     }
-    snap = snaps->pdata[0];
-    if (!strcmp(snapd_snap_get_channel(snap), "stable")) {
-        g_ptr_array_add(data->missing_snaps, g_object_ref(snap));
+
+    index = ds_theme_index_copy(self->installed_themes, NULL);
+    ds_theme_index_remove_snap(index, data->snap_name);
+    for (guint i = 0; i < slots->len; i++) {
+        SnapdSlot *slot = slots->pdata[i];
+
+        if (g_strcmp0(snapd_slot_get_snap(slot), data->snap_name) == 0) {
+            index_slot(index, slot);
+        }
     }
 
-end:
-    maybe_complete_find_missing_task(find_data->task);
+    g_message("Updated installed themes for snap %s", data->snap_name);
+    set_installed_themes(self, index, TRUE);
 }
 
+/* Updates the index from the content slots of one snap, rather than
+ * fetching every slot again */
 static void
-find_package(GTask *task, const char *snap_name) {
-    DsSnapdHelper *self = g_task_get_source_object(task);
-    find_missing_data_t *data = g_task_get_task_data(task);
-    g_autoptr(find_package_data_t) find_data = g_new0(find_package_data_t, 1);
+update_snap_themes(DsSnapdHelper *self, const char *snap_name, gboolean installed)
+{
+    snap_slots_data_t *data;
+    request_ticket_t ticket;
+    g_autoptr(GError) error = NULL;
 
-    find_data->task = g_object_ref(task);
-    find_data->snap_name = g_strdup(snap_name);
+    /* Without an index, the next check does a full scan anyway */
+    if (self->installed_themes == NULL) {
+        if (installed) {
+            g_hash_table_remove(self->installing, snap_name);
+        }
+        return;
+    }
 
-    data->pending_lookups++;
+    if (!snapd_request_allowed(self, "get-connections", &ticket, &error)) {
+        g_debug("Not updating themes of snap %s: %s", snap_name, error->message);
+        self->installed_themes_current = FALSE;
+        if (installed) {
+            g_hash_table_remove(self->installing, snap_name);
+        }
+        return;
+    }
 
-    g_print("Searching for snap: %s\n", snap_name);
-    snapd_client_find_async(
-        self->client, SNAPD_FIND_FLAGS_MATCH_NAME, snap_name,
-        g_task_get_cancellable(task), find_package_cb, g_steal_pointer(&find_data));
+    data = g_new0(snap_slots_data_t, 1);
+    data->self = g_object_ref(self);
+    data->snap_name = g_strdup(snap_name);
+    data->installed = installed;
+    data->ticket = ticket;
+    snapd_client_get_connections2_async(
+        self->client, SNAPD_GET_CONNECTIONS_FLAGS_SELECT_ALL, snap_name, "content",
+        self->notices_cancellable, get_snap_slots_cb, data);
 }
 
+static void refresh_content_slots(DsSnapdHelper *self);
+
 static void
-get_installed_themes_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+content_slots_done(DsSnapdHelper *self)
 {
-    g_autoptr(GTask) task = user_data;
-    DsSnapdHelper *self = g_task_get_source_object(task);
-    find_missing_data_t *data = g_task_get_task_data(task);
-    g_autoptr(GPtrArray) gtk_themes = NULL;
-    g_autoptr(GPtrArray) icon_themes = NULL;
-    g_autoptr(GPtrArray) sound_themes = NULL;
+    self->content_refresh_running = FALSE;
+    if (self->content_refresh_pending) {
+        self->content_refresh_pending = FALSE;
+        refresh_content_slots(self);
+    }
+}
+
+static void
+content_index_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    DsSnapdHelper *self = DS_SNAPD_HELPER(object);
+    g_autoptr(DsThemeIndex) index = NULL;
     g_autoptr(GError) error = NULL;
 
-    if (!ds_snapd_helper_get_installed_themes_finish(self, result, &gtk_themes, &icon_themes, &sound_themes, &error)) {
-        g_task_return_error(task, g_steal_pointer(&error));
+    index = build_index_finish(result, &error);
+    if (index == NULL) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            return;
+        }
+        g_warning("Could not index content slots: %s", error->message);
+        self->installed_themes_current = FALSE;
+    } else {
+        set_installed_themes(self, index, TRUE);
+    }
+    content_slots_done(self);
+}
+
+static void
+get_content_slots_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autofree helper_request_t *request = user_data;
+    DsSnapdHelper *self = request->self;
+    g_autoptr(GPtrArray) slots = NULL;
+    g_autoptr(GError) error = NULL;
+
+    /* Only cancelled when the helper is finalized */
+    if (!snapd_client_get_connections2_finish(client, result, NULL, NULL, NULL, &slots, &error) &&
+        g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    snapd_request_done(self, &request->ticket, error);
+    if (error != NULL) {
+        g_warning("Could not get content slots: %s", error->message);
+        self->installed_themes_current = FALSE;
+        content_slots_done(self);
         return;
     }
 
-    if (array_contains(data->themes->gtk_theme_name, gtk_themes)) {
-        g_message("GTK theme %s already available to snaps", data->themes->gtk_theme_name);
-    } else {
-        g_message("GTK theme %s not available to snaps", data->themes->gtk_theme_name);
-        g_autofree char *pkg = make_package_name("gtk-theme-", data->themes->gtk_theme_name);
-        find_package(task, pkg);
+    build_index_async(self, slots, NULL, self->notices_cancellable, content_index_cb, NULL);
+}
+
+/* Rebuilds the index from every content slot, with one request.  The
+ * index has no revision, so it isn't persisted: snapd's change list
+ * can't tell us whether other changes completed in the meantime.
+ * Changes that complete during a refresh cause another one. */
+static void
+refresh_content_slots(DsSnapdHelper *self)
+{
+    request_ticket_t ticket;
+    g_autoptr(GError) error = NULL;
+
+    if (self->content_refresh_running) {
+        self->content_refresh_pending = TRUE;
+        return;
     }
 
-    if (array_contains(data->themes->icon_theme_name, icon_themes)) {
-        g_message("Icon theme %s already available to snaps", data->themes->icon_theme_name);
-    } else {
-        g_message("Icon theme %s not available to snaps", data->themes->icon_theme_name);
-        g_autofree char *pkg = make_package_name("icon-theme-", data->themes->icon_theme_name);
-        find_package(task, pkg);
+    if (!snapd_request_allowed(self, "get-connections", &ticket, &error)) {
+        g_debug("Not updating installed themes: %s", error->message);
+        self->installed_themes_current = FALSE;
+        return;
     }
 
-    if (array_contains(data->themes->cursor_theme_name, icon_themes)) {
-        g_message("Cursor theme %s already available to snaps", data->themes->cursor_theme_name);
-    } else if (strcmp(data->themes->icon_theme_name,
-                      data->themes->cursor_theme_name) != 0) {
-        g_message("Cursor theme %s not available to snaps", data->themes->cursor_theme_name);
-        g_autofree char *pkg = make_package_name("icon-theme-", data->themes->cursor_theme_name);
-        find_package(task, pkg);
+    self->content_refresh_running = TRUE;
+    snapd_client_get_connections2_async(
+        self->client, SNAPD_GET_CONNECTIONS_FLAGS_SELECT_ALL, NULL, "content",
+        self->notices_cancellable, get_content_slots_cb, helper_request_new(self, &ticket));
+}
+
+/* Updates the index for a completed change.  Only the change kind is
+ * used: snapd-glib doesn't report which snaps most changes affected,
+ * so every content slot is fetched again. */
+static void
+handle_change(DsSnapdHelper *self, SnapdChange *change)
+{
+    if (!g_strv_contains(snap_change_kinds, snapd_change_get_kind(change))) {
+        return;
+    }
+    if (!mark_change_handled(self, snapd_change_get_id(change))) {
+        return;
     }
 
-    if (array_contains(data->themes->sound_theme_name, sound_themes)) {
-        g_message("Sound theme %s already available to snaps", data->themes->sound_theme_name);
-    } else {
-        g_message("Sound theme %s not available to snaps", data->themes->sound_theme_name);
-        g_autofree char *pkg = make_package_name("sound-theme-", data->themes->sound_theme_name);
-        find_package(task, pkg);
+    /* Without an index, the next check does a full scan anyway */
+    if (self->installed_themes == NULL) {
+        return;
     }
 
-    /* If we haven't queued any package lookups, complete the task */
-    maybe_complete_find_missing_task(task);
+    refresh_content_slots(self);
 }
 
-void
-ds_snapd_helper_find_missing_snaps(DsSnapdHelper *self, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+static void
+get_notice_change_cb(GObject *object, GAsyncResult *result, gpointer user_data)
 {
-    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
-    find_missing_data_t *data = g_new0(find_missing_data_t, 1);
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autofree helper_request_t *request = user_data;
+    DsSnapdHelper *self = request->self;
+    g_autoptr(SnapdChange) change = NULL;
+    g_autoptr(GError) error = NULL;
 
-    data->themes = ds_theme_set_copy(themes);
-    data->missing_snaps = g_ptr_array_new_with_free_func(g_object_unref);
-    g_task_set_task_data(task, data, (GDestroyNotify)find_missing_data_free);
+    /* Only cancelled when the helper is finalized */
+    change = snapd_client_get_change_finish(client, result, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    snapd_request_done(self, &request->ticket, error);
+    if (change == NULL) {
+        g_warning("Could not get snapd change: %s", error->message);
+        self->installed_themes_current = FALSE;
+        return;
+    }
 
-    ds_snapd_helper_get_installed_themes(self, cancellable, get_installed_themes_cb, g_steal_pointer(&task));
+    if (snapd_change_get_ready(change)) {
+        handle_change(self, change);
+    }
 }
 
-GPtrArray *
-ds_snapd_helper_find_missing_snaps_finish(DsSnapdHelper *helper, GAsyncResult *result, GError **error)
+static void watch_notices(DsSnapdHelper *self);
+
+static gboolean
+retry_notices_cb(DsSnapdHelper *self)
 {
-    GTask *task = G_TASK(result);
+    self->notices_retry_id = 0;
+    watch_notices(self);
+    return G_SOURCE_REMOVE;
+}
 
-    return g_task_propagate_pointer(task, error);
+static void
+queue_notices_retry(DsSnapdHelper *self)
+{
+    self->notices_retry_id = g_timeout_add_seconds(
+        MAX(NOTICES_RETRY_DELAY, ds_circuit_breaker_get_retry_delay(self->snapd_breaker)),
+        G_SOURCE_FUNC(retry_notices_cb), self);
+}
+
+static void
+get_notices_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autofree helper_request_t *request = user_data;
+    DsSnapdHelper *self = request->self;
+    g_autoptr(GPtrArray) notices = NULL;
+    g_autoptr(GError) error = NULL;
+
+    /* Only cancelled when the helper is finalized */
+    notices = snapd_client_get_notices_finish(client, result, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    snapd_request_done(self, &request->ticket, error);
+    if (notices == NULL) {
+        /* Changes may be missed until we resubscribe */
+        g_warning("Could not get snapd notices: %s", error->message);
+        self->installed_themes_current = FALSE;
+        queue_notices_retry(self);
+        return;
+    }
+
+    for (guint i = 0; i < notices->len; i++) {
+        SnapdNotice *notice = notices->pdata[i];
+        request_ticket_t ticket;
+        GDateTime *last_occurred = snapd_notice_get_last_occurred(notice);
+
+        if (g_date_time_compare(last_occurred, self->notices_since) > 0) {
+            g_date_time_unref(self->notices_since);
+            self->notices_since = g_date_time_ref(last_occurred);
+        }
+
+        if (snapd_notice_get_notice_type(notice) != SNAPD_NOTICE_TYPE_CHANGE_UPDATE) {
+            continue;
+        }
+        if (!snapd_request_allowed(self, "get-change", &ticket, &error)) {
+            g_debug("Not getting snapd change: %s", error->message);
+            g_clear_error(&error);
+            self->installed_themes_current = FALSE;
+        } else {
+            snapd_client_get_change_async(
+                client, snapd_notice_get_key(notice),
+                self->notices_cancellable, get_notice_change_cb, helper_request_new(self, &ticket));
+        }
+    }
+
+    watch_notices(self);
+}
+
+static void
+probe_snapd_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autofree helper_request_t *request = user_data;
+    DsSnapdHelper *self = request->self;
+    g_autoptr(GPtrArray) changes = NULL;
+    g_autoptr(GError) error = NULL;
+
+    /* Only cancelled when the helper is finalized */
+    changes = snapd_client_get_changes_finish(client, result, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    snapd_request_done(self, &request->ticket, error);
+    if (changes == NULL) {
+        queue_notices_retry(self);
+        return;
+    }
+    watch_notices(self);
+}
+
+/* Long-polls snapd for notices.  The callbacks don't hold a reference
+ * to the helper: notices_cancellable is cancelled when it is finalized,
+ * so they must not touch it when cancelled, even to report the request
+ * to the circuit breaker, which goes with the helper. */
+static void
+watch_notices(DsSnapdHelper *self)
+{
+    request_ticket_t ticket;
+    g_autoptr(GError) error = NULL;
+
+    if (self->notices_cancellable == NULL) {
+        self->notices_cancellable = g_cancellable_new();
+    }
+    if (self->notices_since == NULL) {
+        self->notices_since = g_date_time_new_now_utc();
+    }
+
+    /* While snapd is failing, the long poll would be the breaker's one
+     * probe for its whole timeout and hold off every other request, so
+     * a short request checks snapd is back first */
+    if (!ds_circuit_breaker_is_closed(self->snapd_breaker)) {
+        if (!snapd_request_allowed(self, "get-changes", &ticket, &error)) {
+            g_debug("Not watching snapd notices: %s", error->message);
+            queue_notices_retry(self);
+            return;
+        }
+        snapd_client_get_changes_async(
+            self->client, SNAPD_CHANGE_FILTER_IN_PROGRESS, NULL,
+            self->notices_cancellable, probe_snapd_cb, helper_request_new(self, &ticket));
+        return;
+    }
+
+    if (!snapd_request_allowed(self, "get-notices", &ticket, &error)) {
+        g_debug("Not watching snapd notices: %s", error->message);
+        queue_notices_retry(self);
+        return;
+    }
+    snapd_client_get_notices_async(
+        self->client, self->notices_since, NOTICES_TIMEOUT,
+        self->notices_cancellable, get_notices_cb, helper_request_new(self, &ticket));
 }
 
-static void install_next_snap(GTask *task);
+static void
+build_index_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    DsSnapdHelper *self = DS_SNAPD_HELPER(object);
+    g_autoptr(GTask) task = user_data;
+    const char *revision = g_task_get_task_data(task);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(DsThemeIndex) index = NULL;
+
+    index = build_index_finish(result, &error);
+    if (index == NULL) {
+        g_task_return_error(task, g_steal_pointer(&error));
+        return;
+    }
+
+    /* Only cache the index if it reflects a settled snapd state.  The
+     * check that fetched it reports what is missing, so it isn't
+     * announced. */
+    if (revision != NULL) {
+        set_installed_themes(self, index, FALSE);
+        self->installed_themes_current = notices_active(self);
+    }
+
+    g_task_return_pointer(task, g_steal_pointer(&index), (GDestroyNotify)ds_theme_index_unref);
+}
 
 static void
-install_next_snap_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+get_interfaces_cb(GObject *object, GAsyncResult *result, gpointer user_data)
 {
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
     g_autoptr(GTask) task = user_data;
     DsSnapdHelper *self = g_task_get_source_object(task);
     g_autoptr(GError) error = NULL;
+    g_autoptr(GPtrArray) interfaces = NULL;
+    g_autoptr(GPtrArray) slots = g_ptr_array_new_with_free_func(g_object_unref);
 
-    if (!snapd_client_install2_finish(self->client, result,  &error)) {
+    interfaces = snapd_client_get_interfaces2_finish(client, result, &error);
+    snapd_request_done(self, &self->installed_themes_ticket, error);
+    if (interfaces == NULL) {
         g_task_return_error(task, g_steal_pointer(&error));
         return;
     }
 
-    install_next_snap(task);
+    for (guint i = 0; i < interfaces->len; i++) {
+        SnapdInterface *iface = interfaces->pdata[i];
+        GPtrArray *iface_slots = snapd_interface_get_slots(iface);
+
+        if (strcmp(snapd_interface_get_name(iface), "content") != 0) {
+            continue;
+        }
+        for (guint j = 0; j < iface_slots->len; j++) {
+            g_ptr_array_add(slots, g_object_ref(iface_slots->pdata[j]));
+        }
+    }
+
+    build_index_async(self, slots, g_task_get_task_data(task), g_task_get_cancellable(task), build_index_cb, g_object_ref(task));
 }
 
 static void
-install_next_snap(GTask *task)
+get_changes_cb(GObject *object, GAsyncResult *result, gpointer user_data)
 {
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autoptr(GTask) task = user_data;
     DsSnapdHelper *self = g_task_get_source_object(task);
-    GPtrArray *snaps = g_task_get_task_data(task);
-    g_autoptr(SnapdSnap) snap = NULL;
+    char *interfaces[] = { "content", NULL };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GPtrArray) changes = NULL;
+    g_autofree char *revision = NULL;
+
+    changes = snapd_client_get_changes_finish(client, result, &error);
+    snapd_request_done(self, &self->installed_themes_ticket, error);
+    if (changes != NULL) {
+        revision = get_changes_revision(changes);
+    } else if (is_snapd_outage(error)) {
+        g_task_return_error(task, g_steal_pointer(&error));
+        return;
+    } else {
+        g_warning("Could not get snapd changes: %s", error->message);
+        g_clear_error(&error);
+    }
 
-    /* Nothing left? we're done. */
-    if (snaps->len == 0) {
-        g_task_return_boolean(task, TRUE);
+    /* If snapd hasn't changed since the index was built, reuse it */
+    if (revision != NULL && self->installed_themes != NULL &&
+        g_strcmp0(revision, ds_theme_index_get_revision(self->installed_themes)) == 0) {
+        self->installed_themes_current = notices_active(self);
+        g_task_return_pointer(task, ds_theme_index_ref(self->installed_themes),
+                              (GDestroyNotify)ds_theme_index_unref);
         return;
     }
 
-    snap = g_ptr_array_steal_index(snaps, snaps->len-1);
-    snapd_client_install2_async(
-        self->client, SNAPD_INSTALL_FLAGS_NONE,
-        snapd_snap_get_name(snap), NULL, NULL,
-        NULL, NULL, g_task_get_cancellable(task),
-        install_next_snap_cb, g_object_ref(task));
+    g_task_set_task_data(task, g_steal_pointer(&revision), g_free);
+    if (!snapd_request_allowed(self, "get-interfaces", &self->installed_themes_ticket, &error)) {
+        g_task_return_error(task, g_steal_pointer(&error));
+        return;
+    }
+    snapd_client_get_interfaces2_async(
+        client, SNAPD_GET_INTERFACES_FLAGS_INCLUDE_SLOTS, interfaces,
+        g_task_get_cancellable(task), get_interfaces_cb, g_steal_pointer(&task));
+}
+
+static void
+fetch_installed_themes_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DsSnapdHelper *self = DS_SNAPD_HELPER(object);
+    g_autoptr(GPtrArray) waiters = g_steal_pointer(&self->installed_themes_waiters);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(DsThemeIndex) index = NULL;
+
+    index = g_task_propagate_pointer(G_TASK(result), &error);
+    for (guint i = 0; i < waiters->len; i++) {
+        GTask *waiter = waiters->pdata[i];
+
+        if (g_task_return_error_if_cancelled(waiter)) {
+            continue;
+        }
+        if (index != NULL) {
+            g_task_return_pointer(waiter, ds_theme_index_ref(index), (GDestroyNotify)ds_theme_index_unref);
+        } else {
+            g_task_return_error(waiter, g_error_copy(error));
+        }
+    }
 }
 
 void
-ds_snapd_helper_install_snaps(DsSnapdHelper *self, GPtrArray *snaps, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+ds_snapd_helper_get_installed_themes(DsSnapdHelper *self, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
 {
     g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    g_autoptr(GTask) fetch_task = NULL;
+    g_autoptr(GError) error = NULL;
+
+    if (self->notices_cancellable == NULL) {
+        watch_notices(self);
+    }
+
+    /* While subscribed to notices, the index is kept up to date as snaps
+     * are installed and removed, so snapd doesn't need to be asked */
+    if (self->installed_themes_current) {
+        g_task_return_pointer(task, ds_theme_index_ref(self->installed_themes),
+                              (GDestroyNotify)ds_theme_index_unref);
+        return;
+    }
+
+    /* Concurrent checks share a single fetch */
+    if (self->installed_themes_waiters != NULL) {
+        g_ptr_array_add(self->installed_themes_waiters, g_steal_pointer(&task));
+        return;
+    }
+    self->installed_themes_waiters = g_ptr_array_new_with_free_func(g_object_unref);
+    g_ptr_array_add(self->installed_themes_waiters, g_steal_pointer(&task));
+
+    fetch_task = g_task_new(self, NULL, fetch_installed_themes_cb, NULL);
+    if (!snapd_request_allowed(self, "get-changes", &self->installed_themes_ticket, &error)) {
+        g_task_return_error(fetch_task, g_steal_pointer(&error));
+        return;
+    }
+    snapd_client_get_changes_async(
+        self->client, SNAPD_CHANGE_FILTER_ALL, NULL,
+        NULL, get_changes_cb, g_steal_pointer(&fetch_task));
+}
+
+static DsThemeIndex *
+get_installed_theme_index_finish(GAsyncResult *result, GError **error)
+{
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+gboolean
+ds_snapd_helper_get_installed_themes_finish(DsSnapdHelper *self, GAsyncResult *result, GPtrArray **gtk_themes, GPtrArray **icon_themes, GPtrArray **sound_themes, GError **error)
+{
+    g_autoptr(DsThemeIndex) index = get_installed_theme_index_finish(result, error);
+
+    if (index == NULL) {
+        return FALSE;
+    }
+
+    if (gtk_themes != NULL) {
+        *gtk_themes = ds_theme_index_get_themes(index, DS_THEME_KIND_GTK);
+    }
+    if (icon_themes != NULL) {
+        *icon_themes = ds_theme_index_get_themes(index, DS_THEME_KIND_ICON);
+    }
+    if (sound_themes != NULL) {
+        *sound_themes = ds_theme_index_get_themes(index, DS_THEME_KIND_SOUND);
+    }
+    return TRUE;
+}
+
+typedef struct  {
+    DsThemeSet *themes;
+    guint changed;
+    guint trace_id;
+    gint64 index_time;
+    /* Results of the session's previous check, which this check reuses
+     * and updates, or NULL for independent queries */
+    component_result_t *resolved;
+
+    int pending_lookups;
+    GPtrArray *missing_snaps;
+    GError *error;
+} find_missing_data_t;
+
+void
+find_missing_data_free(find_missing_data_t *data)
+{
+    g_clear_pointer(&data->themes, ds_theme_set_unref);
+    g_clear_pointer(&data->missing_snaps, g_ptr_array_unref);
+    g_clear_pointer(&data->error, g_error_free);
+    g_free(data);
+}
+
+void
+maybe_complete_find_missing_task(GTask *task)
+{
+    find_missing_data_t *data = g_task_get_task_data(task);
+
+    /* If there are pending lookups, don't do anything */
+    if (data->pending_lookups > 0) {
+        return;
+    }
+    if (data->error == NULL) {
+        g_task_return_pointer(task, g_steal_pointer(&data->missing_snaps),
+                              (GDestroyNotify)g_ptr_array_unref);
+    } else {
+        g_task_return_error(task, g_steal_pointer(&data->error));
+    }
+}
+
+/* Adds a snap to the missing list, unless another theme in the set
+ * already resolved to it. */
+static void
+add_missing_snap(find_missing_data_t *data, SnapdSnap *snap)
+{
+    for (guint i = 0; i < data->missing_snaps->len; i++) {
+        if (!strcmp(snapd_snap_get_name(data->missing_snaps->pdata[i]), snapd_snap_get_name(snap))) {
+            return;
+        }
+    }
+    g_ptr_array_add(data->missing_snaps, g_object_ref(snap));
+}
+
+char *
+make_package_name(const char *prefix, const char *theme_name)
+{
+    g_autofree char *name = g_ascii_strdown(theme_name, -1);
+    char *a, *b;
+
+    /* strip out non alphanumeric characters from name */
+    for (a = b = name; *a != '\0'; a++) {
+        if (g_ascii_isalnum(*a)) {
+            *b = *a;
+            b++;
+        } else if (*a == '-' && b != name && *(b-1) != '-') {
+            /* Allow dashes, provided they aren't at the beginning or
+             * preceded by another dash */
+            *b = '-';
+            b++;
+        }
+    }
+    *b = '\0';
+    /* trim trailing dashes */
+    while (b != name && *(b-1) == '-') {
+        b--;
+        *b = '\0';
+    }
+    return g_strconcat(prefix, name, NULL);
+}
+
+/* trim off last dash separated segment of the snap name, provided the
+ * result has three or more portions. */
+char *
+shorten_package_name(const char *snap_name)
+{
+    const char *pos = snap_name, *last_dash = NULL;
+    int dash_count = 0;
+
+    while (pos != NULL) {
+        pos = strchr(pos, '-');
+        if (pos != NULL) {
+            last_dash = pos;
+            dash_count++;
+            pos++;
+        }
+    }
+    if (dash_count < 3) {
+        return NULL;
+    }
+    return g_strndup(snap_name, last_dash - snap_name);
+}
+
+/* Builds the list of snap names that could provide a theme, from the
+ * most to the least specific. */
+static GPtrArray *
+make_package_candidates(const char *prefix, const char *theme_name)
+{
+    GPtrArray *candidates = g_ptr_array_new_with_free_func(g_free);
+    char *snap_name = make_package_name(prefix, theme_name);
+
+    while (snap_name != NULL) {
+        g_ptr_array_add(candidates, snap_name);
+        snap_name = shorten_package_name(snap_name);
+    }
+    return candidates;
+}
+
+typedef struct {
+    char *snap_name;
+    GCancellable *cancellable;
+
+    gboolean resolved;
+    DsLookupResult result;
+    SnapdSnap *snap;
+    GError *error;
+} candidate_t;
+
+static void
+candidate_free(candidate_t *candidate)
+{
+    g_free(candidate->snap_name);
+    g_clear_object(&candidate->cancellable);
+    g_clear_object(&candidate->snap);
+    g_clear_pointer(&candidate->error, g_error_free);
+    g_free(candidate);
+}
+
+/* The resolution of one theme to a snap.  All candidate names are
+ * looked up concurrently, and the most specific one that exists wins. */
+typedef struct {
+    grefcount ref_count;
+
+    GTask *task;
+    DsThemeComponent component;
+    GPtrArray *candidates;
+    gulong cancelled_id;
+    gboolean complete;
+    gint64 begin_time;
+} resolution_t;
+
+static resolution_t *
+resolution_ref(resolution_t *resolution)
+{
+    g_ref_count_inc(&resolution->ref_count);
+    return resolution;
+}
+
+static void
+resolution_unref(resolution_t *resolution)
+{
+    if (!g_ref_count_dec(&resolution->ref_count)) {
+        return;
+    }
+    g_cancellable_disconnect(g_task_get_cancellable(resolution->task), resolution->cancelled_id);
+    g_clear_object(&resolution->task);
+    g_clear_pointer(&resolution->candidates, g_ptr_array_unref);
+    g_free(resolution);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(resolution_t, resolution_unref);
+
+/* Cancel lookups for all candidates less specific than first */
+static void
+resolution_cancel_from(resolution_t *resolution, guint first)
+{
+    for (guint i = first; i < resolution->candidates->len; i++) {
+        candidate_t *candidate = resolution->candidates->pdata[i];
+
+        if (!candidate->resolved) {
+            g_cancellable_cancel(candidate->cancellable);
+        }
+    }
+}
+
+static void
+resolution_cancelled_cb(GCancellable *cancellable, resolution_t *resolution)
+{
+    resolution_cancel_from(resolution, 0);
+}
+
+static void
+resolution_complete(resolution_t *resolution)
+{
+    find_missing_data_t *data = g_task_get_task_data(resolution->task);
+
+    resolution->complete = TRUE;
+    resolution_cancel_from(resolution, 0);
+    ds_trace_end(data->trace_id, "find-package", resolution->begin_time,
+                 ds_theme_set_get_component(data->themes, resolution->component));
+
+    data->pending_lookups--;
+    maybe_complete_find_missing_task(resolution->task);
+}
+
+/* A snap the store is known to have from an earlier result, carrying
+ * what installing it needs.  download_size is 0 if it isn't known. */
+static SnapdSnap *
+new_store_snap(const char *snap_name, gint64 download_size)
+{
+    return g_object_new(SNAPD_TYPE_SNAP, "name", snap_name, "channel", "stable",
+                        "download-size", download_size, NULL);
+}
+
+/* Check if the result can be decided: that is when a candidate has been
+ * found and all more specific candidates are known not to exist. */
+static void
+resolution_evaluate(resolution_t *resolution)
+{
+    find_missing_data_t *data = g_task_get_task_data(resolution->task);
+    g_autoptr(SnapdSnap) snap = NULL;
+
+    if (resolution->complete) {
+        return;
+    }
+
+    for (guint i = 0; i < resolution->candidates->len; i++) {
+        candidate_t *candidate = resolution->candidates->pdata[i];
+
+        if (!candidate->resolved) {
+            return;
+        }
+        if (candidate->error != NULL) {
+            if (data->error == NULL) {
+                data->error = g_error_copy(candidate->error);
+            }
+            resolution_complete(resolution);
+            return;
+        }
+        if (candidate->result == DS_LOOKUP_RESULT_NOT_FOUND) {
+            continue;
+        }
+        if (candidate->result == DS_LOOKUP_RESULT_FOUND) {
+            if (candidate->snap != NULL) {
+                snap = g_object_ref(candidate->snap);
+            } else {
+                snap = new_store_snap(candidate->snap_name, 0);
+            }
+            add_missing_snap(data, snap);
+        }
+        break;
+    }
+
+    /* Remember the result so later checks can reuse it */
+    if (data->resolved != NULL) {
+        component_result_t *resolved = &data->resolved[resolution->component];
+
+        g_clear_pointer(&resolved->themes, ds_theme_set_unref);
+        resolved->themes = ds_theme_set_ref(data->themes);
+        g_set_object(&resolved->snap, snap);
+    }
+
+    resolution_complete(resolution);
+}
+
+static void
+resolution_set_result(resolution_t *resolution, guint i, DsLookupResult result, SnapdSnap *snap)
+{
+    candidate_t *candidate = resolution->candidates->pdata[i];
+
+    candidate->resolved = TRUE;
+    candidate->result = result;
+    g_set_object(&candidate->snap, snap);
+    if (result == DS_LOOKUP_RESULT_NOT_FOUND) {
+        g_print("Snap: %s not found\n", candidate->snap_name);
+    } else {
+        /* Less specific candidates can no longer win */
+        resolution_cancel_from(resolution, i + 1);
+    }
+}
+
+typedef struct {
+    resolution_t *resolution;
+    guint candidate;
+} find_package_data_t;
+
+static void
+find_package_data_free(find_package_data_t *data)
+{
+    g_clear_pointer(&data->resolution, resolution_unref);
+    g_free(data);
+}
+
+
+/* Interprets the reply to an exact name search.  Returns FALSE if the
+ * search failed, rather than finding nothing. */
+static gboolean
+get_find_result(GPtrArray *snaps, GError *error, DsLookupResult *result, SnapdSnap **snap)
+{
+    *snap = NULL;
+    if (snaps == NULL) {
+        if (!g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_NOT_FOUND)) {
+            return FALSE;
+        }
+        *result = DS_LOOKUP_RESULT_NOT_FOUND;
+    } else if (snaps->len > 0 && !strcmp(snapd_snap_get_channel(snaps->pdata[0]), "stable")) {
+        *snap = snaps->pdata[0];
+        *result = DS_LOOKUP_RESULT_FOUND;
+    } else {
+        *result = DS_LOOKUP_RESULT_UNAVAILABLE;
+    }
+    return TRUE;
+}
+
+/* Passes the result of a store lookup to a waiting candidate */
+static void
+find_package_done(find_package_data_t *find_data, gboolean success, DsLookupResult lookup_result, SnapdSnap *snap, const GError *error)
+{
+    resolution_t *resolution = find_data->resolution;
+    candidate_t *candidate = resolution->candidates->pdata[find_data->candidate];
+
+    if (g_cancellable_set_error_if_cancelled(candidate->cancellable, &candidate->error)) {
+        candidate->resolved = TRUE;
+    } else if (!success) {
+        candidate->resolved = TRUE;
+        candidate->error = g_error_copy(error);
+    } else {
+        resolution_set_result(resolution, find_data->candidate, lookup_result, snap);
+    }
+    resolution_evaluate(resolution);
+}
+
+/* A store lookup, shared by every candidate with the same snap name */
+struct _lookup_t {
+    DsSnapdHelper *self;
+    char *snap_name;
+    request_ticket_t ticket;
+    /* find_package_data_t waiting for the result */
+    GPtrArray *waiters;
+};
+
+static void
+lookup_free(lookup_t *lookup)
+{
+    g_clear_object(&lookup->self);
+    g_free(lookup->snap_name);
+    g_clear_pointer(&lookup->waiters, g_ptr_array_unref);
+    g_free(lookup);
+}
+
+static void start_lookups(DsSnapdHelper *self);
+
+static void
+lookup_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    lookup_t *lookup = user_data;
+    g_autoptr(DsSnapdHelper) self = g_object_ref(lookup->self);
+    g_autoptr(GPtrArray) snaps = NULL;
+    g_autoptr(GError) error = NULL;
+    SnapdSnap *snap = NULL;
+    DsLookupResult lookup_result;
+    gboolean success;
+
+    self->running_lookups--;
+    g_hash_table_remove(self->lookups, lookup->snap_name);
+
+    snaps = snapd_client_find_finish(client, result, NULL, &error);
+    store_request_done(self, &lookup->ticket, error);
+    success = get_find_result(snaps, error, &lookup_result, &snap);
+    if (success) {
+        ds_lookup_cache_insert(self->lookup_cache, lookup->snap_name, lookup_result,
+                               snap != NULL ? snapd_snap_get_download_size(snap) : 0);
+    }
+    for (guint i = 0; i < lookup->waiters->len; i++) {
+        find_package_done(lookup->waiters->pdata[i], success, lookup_result, snap, error);
+    }
+    lookup_free(lookup);
+
+    start_lookups(self);
+}
+
+/* Returns TRUE if no candidate waiting for the lookup still needs it */
+static gboolean
+lookup_is_cancelled(lookup_t *lookup)
+{
+    for (guint i = 0; i < lookup->waiters->len; i++) {
+        find_package_data_t *find_data = lookup->waiters->pdata[i];
+        candidate_t *candidate = find_data->resolution->candidates->pdata[find_data->candidate];
+
+        if (!g_cancellable_is_cancelled(candidate->cancellable)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Starts queued lookups, up to the limit on concurrent requests.
+ * Lookups that were abandoned while queued are never made. */
+static void
+start_lookups(DsSnapdHelper *self)
+{
+    lookup_t *lookup;
+    g_autoptr(GError) error = NULL;
+
+    while (self->running_lookups < MAX_CONCURRENT_LOOKUPS &&
+           (lookup = g_queue_pop_head(self->lookup_queue)) != NULL) {
+        if (lookup_is_cancelled(lookup)) {
+            g_hash_table_remove(self->lookups, lookup->snap_name);
+            for (guint i = 0; i < lookup->waiters->len; i++) {
+                find_package_done(lookup->waiters->pdata[i], FALSE, DS_LOOKUP_RESULT_NOT_FOUND, NULL, NULL);
+            }
+            lookup_free(lookup);
+            continue;
+        }
+
+        if (!store_request_allowed(self, "find", &lookup->ticket, &error)) {
+            g_hash_table_remove(self->lookups, lookup->snap_name);
+            for (guint i = 0; i < lookup->waiters->len; i++) {
+                find_package_done(lookup->waiters->pdata[i], FALSE, DS_LOOKUP_RESULT_NOT_FOUND, NULL, error);
+            }
+            lookup_free(lookup);
+            g_clear_error(&error);
+            continue;
+        }
+
+        g_print("Searching for snap: %s\n", lookup->snap_name);
+        self->running_lookups++;
+        snapd_client_find_async(
+            self->client, SNAPD_FIND_FLAGS_MATCH_NAME, lookup->snap_name,
+            NULL, lookup_cb, lookup);
+    }
+}
+
+/* Looks up snap_name in the store on behalf of a candidate.  A lookup
+ * already in progress for the same name is joined rather than repeated,
+ * and lookups are not cancelled once made, so their results still reach
+ * the lookup cache. */
+static void
+request_lookup(DsSnapdHelper *self, const char *snap_name, find_package_data_t *find_data)
+{
+    lookup_t *lookup = g_hash_table_lookup(self->lookups, snap_name);
+
+    if (lookup != NULL) {
+        ds_metrics_increment("lookups-joined");
+        g_ptr_array_add(lookup->waiters, find_data);
+        return;
+    }
+
+    lookup = g_new0(lookup_t, 1);
+    lookup->self = g_object_ref(self);
+    lookup->snap_name = g_strdup(snap_name);
+    lookup->waiters = g_ptr_array_new_with_free_func((GDestroyNotify)find_package_data_free);
+    g_ptr_array_add(lookup->waiters, find_data);
+    g_hash_table_insert(self->lookups, lookup->snap_name, lookup);
+    g_queue_push_tail(self->lookup_queue, lookup);
+    start_lookups(self);
+}
+
+/* Resolve the snap providing theme_name, adding it to the missing snaps
+ * if it exists. */
+static void
+find_package(GTask *task, DsThemeComponent component, const char *prefix, const char *theme_name) {
+    DsSnapdHelper *self = g_task_get_source_object(task);
+    find_missing_data_t *data = g_task_get_task_data(task);
+    GCancellable *cancellable = g_task_get_cancellable(task);
+    g_autoptr(resolution_t) resolution = g_new0(resolution_t, 1);
+    g_autoptr(GPtrArray) names = make_package_candidates(prefix, theme_name);
+
+    g_ref_count_init(&resolution->ref_count);
+    resolution->task = g_object_ref(task);
+    resolution->component = component;
+    resolution->begin_time = ds_trace_begin();
+    resolution->candidates = g_ptr_array_new_with_free_func((GDestroyNotify)candidate_free);
+    for (guint i = 0; i < names->len; i++) {
+        candidate_t *candidate = g_new0(candidate_t, 1);
+
+        candidate->snap_name = g_strdup(names->pdata[i]);
+        candidate->cancellable = g_cancellable_new();
+        g_ptr_array_add(resolution->candidates, candidate);
+    }
+    if (cancellable != NULL) {
+        resolution->cancelled_id = g_cancellable_connect(
+            cancellable, G_CALLBACK(resolution_cancelled_cb), resolution, NULL);
+    }
+
+    data->pending_lookups++;
+
+    /* Answer what we can from the catalog and cache */
+    for (guint i = 0; i < resolution->candidates->len; i++) {
+        candidate_t *candidate = resolution->candidates->pdata[i];
+        DsLookupResult lookup_result;
+        gint64 download_size;
+
+        if (self->store_catalog != NULL &&
+            ds_store_catalog_lookup(self->store_catalog, candidate->snap_name, &lookup_result, &download_size)) {
+            g_autoptr(SnapdSnap) snap = NULL;
+
+            if (lookup_result == DS_LOOKUP_RESULT_FOUND) {
+                snap = new_store_snap(candidate->snap_name, download_size);
+            }
+            resolution_set_result(resolution, i, lookup_result, snap);
+        } else if (ds_lookup_cache_lookup(self->lookup_cache, candidate->snap_name, &lookup_result, &download_size)) {
+            g_autoptr(SnapdSnap) snap = NULL;
+
+            g_print("Snap: %s found in lookup cache\n", candidate->snap_name);
+            if (lookup_result == DS_LOOKUP_RESULT_FOUND) {
+                snap = new_store_snap(candidate->snap_name, download_size);
+            }
+            resolution_set_result(resolution, i, lookup_result, snap);
+        }
+    }
+
+    /* Look up everything else at once */
+    for (guint i = 0; i < resolution->candidates->len; i++) {
+        candidate_t *candidate = resolution->candidates->pdata[i];
+        find_package_data_t *find_data;
+
+        if (candidate->resolved) {
+            continue;
+        }
+        if (g_cancellable_set_error_if_cancelled(candidate->cancellable, &candidate->error)) {
+            candidate->resolved = TRUE;
+            continue;
+        }
+
+        find_data = g_new0(find_package_data_t, 1);
+        find_data->resolution = resolution_ref(resolution);
+        find_data->candidate = i;
+
+        request_lookup(self, candidate->snap_name, find_data);
+    }
+
+    resolution_evaluate(resolution);
+}
+
+/* Resolve the snap for a component that isn't installed.  Components
+ * that haven't changed since the last check reuse its result, and
+ * themes the host doesn't have are not looked for: the host is falling
+ * back to another theme itself. */
+static void
+resolve_component(GTask *task, DsThemeComponent component, const char *prefix)
+{
+    DsSnapdHelper *self = g_task_get_source_object(task);
+    find_missing_data_t *data = g_task_get_task_data(task);
+    const char *theme_name = ds_theme_set_get_component(data->themes, component);
+    component_result_t *resolved = data->resolved != NULL ? &data->resolved[component] : NULL;
+
+    if (self->host_themes != NULL && host_knows_component(self->host_themes, component) &&
+        !host_has_component(self->host_themes, component, theme_name)) {
+        g_message("Theme %s is not installed on the host, not looking for a snap", theme_name);
+        return;
+    }
+
+    if (resolved != NULL && (data->changed & DS_THEME_COMPONENT_MASK(component)) == 0 &&
+        resolved->themes != NULL && ds_theme_set_get_component(resolved->themes, component) == theme_name) {
+        if (resolved->snap != NULL) {
+            add_missing_snap(data, resolved->snap);
+        }
+        return;
+    }
+
+    find_package(task, component, prefix, theme_name);
+}
+
+static void
+get_installed_themes_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    g_autoptr(GTask) task = user_data;
+    find_missing_data_t *data = g_task_get_task_data(task);
+    g_autoptr(DsThemeIndex) index = NULL;
+    g_autoptr(GError) error = NULL;
+
+    index = get_installed_theme_index_finish(result, &error);
+    ds_trace_end(data->trace_id, "installed-themes", data->index_time, NULL);
+    if (index == NULL) {
+        g_task_return_error(task, g_steal_pointer(&error));
+        return;
+    }
+
+    /* Hold the task open until all lookups are queued */
+    data->pending_lookups++;
+
+    if (index_has_component(index, DS_THEME_COMPONENT_GTK, data->themes->gtk_theme_name)) {
+        g_message("GTK theme %s already available to snaps", data->themes->gtk_theme_name);
+    } else {
+        g_message("GTK theme %s not available to snaps", data->themes->gtk_theme_name);
+        resolve_component(task, DS_THEME_COMPONENT_GTK, "gtk-theme-");
+    }
+
+    if (index_has_component(index, DS_THEME_COMPONENT_ICON, data->themes->icon_theme_name)) {
+        g_message("Icon theme %s already available to snaps", data->themes->icon_theme_name);
+    } else {
+        g_message("Icon theme %s not available to snaps", data->themes->icon_theme_name);
+        resolve_component(task, DS_THEME_COMPONENT_ICON, "icon-theme-");
+    }
+
+    if (index_has_component(index, DS_THEME_COMPONENT_CURSOR, data->themes->cursor_theme_name)) {
+        g_message("Cursor theme %s already available to snaps", data->themes->cursor_theme_name);
+    } else if (data->themes->icon_theme_name != data->themes->cursor_theme_name) {
+        g_message("Cursor theme %s not available to snaps", data->themes->cursor_theme_name);
+        resolve_component(task, DS_THEME_COMPONENT_CURSOR, "icon-theme-");
+    }
+
+    if (index_has_component(index, DS_THEME_COMPONENT_SOUND, data->themes->sound_theme_name)) {
+        g_message("Sound theme %s already available to snaps", data->themes->sound_theme_name);
+    } else {
+        g_message("Sound theme %s not available to snaps", data->themes->sound_theme_name);
+        resolve_component(task, DS_THEME_COMPONENT_SOUND, "sound-theme-");
+    }
+
+    /* If there are no package lookups left, complete the task */
+    data->pending_lookups--;
+    maybe_complete_find_missing_task(task);
+}
+
+static void
+find_missing_snaps_async(DsSnapdHelper *self, const DsThemeSet *themes, guint changed, component_result_t *resolved, guint trace_id, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    find_missing_data_t *data = g_new0(find_missing_data_t, 1);
+
+    data->themes = ds_theme_set_ref(themes);
+    data->changed = changed;
+    data->resolved = resolved;
+    data->trace_id = trace_id;
+    data->index_time = ds_trace_begin();
+    data->missing_snaps = g_ptr_array_new_with_free_func(g_object_unref);
+    g_task_set_task_data(task, data, (GDestroyNotify)find_missing_data_free);
+
+    maybe_refresh_catalog(self);
+    ds_snapd_helper_get_installed_themes(self, cancellable, get_installed_themes_cb, g_steal_pointer(&task));
+}
+
+/* A check for missing snaps, shared by every caller asking about the
+ * same theme set while it runs. */
+struct _check_t {
+    DsSnapdHelper *helper;
+    DsThemeSet *themes;
+    guint changed;
+    GCancellable *cancellable;
+    GPtrArray *waiters;
+    /* TRUE if in the helper's queries table, for independent queries */
+    gboolean is_query;
+    /* TRUE if the user was told about themes installed while it ran,
+     * so its result may be out of date */
+    gboolean stale;
+    guint trace_id;
+    gint64 begin_time;
+};
+
+static check_t *
+check_new(DsSnapdHelper *self, const DsThemeSet *themes, guint changed, guint trace_id)
+{
+    check_t *check = g_new0(check_t, 1);
+
+    check->helper = g_object_ref(self);
+    check->themes = ds_theme_set_ref(themes);
+    check->changed = changed;
+    check->trace_id = trace_id;
+    check->begin_time = ds_trace_begin();
+    check->cancellable = g_cancellable_new();
+    check->waiters = g_ptr_array_new_with_free_func(g_object_unref);
+    return check;
+}
+
+static void
+check_free(check_t *check)
+{
+    g_clear_object(&check->helper);
+    g_clear_pointer(&check->themes, ds_theme_set_unref);
+    g_clear_object(&check->cancellable);
+    g_clear_pointer(&check->waiters, g_ptr_array_unref);
+    g_free(check);
+}
+
+static void
+check_complete(check_t *check, GPtrArray *missing_snaps, GError *error)
+{
+    DsSnapdHelper *self = check->helper;
+    g_autoptr(GPtrArray) no_snaps = NULL;
+    g_autoptr(GPtrArray) not_installing = NULL;
+
+    if (self->current_check == check) {
+        self->current_check = NULL;
+    }
+    if (check->is_query) {
+        g_hash_table_remove(self->queries, check->themes);
+    }
+    ds_trace_end(check->trace_id, "check", check->begin_time,
+                 missing_snaps != NULL ? NULL : error->message);
+
+    /* Snaps being installed provide their themes shortly */
+    if (missing_snaps != NULL && g_hash_table_size(self->installing) > 0) {
+        not_installing = g_ptr_array_new_with_free_func(g_object_unref);
+        for (guint i = 0; i < missing_snaps->len; i++) {
+            SnapdSnap *snap = missing_snaps->pdata[i];
+
+            if (g_hash_table_contains(self->installing, snapd_snap_get_name(snap))) {
+                g_message("Snap %s is being installed, not offering it", snapd_snap_get_name(snap));
+                continue;
+            }
+            g_ptr_array_add(not_installing, g_object_ref(snap));
+        }
+        missing_snaps = not_installing;
+    }
+
+    /* Don't ask again about snaps the user declined for other themes */
+    if (!check->is_query && missing_snaps != NULL && missing_snaps->len > 0 &&
+        ds_decision_store_snaps_declined(self->decisions, check->themes, missing_snaps)) {
+        g_message("Missing snaps were declined before, not asking again");
+        no_snaps = g_ptr_array_new_with_free_func(g_object_unref);
+        missing_snaps = no_snaps;
+    }
+
+    for (guint i = 0; i < check->waiters->len; i++) {
+        GTask *waiter = check->waiters->pdata[i];
+
+        if (missing_snaps != NULL) {
+            g_task_return_pointer(waiter, g_ptr_array_copy(missing_snaps, (GCopyFunc)g_object_ref, NULL),
+                                  (GDestroyNotify)g_ptr_array_unref);
+        } else {
+            g_task_return_error(waiter, g_error_copy(error));
+        }
+    }
+
+    check_free(check);
+}
+
+static void
+check_done_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    check_t *check = user_data;
+    g_autoptr(GPtrArray) missing_snaps = NULL;
+    g_autoptr(GError) error = NULL;
+
+    missing_snaps = g_task_propagate_pointer(G_TASK(result), &error);
+    check_complete(check, missing_snaps, error);
+}
+
+static void
+resolve_check_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    check_t *check = user_data;
+    DsSnapdHelper *self = check->helper;
+    g_autoptr(GPtrArray) missing_snaps = NULL;
+    g_autoptr(GError) error = NULL;
+
+    missing_snaps = self->resolve_finish(result, &error);
+    if (missing_snaps == NULL && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_warning("Could not resolve themes remotely, checking locally: %s", error->message);
+        find_missing_snaps_async(self, check->themes, check->changed, self->resolved, check->trace_id,
+                                 check->cancellable, check_done_cb, check);
+        return;
+    }
+    check_complete(check, missing_snaps, error);
+}
+
+/* Only one check runs at a time.  A request for the theme set already
+ * being checked joins that check, while a request for a different set
+ * cancels it: its callers receive G_IO_ERROR_CANCELLED.
+ *
+ * changed is a mask of the components that changed since the previous
+ * request.  Components outside the mask reuse the previous result,
+ * rather than being looked up in the store again.
+ *
+ * If a resolver is set, it resolves the theme set, falling back to a
+ * local check if it fails.
+ *
+ * trace_id labels the timing spans of the check. */
+void
+ds_snapd_helper_find_missing_snaps(DsSnapdHelper *self, const DsThemeSet *themes, guint changed, guint trace_id, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    check_t *check = self->current_check;
+
+    if (self->last_themes != themes) {
+        g_clear_pointer(&self->last_themes, ds_theme_set_unref);
+        self->last_themes = ds_theme_set_ref(themes);
+    }
+
+    ds_metrics_increment("theme-checks");
+
+    /* The user doesn't want the snaps for these themes, so don't look
+     * them up.  A check in progress is for themes no longer in use. */
+    if (ds_decision_store_is_declined(self->decisions, themes)) {
+        g_message("Missing snaps for these themes were declined, not checking");
+        ds_metrics_increment("theme-checks-declined");
+        self->unresolved_changed |= changed;
+        if (check != NULL) {
+            self->unresolved_changed |= check->changed;
+            g_cancellable_cancel(check->cancellable);
+            self->current_check = NULL;
+        }
+        g_task_return_pointer(task, g_ptr_array_new_with_free_func(g_object_unref),
+                              (GDestroyNotify)g_ptr_array_unref);
+        return;
+    }
+
+    if (check != NULL && !check->stale && ds_theme_set_equal(check->themes, themes)) {
+        g_debug("Check %u joins check %u", trace_id, check->trace_id);
+        ds_metrics_increment("theme-checks-joined");
+        g_ptr_array_add(check->waiters, g_steal_pointer(&task));
+        return;
+    }
+
+    /* Components changed for the superseded check haven't been resolved */
+    if (check != NULL) {
+        changed |= check->changed;
+        g_cancellable_cancel(check->cancellable);
+        ds_metrics_increment("theme-checks-superseded");
+    }
+
+    changed |= self->unresolved_changed;
+    self->unresolved_changed = 0;
+    check = check_new(self, themes, changed, trace_id);
+    g_ptr_array_add(check->waiters, g_steal_pointer(&task));
+    self->current_check = check;
+
+    if (self->resolve != NULL) {
+        /* Keep the index current and watch notices, so the user is
+         * still told when missing themes are installed */
+        ds_snapd_helper_get_installed_themes(self, NULL, NULL, NULL);
+        self->resolve(self->resolver, themes, check->cancellable, resolve_check_cb, check);
+    } else {
+        find_missing_snaps_async(self, themes, changed, self->resolved, trace_id, check->cancellable, check_done_cb, check);
+    }
+}
+
+/* Finds the snaps missing for a theme set, independently of the
+ * session's current check, so any number of theme sets can be
+ * resolved at once.  Concurrent queries for the same theme set share a
+ * single resolution. */
+void
+ds_snapd_helper_query_missing_snaps(DsSnapdHelper *self, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    check_t *check = g_hash_table_lookup(self->queries, themes);
+
+    if (check != NULL) {
+        g_ptr_array_add(check->waiters, g_steal_pointer(&task));
+        return;
+    }
+
+    check = check_new(self, themes, DS_THEME_COMPONENTS_ALL, ds_trace_new_id());
+    check->is_query = TRUE;
+    g_ptr_array_add(check->waiters, g_steal_pointer(&task));
+    g_hash_table_insert(self->queries, check->themes, check);
+
+    find_missing_snaps_async(self, themes, DS_THEME_COMPONENTS_ALL, NULL, check->trace_id,
+                             check->cancellable, check_done_cb, check);
+}
+
+GPtrArray *
+ds_snapd_helper_query_missing_snaps_finish(DsSnapdHelper *self, GAsyncResult *result, GError **error)
+{
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/* Records that the user declined to install snaps, the missing snaps
+ * for themes.  Checks of themes needing the same snaps return no
+ * missing snaps until the decision expires. */
+void
+ds_snapd_helper_decline_snaps(DsSnapdHelper *self, const DsThemeSet *themes, GPtrArray *snaps)
+{
+    ds_decision_store_decline(self->decisions, themes, snaps);
+}
+
+/* Has theme sets checked for the session resolved by resolve, which is
+ * called with resolver.  This lets the broker client be plugged in
+ * without the helper depending on it. */
+void
+ds_snapd_helper_set_resolver(DsSnapdHelper *self, GObject *resolver, DsSnapdHelperResolveFunc resolve, DsSnapdHelperResolveFinishFunc resolve_finish)
+{
+    g_set_object(&self->resolver, resolver);
+    self->resolve = resolve;
+    self->resolve_finish = resolve_finish;
+}
+
+GPtrArray *
+ds_snapd_helper_find_missing_snaps_finish(DsSnapdHelper *helper, GAsyncResult *result, GError **error)
+{
+    GTask *task = G_TASK(result);
+
+    return g_task_propagate_pointer(task, error);
+}
+
+static void queue_prefetch(DsSnapdHelper *self, guint delay);
+
+/* The prefetch callback doesn't hold a reference to the helper: the
+ * prefetch is cancelled when it is finalized */
+typedef struct {
+    DsSnapdHelper *self;
+    char *snap_name;
+    request_ticket_t ticket;
+} prefetch_data_t;
+
+static void
+prefetch_data_free(prefetch_data_t *data)
+{
+    g_free(data->snap_name);
+    g_free(data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(prefetch_data_t, prefetch_data_free);
+
+static void
+prefetch_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autoptr(prefetch_data_t) data = user_data;
+    DsSnapdHelper *self = data->self;
+    g_autoptr(GPtrArray) snaps = NULL;
+    g_autoptr(GError) error = NULL;
+    DsLookupResult lookup_result;
+    SnapdSnap *snap;
+
+    /* Only cancelled when the helper is finalized */
+    snaps = snapd_client_find_finish(client, result, NULL, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    store_request_done(self, &data->ticket, error);
+    if (get_find_result(snaps, error, &lookup_result, &snap)) {
+        ds_lookup_cache_insert(self->lookup_cache, data->snap_name, lookup_result,
+                               snap != NULL ? snapd_snap_get_download_size(snap) : 0);
+        ds_metrics_increment("prefetched-lookups");
+    } else {
+        g_debug("Could not prefetch %s: %s", data->snap_name, error->message);
+    }
+    queue_prefetch(self, PREFETCH_INTERVAL);
+}
+
+static gboolean
+prefetch_next_cb(DsSnapdHelper *self)
+{
+    prefetch_data_t *data;
+    g_autofree char *snap_name = NULL;
+    DsLookupResult lookup_result;
+    request_ticket_t ticket;
+
+    self->prefetch_id = 0;
+
+    /* Stay out of the way of checks the user is waiting for */
+    if (self->current_check != NULL || g_hash_table_size(self->queries) > 0) {
+        queue_prefetch(self, PREFETCH_INTERVAL);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* Skip names that are already known */
+    while ((snap_name = g_queue_pop_head(self->prefetch_queue)) != NULL) {
+        if (!ds_lookup_cache_contains(self->lookup_cache, snap_name) &&
+            (self->store_catalog == NULL ||
+             !ds_store_catalog_lookup(self->store_catalog, snap_name, &lookup_result, NULL))) {
+            break;
+        }
+        g_clear_pointer(&snap_name, g_free);
+    }
+    if (snap_name == NULL) {
+        g_debug("Finished prefetching host theme lookups");
+        return G_SOURCE_REMOVE;
+    }
+
+    /* Try again once the outage should be over */
+    if (!store_request_allowed(self, "find-prefetch", &ticket, NULL)) {
+        g_queue_push_head(self->prefetch_queue, g_steal_pointer(&snap_name));
+        queue_prefetch(self, MAX(PREFETCH_INTERVAL, ds_circuit_breaker_get_retry_delay(self->store_breaker) * 1000));
+        return G_SOURCE_REMOVE;
+    }
+
+    data = g_new0(prefetch_data_t, 1);
+    data->self = self;
+    data->snap_name = g_steal_pointer(&snap_name);
+    data->ticket = ticket;
+    snapd_client_find_async(
+        self->client, SNAPD_FIND_FLAGS_MATCH_NAME, data->snap_name,
+        self->prefetch_cancellable, prefetch_cb, data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+queue_prefetch(DsSnapdHelper *self, guint delay)
+{
+    self->prefetch_id = g_timeout_add_full(G_PRIORITY_LOW, delay,
+                                           G_SOURCE_FUNC(prefetch_next_cb), self, NULL);
+}
+
+/* Adds the candidate snaps for every host theme of one kind */
+static void
+add_host_themes(DsSnapdHelper *self, GHashTable *names, DsThemeKind kind, const char *prefix)
+{
+    g_autoptr(GPtrArray) themes = ds_host_themes_get_themes(self->host_themes, kind);
+
+    for (guint i = 0; i < themes->len; i++) {
+        g_autoptr(GPtrArray) candidates = make_package_candidates(prefix, themes->pdata[i]);
+
+        for (guint j = 0; j < candidates->len; j++) {
+            g_hash_table_add(names, g_steal_pointer(&candidates->pdata[j]));
+        }
+    }
+}
+
+static gboolean
+start_prefetch_cb(DsSnapdHelper *self)
+{
+    g_autoptr(GHashTable) names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTableIter iter;
+    gpointer key;
+
+    self->prefetch_id = 0;
+
+    /* Wait for the host themes to be indexed */
+    if (!ds_host_themes_is_ready(self->host_themes)) {
+        self->prefetch_id = g_timeout_add_seconds_full(G_PRIORITY_LOW, 1,
+                                                       G_SOURCE_FUNC(start_prefetch_cb), self, NULL);
+        return G_SOURCE_REMOVE;
+    }
+
+    add_host_themes(self, names, DS_THEME_KIND_GTK, "gtk-theme-");
+    add_host_themes(self, names, DS_THEME_KIND_GTK4, "gtk-theme-");
+    add_host_themes(self, names, DS_THEME_KIND_ICON, "icon-theme-");
+    add_host_themes(self, names, DS_THEME_KIND_SOUND, "sound-theme-");
+    add_host_themes(self, names, DS_THEME_KIND_CURSOR, "icon-theme-");
+
+    self->prefetch_queue = g_queue_new();
+    g_hash_table_iter_init(&iter, names);
+    while (g_hash_table_iter_next(&iter, &key, NULL) &&
+           g_queue_get_length(self->prefetch_queue) < PREFETCH_MAX_NAMES) {
+        g_queue_push_tail(self->prefetch_queue, g_strdup(key));
+    }
+    g_debug("Prefetching %u host theme lookups", g_queue_get_length(self->prefetch_queue));
+
+    queue_prefetch(self, 0);
+    return G_SOURCE_REMOVE;
+}
+
+/* Looks up the snaps for the themes installed on the host in the
+ * background, so switching to one of them can be answered from the
+ * lookup cache.  Needs the host theme index. */
+void
+ds_snapd_helper_prefetch_host_themes(DsSnapdHelper *self)
+{
+    g_return_if_fail(self->host_themes != NULL);
+
+    if (self->prefetch_cancellable != NULL) {
+        return;
+    }
+    self->prefetch_cancellable = g_cancellable_new();
+    self->prefetch_id = g_timeout_add_seconds_full(G_PRIORITY_LOW, PREFETCH_START_DELAY,
+                                                   G_SOURCE_FUNC(start_prefetch_cb), self, NULL);
+}
+
+typedef struct {
+    int pending_installs;
+    GPtrArray *failed_snaps;
+    GError *error;
+    guint trace_id;
+    gulong cancelled_id;
+
+    /* Latest DsInstallProgress of each snap */
+    GArray *progress;
+    DsInstallProgressCallback progress_callback;
+    gpointer progress_callback_data;
+    gint64 last_progress_time;
+    guint progress_id;
+} install_data_t;
+
+static void
+install_data_free(install_data_t *data)
+{
+    g_clear_pointer(&data->failed_snaps, g_ptr_array_unref);
+    g_clear_pointer(&data->error, g_error_free);
+    g_clear_pointer(&data->progress, g_array_unref);
+    g_clear_handle_id(&data->progress_id, g_source_remove);
+    g_free(data);
+}
+
+typedef struct {
+    GTask *task;
+    char *snap_name;
+    guint index;
+    gint64 begin_time;
+    /* ID of the snapd change making the install, once known */
+    char *change_id;
+    request_ticket_t ticket;
+
+    /* How soon the theme is seen, lowest first */
+    guint visibility;
+    /* Size of the download, or UNKNOWN_DOWNLOAD_SIZE */
+    guint64 download_size;
+} install_snap_data_t;
+
+static void
+install_snap_data_free(install_snap_data_t *data)
+{
+    g_clear_object(&data->task);
+    g_free(data->snap_name);
+    g_free(data->change_id);
+    g_free(data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(install_snap_data_t, install_snap_data_free);
+
+static void
+report_install_progress(GTask *task)
+{
+    DsSnapdHelper *self = g_task_get_source_object(task);
+    install_data_t *data = g_task_get_task_data(task);
+    DsInstallProgress progress = { 0 };
+
+    data->last_progress_time = g_get_monotonic_time();
+    for (guint i = 0; i < data->progress->len; i++) {
+        DsInstallProgress *snap_progress = &g_array_index(data->progress, DsInstallProgress, i);
+
+        progress.tasks_done += snap_progress->tasks_done;
+        progress.tasks_total += snap_progress->tasks_total;
+        progress.bytes_done += snap_progress->bytes_done;
+        progress.bytes_total += snap_progress->bytes_total;
+    }
+    data->progress_callback(self, &progress, data->progress_callback_data);
+}
+
+static gboolean
+install_progress_timeout_cb(GTask *task)
+{
+    install_data_t *data = g_task_get_task_data(task);
+
+    data->progress_id = 0;
+    report_install_progress(task);
+    return G_SOURCE_REMOVE;
+}
+
+/* snapd reports progress many times a second while downloading, so
+ * reports are coalesced to one per PROGRESS_INTERVAL.  The last update
+ * in an interval is delivered when it ends. */
+static void
+queue_install_progress(GTask *task)
+{
+    install_data_t *data = g_task_get_task_data(task);
+    gint64 elapsed;
+
+    if (data->progress_callback == NULL || data->progress_id != 0) {
+        return;
+    }
+
+    elapsed = (g_get_monotonic_time() - data->last_progress_time) / 1000;
+    if (elapsed >= PROGRESS_INTERVAL) {
+        report_install_progress(task);
+        return;
+    }
+    data->progress_id = g_timeout_add(PROGRESS_INTERVAL - elapsed,
+                                      G_SOURCE_FUNC(install_progress_timeout_cb), task);
+}
+
+static void
+install_progress_cb(SnapdClient *client, SnapdChange *change, gpointer deprecated, gpointer user_data)
+{
+    install_snap_data_t *install_data = user_data;
+    install_data_t *data = g_task_get_task_data(install_data->task);
+    DsInstallProgress *progress = &g_array_index(data->progress, DsInstallProgress, install_data->index);
+    GPtrArray *tasks = snapd_change_get_tasks(change);
+
+    if (install_data->change_id == NULL) {
+        install_data->change_id = g_strdup(snapd_change_get_id(change));
+    }
+
+    *progress = (DsInstallProgress) { 0 };
+    for (guint i = 0; i < tasks->len; i++) {
+        SnapdTask *snapd_task = tasks->pdata[i];
+
+        progress->tasks_total++;
+        if (snapd_task_get_ready(snapd_task)) {
+            progress->tasks_done++;
+        }
+        if (g_strcmp0(snapd_task_get_kind(snapd_task), "download-snap") == 0) {
+            progress->bytes_done += snapd_task_get_progress_done(snapd_task);
+            progress->bytes_total += snapd_task_get_progress_total(snapd_task);
+        }
+    }
+
+    queue_install_progress(install_data->task);
+}
+
+static void
+maybe_complete_install_task(GTask *task)
+{
+    install_data_t *data = g_task_get_task_data(task);
+    g_autofree char *failed_names = NULL;
+
+    if (data->pending_installs > 0) {
+        return;
+    }
+    g_cancellable_disconnect(g_task_get_cancellable(task), data->cancelled_id);
+    data->cancelled_id = 0;
+
+    /* Deliver the final progress before the result */
+    if (data->progress_id != 0) {
+        g_clear_handle_id(&data->progress_id, g_source_remove);
+        report_install_progress(task);
+    }
+    if (data->error == NULL) {
+        g_task_return_boolean(task, TRUE);
+        return;
+    }
+
+    /* Report every snap that failed, along with the first error */
+    g_ptr_array_add(data->failed_snaps, NULL);
+    failed_names = g_strjoinv(", ", (char **)data->failed_snaps->pdata);
+    g_prefix_error(&data->error, "Failed to install %s: ", failed_names);
+    g_task_return_error(task, g_steal_pointer(&data->error));
+}
+
+static void start_installs(DsSnapdHelper *self);
+
+/* Records the outcome of one install, and completes the task once all
+ * of its installs are done */
+static void
+finish_install(install_snap_data_t *install_data, GError *error)
+{
+    DsSnapdHelper *self = g_task_get_source_object(install_data->task);
+    install_data_t *data = g_task_get_task_data(install_data->task);
+
+    data->pending_installs--;
+
+    if (error == NULL) {
+        DsInstallProgress *progress = &g_array_index(data->progress, DsInstallProgress, install_data->index);
+
+        g_print("Installed snap %s\n", install_data->snap_name);
+        ds_metrics_increment("installs-succeeded");
+        progress->tasks_done = progress->tasks_total;
+        progress->bytes_done = progress->bytes_total;
+        queue_install_progress(install_data->task);
+
+        /* The snap stays marked as being installed until its themes
+         * are in the index, and the notice for the change is skipped */
+        if (install_data->change_id != NULL) {
+            mark_change_handled(self, install_data->change_id);
+        }
+        update_snap_themes(self, install_data->snap_name, TRUE);
+    } else {
+        g_hash_table_remove(self->installing, install_data->snap_name);
+        g_warning("Could not install snap %s: %s", install_data->snap_name, error->message);
+        ds_metrics_increment("installs-failed");
+        g_ptr_array_add(data->failed_snaps, g_strdup(install_data->snap_name));
+        if (data->error == NULL) {
+            data->error = g_error_copy(error);
+        }
+    }
+
+    maybe_complete_install_task(install_data->task);
+}
+
+static void
+install_snap_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autoptr(install_snap_data_t) install_data = user_data;
+    DsSnapdHelper *self = g_task_get_source_object(install_data->task);
+    install_data_t *data = g_task_get_task_data(install_data->task);
+    g_autoptr(GError) error = NULL;
+
+    self->running_installs--;
+    ds_trace_end(data->trace_id, "install", install_data->begin_time, install_data->snap_name);
+
+    snapd_client_install2_finish(client, result, &error);
+    snapd_request_done(self, &install_data->ticket, error);
+    finish_install(install_data, error);
+
+    start_installs(self);
+}
+
+/* Themes that are seen all the time come first */
+static guint
+get_snap_visibility(const char *snap_name)
+{
+    if (g_str_has_prefix(snap_name, "gtk-theme-")) {
+        return 0;
+    }
+    if (g_str_has_prefix(snap_name, "icon-theme-")) {
+        return 1;
+    }
+    if (g_str_has_prefix(snap_name, "sound-theme-")) {
+        return 2;
+    }
+    return 3;
+}
+
+/* Orders installs by visibility, then the smallest download first */
+static gint
+compare_installs(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const install_snap_data_t *install_a = a, *install_b = b;
+
+    if (install_a->visibility != install_b->visibility) {
+        return install_a->visibility < install_b->visibility ? -1 : 1;
+    }
+    if (install_a->download_size != install_b->download_size) {
+        return install_a->download_size < install_b->download_size ? -1 : 1;
+    }
+    return 0;
+}
+
+static guint
+get_max_installs(DsSnapdHelper *self)
+{
+    return g_network_monitor_get_network_metered(self->network_monitor) ? MAX_METERED_INSTALLS : MAX_CONCURRENT_INSTALLS;
+}
+
+/* Whether a download is small enough to make on a metered network */
+static gboolean
+is_small_download(guint64 download_size)
+{
+    return download_size <= MAX_METERED_DOWNLOAD;
+}
+
+/* Whether an install of known, small size is waiting */
+static gboolean
+have_small_install_queued(DsSnapdHelper *self)
+{
+    for (GList *link = self->install_queue->head; link != NULL; link = link->next) {
+        install_snap_data_t *install_data = link->data;
+
+        if (is_small_download(install_data->download_size)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Whether the network allows an install to start now.  Nothing is
+ * downloaded without a network, and large downloads wait for an
+ * unmetered one.  Downloads of unknown size go once nothing known to
+ * be small is waiting, rather than never on a metered network. */
+static gboolean
+install_can_start(DsSnapdHelper *self, install_snap_data_t *install_data)
+{
+    if (!g_network_monitor_get_network_available(self->network_monitor)) {
+        return FALSE;
+    }
+    if (!g_network_monitor_get_network_metered(self->network_monitor)) {
+        return TRUE;
+    }
+    if (install_data->download_size == UNKNOWN_DOWNLOAD_SIZE) {
+        return !have_small_install_queued(self);
+    }
+    return is_small_download(install_data->download_size);
+}
+
+static void
+start_install(DsSnapdHelper *self, install_snap_data_t *install_data)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!snapd_request_allowed(self, "install", &install_data->ticket, &error)) {
+        finish_install(install_data, error);
+        install_snap_data_free(install_data);
+        return;
+    }
+
+    g_print("Installing snap %s\n", install_data->snap_name);
+    self->running_installs++;
+    install_data->begin_time = ds_trace_begin();
+    ds_metrics_increment("installs-started");
+    snapd_client_install2_async(
+        self->client, SNAPD_INSTALL_FLAGS_NONE,
+        install_data->snap_name, NULL, NULL,
+        install_progress_cb, install_data, g_task_get_cancellable(install_data->task),
+        install_snap_cb, install_data);
+}
+
+/* Starts queued installs in order, as far as the network allows.
+ * Deferred installs are passed over, and started when the network
+ * changes. */
+static void
+start_installs(DsSnapdHelper *self)
+{
+    GList *link = self->install_queue->head;
+
+    while (link != NULL) {
+        GList *next = link->next;
+        install_snap_data_t *install_data = link->data;
+        g_autoptr(GError) error = NULL;
+
+        if (g_cancellable_set_error_if_cancelled(g_task_get_cancellable(install_data->task), &error)) {
+            g_queue_delete_link(self->install_queue, link);
+            finish_install(install_data, error);
+            install_snap_data_free(install_data);
+        } else if (self->running_installs < get_max_installs(self) && install_can_start(self, install_data)) {
+            g_queue_delete_link(self->install_queue, link);
+            start_install(self, install_data);
+        }
+        link = next;
+    }
+
+    if (self->running_installs == 0 && self->install_queue->length > 0) {
+        g_message("Deferring %u snap installs until the network allows", self->install_queue->length);
+        ds_metrics_increment("installs-deferred");
+    }
+}
+
+static void
+network_changed_cb(DsSnapdHelper *self)
+{
+    start_installs(self);
+}
+
+static gboolean
+install_cancelled_idle_cb(GTask *task)
+{
+    start_installs(g_task_get_source_object(task));
+    return G_SOURCE_REMOVE;
+}
+
+/* Drops the task's queued installs, which may be waiting for the
+ * network to change.  This can't complete the task from inside the
+ * signal handler, as that disconnects it. */
+static void
+install_cancelled_cb(GCancellable *cancellable, GTask *task)
+{
+    g_idle_add_full(G_PRIORITY_DEFAULT, G_SOURCE_FUNC(install_cancelled_idle_cb),
+                    g_object_ref(task), g_object_unref);
+}
+
+static void
+set_network_monitor(DsSnapdHelper *self, GNetworkMonitor *network_monitor)
+{
+    if (self->network_monitor != NULL) {
+        g_signal_handlers_disconnect_by_data(self->network_monitor, self);
+    }
+    g_clear_object(&self->network_monitor);
+    self->network_monitor = g_object_ref(network_monitor != NULL ? network_monitor : g_network_monitor_get_default());
+    g_signal_connect_swapped(self->network_monitor, "network-changed", G_CALLBACK(network_changed_cb), self);
+    g_signal_connect_swapped(self->network_monitor, "notify::network-metered", G_CALLBACK(network_changed_cb), self);
+}
+
+/* Queues the snaps to be installed.  The most visible themes and the
+ * smallest downloads go first, and only a few installs run at once, or
+ * one on a metered network.  Large downloads wait for an unmetered
+ * network, and downloads of unknown size go after the small ones.
+ * Snaps already being installed by an earlier call are skipped, and if
+ * that is all of them the call fails with G_IO_ERROR_PENDING, as
+ * nothing it installs is complete yet.  If progress_callback is set, it is called with the combined
+ * progress of the installs at a limited rate. */
+void
+ds_snapd_helper_install_snaps(DsSnapdHelper *self, GPtrArray *snaps, DsInstallProgressCallback progress_callback, gpointer progress_callback_data, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    install_data_t *data = g_new0(install_data_t, 1);
+    guint n_queued = 0;
+
+    data->failed_snaps = g_ptr_array_new_with_free_func(g_free);
+    data->trace_id = ds_trace_new_id();
+    data->progress = g_array_new(FALSE, TRUE, sizeof(DsInstallProgress));
+    data->progress_callback = progress_callback;
+    data->progress_callback_data = progress_callback_data;
+    g_task_set_task_data(task, data, (GDestroyNotify)install_data_free);
+
+    /* Installs that fail straight away mustn't complete the task until
+     * all have been queued */
+    data->pending_installs++;
+    for (guint i = 0; i < snaps->len; i++) {
+        SnapdSnap *snap = snaps->pdata[i];
+        const char *snap_name = snapd_snap_get_name(snap);
+        gint64 download_size = snapd_snap_get_download_size(snap);
+        install_snap_data_t *install_data;
+
+        if (!g_hash_table_add(self->installing, g_strdup(snap_name))) {
+            g_message("Snap %s is already being installed", snap_name);
+            ds_metrics_increment("installs-skipped");
+            continue;
+        }
+
+        install_data = g_new0(install_snap_data_t, 1);
+        install_data->task = g_object_ref(task);
+        install_data->snap_name = g_strdup(snap_name);
+        install_data->index = data->progress->len;
+        install_data->visibility = get_snap_visibility(snap_name);
+        install_data->download_size = download_size > 0 ? (guint64)download_size : UNKNOWN_DOWNLOAD_SIZE;
+        g_array_set_size(data->progress, data->progress->len + 1);
+
+        data->pending_installs++;
+        g_queue_insert_sorted(self->install_queue, install_data, compare_installs, NULL);
+        n_queued++;
+    }
+
+    if (snaps->len > 0 && n_queued == 0) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_PENDING,
+                                "The snaps are already being installed");
+        return;
+    }
+    if (cancellable != NULL) {
+        data->cancelled_id = g_cancellable_connect(cancellable, G_CALLBACK(install_cancelled_cb), task, NULL);
+    }
 
-    g_task_set_task_data(task, g_ptr_array_copy(snaps, (GCopyFunc)g_object_ref, NULL), (GDestroyNotify)g_ptr_array_unref);
-    install_next_snap(task);
+    start_installs(self);
+    data->pending_installs--;
+    maybe_complete_install_task(task);
 }
 
 gboolean
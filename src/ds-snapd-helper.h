@@ -1,8 +1,10 @@
 #pragma once
 
-#include <glib-object.h>
+#include <gio/gio.h>
 #include <snapd-glib/snapd-glib.h>
 
+#include "ds-host-themes.h"
+#include "ds-lookup-cache.h"
 #include "ds-theme-set.h"
 
 G_BEGIN_DECLS
@@ -10,15 +12,45 @@ G_BEGIN_DECLS
 #define DS_TYPE_SNAPD_HELPER (ds_snapd_helper_get_type())
 G_DECLARE_FINAL_TYPE(DsSnapdHelper, ds_snapd_helper, DS, SNAPD_HELPER, GObject);
 
+/* Progress of an install, summed over all the snaps being installed.
+ * Bytes are only known for downloads that have started. */
+typedef struct {
+    guint tasks_done;
+    guint tasks_total;
+    guint64 bytes_done;
+    guint64 bytes_total;
+} DsInstallProgress;
+
+typedef void (*DsInstallProgressCallback)(DsSnapdHelper *self, const DsInstallProgress *progress, gpointer user_data);
+
+/* Finds the snaps missing for a theme set somewhere other than this
+ * helper.  The result is a GPtrArray of SnapdSnap. */
+typedef void (*DsSnapdHelperResolveFunc)(GObject *resolver, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+typedef GPtrArray *(*DsSnapdHelperResolveFinishFunc)(GAsyncResult *result, GError **error);
+
 DsSnapdHelper *ds_snapd_helper_new(SnapdClient *client);
 
+DsLookupCache *ds_snapd_helper_get_lookup_cache(DsSnapdHelper *self);
+guint ds_snapd_helper_get_snapd_requests(DsSnapdHelper *self);
+
+void ds_snapd_helper_set_host_themes(DsSnapdHelper *self, DsHostThemes *host_themes);
+void ds_snapd_helper_use_store_catalog(DsSnapdHelper *self);
+void ds_snapd_helper_prefetch_host_themes(DsSnapdHelper *self);
+
 void ds_snapd_helper_get_installed_themes(DsSnapdHelper *self, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
 gboolean ds_snapd_helper_get_installed_themes_finish(DsSnapdHelper *self, GAsyncResult *result, GPtrArray **gtk_themes, GPtrArray **icon_themes, GPtrArray **sound_themes, GError **error);
 
-void ds_snapd_helper_find_missing_snaps(DsSnapdHelper *self, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+void ds_snapd_helper_find_missing_snaps(DsSnapdHelper *self, const DsThemeSet *themes, guint changed, guint trace_id, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
 GPtrArray *ds_snapd_helper_find_missing_snaps_finish(DsSnapdHelper *self, GAsyncResult *result, GError **error);
 
-void ds_snapd_helper_install_snaps(DsSnapdHelper *self, GPtrArray *snaps, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+void ds_snapd_helper_query_missing_snaps(DsSnapdHelper *self, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GPtrArray *ds_snapd_helper_query_missing_snaps_finish(DsSnapdHelper *self, GAsyncResult *result, GError **error);
+
+void ds_snapd_helper_decline_snaps(DsSnapdHelper *self, const DsThemeSet *themes, GPtrArray *snaps);
+
+void ds_snapd_helper_set_resolver(DsSnapdHelper *self, GObject *resolver, DsSnapdHelperResolveFunc resolve, DsSnapdHelperResolveFinishFunc resolve_finish);
+
+void ds_snapd_helper_install_snaps(DsSnapdHelper *self, GPtrArray *snaps, DsInstallProgressCallback progress_callback, gpointer progress_callback_data, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
 gboolean ds_snapd_helper_install_snaps_finish(DsSnapdHelper *self, GAsyncResult *result, GError **error);
 
 G_END_DECLS
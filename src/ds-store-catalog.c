@@ -0,0 +1,386 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <glib/gstdio.h>
+
+#include "ds-metrics.h"
+#include "ds-store-catalog.h"
+
+/* The catalog file is a serialised GVariant: a format version, the
+ * time of the refresh in seconds, and every theme snap in the store
+ * sorted by name, with whether it is available on the stable channel
+ * and its download size, or 0 if the store didn't give one.  It is
+ * mapped rather than read, and searched in place. */
+#define CATALOG_TYPE "(uxa(sbx))"
+#define CATALOG_VERSION 2
+
+/* The name prefixes of theme snaps, each fetched with one query */
+static const char *theme_prefixes[] = { "gtk-theme-", "icon-theme-", "sound-theme-", NULL };
+
+struct _DsStoreCatalog {
+    GObject parent;
+
+    char *path;
+    guint refresh_interval;
+    guint retry_interval;
+    /* When a refresh last failed, in seconds, or 0 */
+    gint64 failure_time;
+
+    /* The contents of the catalog file, and its sorted entries */
+    GVariant *catalog;
+    GVariant *entries;
+    gint64 refresh_time;
+};
+
+G_DEFINE_TYPE(DsStoreCatalog, ds_store_catalog, G_TYPE_OBJECT);
+
+enum {
+    PROP_PATH = 1,
+    PROP_REFRESH_INTERVAL,
+    PROP_RETRY_INTERVAL,
+    PROP_LAST,
+};
+
+/* Replaces the catalog, sinking any floating reference to it */
+static void
+ds_store_catalog_set_catalog(DsStoreCatalog *self, GVariant *catalog)
+{
+    g_autoptr(GVariant) owned_catalog = g_variant_ref_sink(catalog);
+    guint32 version;
+
+    g_clear_pointer(&self->entries, g_variant_unref);
+    g_clear_pointer(&self->catalog, g_variant_unref);
+    self->refresh_time = 0;
+
+    g_variant_get(owned_catalog, "(ux@a(sbx))", &version, &self->refresh_time, &self->entries);
+    if (version != CATALOG_VERSION) {
+        g_warning("Ignoring store catalog with unsupported version %u", version);
+        g_clear_pointer(&self->entries, g_variant_unref);
+        self->refresh_time = 0;
+        return;
+    }
+    self->catalog = g_steal_pointer(&owned_catalog);
+}
+
+static void
+ds_store_catalog_load(DsStoreCatalog *self)
+{
+    g_autoptr(GMappedFile) file = NULL;
+    g_autoptr(GBytes) bytes = NULL;
+    g_autoptr(GError) error = NULL;
+
+    file = g_mapped_file_new(self->path, FALSE, &error);
+    if (file == NULL) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning("Could not load store catalog: %s", error->message);
+        }
+        return;
+    }
+
+    bytes = g_mapped_file_get_bytes(file);
+    ds_store_catalog_set_catalog(self, g_variant_new_from_bytes(G_VARIANT_TYPE(CATALOG_TYPE), bytes, FALSE));
+}
+
+static void
+ds_store_catalog_finalize(GObject *object)
+{
+    DsStoreCatalog *self = DS_STORE_CATALOG(object);
+
+    g_clear_pointer(&self->entries, g_variant_unref);
+    g_clear_pointer(&self->catalog, g_variant_unref);
+    g_clear_pointer(&self->path, g_free);
+    G_OBJECT_CLASS(ds_store_catalog_parent_class)->finalize(object);
+}
+
+static void
+ds_store_catalog_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+    DsStoreCatalog *self = DS_STORE_CATALOG(object);
+
+    switch (prop_id) {
+    case PROP_PATH:
+        g_value_set_string(value, self->path);
+        break;
+    case PROP_REFRESH_INTERVAL:
+        g_value_set_uint(value, self->refresh_interval);
+        break;
+    case PROP_RETRY_INTERVAL:
+        g_value_set_uint(value, self->retry_interval);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_store_catalog_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+    DsStoreCatalog *self = DS_STORE_CATALOG(object);
+
+    switch (prop_id) {
+    case PROP_PATH:
+        g_clear_pointer(&self->path, g_free);
+        self->path = g_value_dup_string(value);
+        if (self->path != NULL) {
+            ds_store_catalog_load(self);
+        }
+        break;
+    case PROP_REFRESH_INTERVAL:
+        self->refresh_interval = g_value_get_uint(value);
+        break;
+    case PROP_RETRY_INTERVAL:
+        self->retry_interval = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+ds_store_catalog_class_init(DsStoreCatalogClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->finalize = ds_store_catalog_finalize;
+    gobject_class->get_property = ds_store_catalog_get_property;
+    gobject_class->set_property = ds_store_catalog_set_property;
+
+    g_object_class_install_property(
+        gobject_class, PROP_PATH,
+        g_param_spec_string("path", "path", "File the catalog is stored in",
+                            NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(
+        gobject_class, PROP_REFRESH_INTERVAL,
+        g_param_spec_uint("refresh-interval", "refresh interval", "seconds before the catalog is fetched again",
+                          0, G_MAXUINT, 24 * 60 * 60, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+    g_object_class_install_property(
+        gobject_class, PROP_RETRY_INTERVAL,
+        g_param_spec_uint("retry-interval", "retry interval", "seconds before a failed fetch is retried",
+                          0, G_MAXUINT, 60 * 60, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+}
+
+static void
+ds_store_catalog_init(DsStoreCatalog *self)
+{
+}
+
+DsStoreCatalog *
+ds_store_catalog_new(const char *path)
+{
+    return g_object_new(DS_TYPE_STORE_CATALOG, "path", path, NULL);
+}
+
+static gboolean
+is_theme_snap(const char *snap_name)
+{
+    for (guint i = 0; theme_prefixes[i] != NULL; i++) {
+        if (g_str_has_prefix(snap_name, theme_prefixes[i])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Looks up a theme snap in the catalog, setting download_size to its
+ * size, or 0 if that isn't known.  Returns FALSE if there is no
+ * catalog or it doesn't list snap_name, in which case the store has to
+ * be asked directly.  Only snaps the catalog lists are trusted: search
+ * results can leave snaps out, so absence doesn't prove they aren't in
+ * the store. */
+gboolean
+ds_store_catalog_lookup(DsStoreCatalog *self, const char *snap_name, DsLookupResult *result, gint64 *download_size)
+{
+    gsize lo = 0, hi;
+
+    if (self->entries == NULL || !is_theme_snap(snap_name)) {
+        return FALSE;
+    }
+
+    hi = g_variant_n_children(self->entries);
+    while (lo < hi) {
+        gsize mid = lo + (hi - lo) / 2;
+        const char *name;
+        gboolean stable;
+        gint64 size;
+        int cmp;
+
+        g_variant_get_child(self->entries, mid, "(&sbx)", &name, &stable, &size);
+        cmp = strcmp(snap_name, name);
+        if (cmp == 0) {
+            *result = stable ? DS_LOOKUP_RESULT_FOUND : DS_LOOKUP_RESULT_UNAVAILABLE;
+            if (download_size != NULL) {
+                *download_size = size;
+            }
+            return TRUE;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Returns whether the catalog is out of date, and a refresh hasn't
+ * failed too recently to try again */
+gboolean
+ds_store_catalog_needs_refresh(DsStoreCatalog *self)
+{
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+    if (now - self->failure_time < self->retry_interval) {
+        return FALSE;
+    }
+    return now - self->refresh_time >= self->refresh_interval;
+}
+
+typedef struct {
+    gboolean stable;
+    gint64 download_size;
+} catalog_entry_t;
+
+typedef struct {
+    int pending_queries;
+    /* Snap name -> catalog_entry_t */
+    GHashTable *snaps;
+    GError *error;
+} refresh_data_t;
+
+static void
+refresh_data_free(refresh_data_t *data)
+{
+    g_clear_pointer(&data->snaps, g_hash_table_unref);
+    g_clear_pointer(&data->error, g_error_free);
+    g_free(data);
+}
+
+static int
+compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static gboolean
+ds_store_catalog_save(DsStoreCatalog *self, GVariant *catalog, GError **error)
+{
+    g_autofree char *dir = g_path_get_dirname(self->path);
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Could not create %s: %s", dir, g_strerror(errsv));
+        return FALSE;
+    }
+    return g_file_set_contents(self->path, g_variant_get_data(catalog),
+                               g_variant_get_size(catalog), error);
+}
+
+static void
+maybe_complete_refresh_task(GTask *task)
+{
+    DsStoreCatalog *self = g_task_get_source_object(task);
+    refresh_data_t *data = g_task_get_task_data(task);
+    g_autofree gpointer *names = NULL;
+    guint n_names;
+    g_autoptr(GVariant) catalog = NULL;
+    g_autoptr(GError) error = NULL;
+    GVariantBuilder builder;
+
+    if (data->pending_queries > 0) {
+        return;
+    }
+    if (data->error != NULL) {
+        if (!g_error_matches(data->error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            self->failure_time = g_get_real_time() / G_USEC_PER_SEC;
+        }
+        g_task_return_error(task, g_steal_pointer(&data->error));
+        return;
+    }
+
+    self->failure_time = 0;
+    names = g_hash_table_get_keys_as_array(data->snaps, &n_names);
+    qsort(names, n_names, sizeof(gpointer), compare_names);
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sbx)"));
+    for (guint i = 0; i < n_names; i++) {
+        catalog_entry_t *entry = g_hash_table_lookup(data->snaps, names[i]);
+
+        g_variant_builder_add(&builder, "(sbx)", names[i], entry->stable, entry->download_size);
+    }
+    catalog = g_variant_ref_sink(g_variant_new(CATALOG_TYPE, CATALOG_VERSION,
+                                               g_get_real_time() / G_USEC_PER_SEC, &builder));
+
+    g_message("Store catalog has %u theme snaps", n_names);
+    ds_store_catalog_set_catalog(self, catalog);
+    if (self->path != NULL && !ds_store_catalog_save(self, catalog, &error)) {
+        g_warning("Could not save store catalog: %s", error->message);
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+static void
+find_theme_snaps_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DS_METRICS_TIME_CALLBACK();
+    SnapdClient *client = SNAPD_CLIENT(object);
+    g_autoptr(GTask) task = user_data;
+    refresh_data_t *data = g_task_get_task_data(task);
+    g_autoptr(GPtrArray) snaps = NULL;
+    g_autoptr(GError) error = NULL;
+
+    data->pending_queries--;
+
+    snaps = snapd_client_find_finish(client, result, NULL, &error);
+    if (snaps == NULL && !g_error_matches(error, SNAPD_ERROR, SNAPD_ERROR_NOT_FOUND)) {
+        if (data->error == NULL) {
+            data->error = g_steal_pointer(&error);
+        }
+    }
+
+    for (guint i = 0; snaps != NULL && i < snaps->len; i++) {
+        SnapdSnap *snap = snaps->pdata[i];
+        const char *name = snapd_snap_get_name(snap);
+        catalog_entry_t *entry;
+
+        /* Searches match more than the name prefix */
+        if (!is_theme_snap(name)) {
+            continue;
+        }
+        entry = g_new0(catalog_entry_t, 1);
+        entry->stable = g_strcmp0(snapd_snap_get_channel(snap), "stable") == 0;
+        entry->download_size = snapd_snap_get_download_size(snap);
+        g_hash_table_insert(data->snaps, g_strdup(name), entry);
+    }
+
+    maybe_complete_refresh_task(task);
+}
+
+/* Fetches every theme snap from the store with one search per theme
+ * prefix, and stores them as the new catalog */
+void
+ds_store_catalog_refresh(DsStoreCatalog *self, SnapdClient *client, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
+    refresh_data_t *data = g_new0(refresh_data_t, 1);
+
+    data->snaps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_task_set_task_data(task, data, (GDestroyNotify)refresh_data_free);
+
+    for (guint i = 0; theme_prefixes[i] != NULL; i++) {
+        /* The store searches words, so drop the trailing dash */
+        g_autofree char *query = g_strndup(theme_prefixes[i], strlen(theme_prefixes[i]) - 1);
+
+        data->pending_queries++;
+        ds_metrics_increment("snapd-requests-find-catalog");
+        snapd_client_find_async(client, SNAPD_FIND_FLAGS_NONE, query, cancellable,
+                                find_theme_snaps_cb, g_object_ref(task));
+    }
+}
+
+gboolean
+ds_store_catalog_refresh_finish(DsStoreCatalog *self, GAsyncResult *result, GError **error)
+{
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <snapd-glib/snapd-glib.h>
+
+#include "ds-lookup-cache.h"
+
+G_BEGIN_DECLS
+
+#define DS_TYPE_STORE_CATALOG (ds_store_catalog_get_type())
+G_DECLARE_FINAL_TYPE(DsStoreCatalog, ds_store_catalog, DS, STORE_CATALOG, GObject);
+
+DsStoreCatalog *ds_store_catalog_new(const char *path);
+
+gboolean ds_store_catalog_lookup(DsStoreCatalog *self, const char *snap_name, DsLookupResult *result, gint64 *download_size);
+gboolean ds_store_catalog_needs_refresh(DsStoreCatalog *self);
+
+void ds_store_catalog_refresh(DsStoreCatalog *self, SnapdClient *client, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+gboolean ds_store_catalog_refresh_finish(DsStoreCatalog *self, GAsyncResult *result, GError **error);
+
+G_END_DECLS
@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "ds-theme-index.h"
+
+#define INDEX_GROUP "index"
+#define SNAP_GROUP_PREFIX "snap "
+#define INDEX_VERSION 3
+
+/* The themes provided by a single snap */
+typedef struct {
+    /* Sets of theme names */
+    GHashTable *themes[DS_THEME_KIND_LAST];
+} snap_themes_t;
+
+struct _DsThemeIndex {
+    gatomicrefcount ref_count;
+
+    char *revision;
+    /* Theme name -> number of snaps providing it */
+    GHashTable *themes[DS_THEME_KIND_LAST];
+    /* Snap name -> snap_themes_t */
+    GHashTable *snaps;
+};
+
+static const char *theme_kind_keys[DS_THEME_KIND_LAST] = {
+    [DS_THEME_KIND_GTK] = "gtk-themes",
+    [DS_THEME_KIND_ICON] = "icon-themes",
+    [DS_THEME_KIND_SOUND] = "sound-themes",
+    [DS_THEME_KIND_GTK4] = "gtk4-themes",
+    [DS_THEME_KIND_CURSOR] = "cursor-themes",
+};
+
+/* Content interface IDs of slots providing themes */
+static const struct {
+    const char *content;
+    DsThemeKind kind;
+} theme_contents[] = {
+    { "gtk-3-themes", DS_THEME_KIND_GTK },
+    { "gtk-4-themes", DS_THEME_KIND_GTK4 },
+    { "icon-themes", DS_THEME_KIND_ICON },
+    { "cursor-themes", DS_THEME_KIND_CURSOR },
+    { "sound-themes", DS_THEME_KIND_SOUND },
+};
+
+G_DEFINE_BOXED_TYPE(DsThemeIndex, ds_theme_index, ds_theme_index_ref, ds_theme_index_unref);
+
+/* Looks up the kind of theme provided by slots with the given content
+ * ID, returning FALSE if they don't provide themes.  Safe to call from
+ * any thread. */
+gboolean
+ds_theme_index_get_content_kind(const char *content, DsThemeKind *kind)
+{
+    static GHashTable *content_kinds = NULL;
+    gpointer value;
+
+    if (g_once_init_enter(&content_kinds)) {
+        GHashTable *table = g_hash_table_new(g_str_hash, g_str_equal);
+
+        for (gsize i = 0; i < G_N_ELEMENTS(theme_contents); i++) {
+            g_hash_table_insert(table, (gpointer)theme_contents[i].content,
+                                GINT_TO_POINTER(theme_contents[i].kind + 1));
+        }
+        g_once_init_leave(&content_kinds, table);
+    }
+
+    if (content == NULL) {
+        return FALSE;
+    }
+    value = g_hash_table_lookup(content_kinds, content);
+    if (value == NULL) {
+        return FALSE;
+    }
+    *kind = GPOINTER_TO_INT(value) - 1;
+    return TRUE;
+}
+
+static snap_themes_t *
+snap_themes_new(void)
+{
+    snap_themes_t *snap_themes = g_new0(snap_themes_t, 1);
+
+    for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+        snap_themes->themes[kind] = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    return snap_themes;
+}
+
+static void
+snap_themes_free(snap_themes_t *snap_themes)
+{
+    for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+        g_hash_table_unref(snap_themes->themes[kind]);
+    }
+    g_free(snap_themes);
+}
+
+DsThemeIndex *
+ds_theme_index_new(const char *revision)
+{
+    DsThemeIndex *index = g_new0(DsThemeIndex, 1);
+
+    g_atomic_ref_count_init(&index->ref_count);
+    index->revision = g_strdup(revision);
+    for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+        index->themes[kind] = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    index->snaps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)snap_themes_free);
+    return index;
+}
+
+/* Returns a modifiable copy of index with a new revision.  Indexes may
+ * be shared with running tasks, so they are copied rather than changed
+ * in place once published. */
+DsThemeIndex *
+ds_theme_index_copy(const DsThemeIndex *index, const char *revision)
+{
+    DsThemeIndex *copy = ds_theme_index_new(revision);
+    GHashTableIter iter, theme_iter;
+    gpointer key, value, theme_name;
+
+    g_hash_table_iter_init(&iter, index->snaps);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        snap_themes_t *snap_themes = value;
+
+        for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+            g_hash_table_iter_init(&theme_iter, snap_themes->themes[kind]);
+            while (g_hash_table_iter_next(&theme_iter, &theme_name, NULL)) {
+                ds_theme_index_add(copy, key, kind, theme_name);
+            }
+        }
+    }
+    return copy;
+}
+
+DsThemeIndex *
+ds_theme_index_ref(DsThemeIndex *index)
+{
+    g_atomic_ref_count_inc(&index->ref_count);
+    return index;
+}
+
+void
+ds_theme_index_unref(DsThemeIndex *index)
+{
+    if (!g_atomic_ref_count_dec(&index->ref_count)) {
+        return;
+    }
+    g_free(index->revision);
+    for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+        g_hash_table_unref(index->themes[kind]);
+    }
+    g_hash_table_unref(index->snaps);
+    g_free(index);
+}
+
+const char *
+ds_theme_index_get_revision(const DsThemeIndex *index)
+{
+    return index->revision;
+}
+
+void
+ds_theme_index_add(DsThemeIndex *index, const char *snap_name, DsThemeKind kind, const char *theme_name)
+{
+    snap_themes_t *snap_themes = g_hash_table_lookup(index->snaps, snap_name);
+    gpointer count;
+
+    if (snap_themes == NULL) {
+        snap_themes = snap_themes_new();
+        g_hash_table_insert(index->snaps, g_strdup(snap_name), snap_themes);
+    }
+    if (!g_hash_table_add(snap_themes->themes[kind], g_strdup(theme_name))) {
+        return;
+    }
+
+    count = g_hash_table_lookup(index->themes[kind], theme_name);
+    if (count == NULL) {
+        g_hash_table_insert(index->themes[kind], g_strdup(theme_name), GUINT_TO_POINTER(1));
+    } else {
+        g_hash_table_replace(index->themes[kind], g_strdup(theme_name),
+                             GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+    }
+}
+
+void
+ds_theme_index_remove_snap(DsThemeIndex *index, const char *snap_name)
+{
+    snap_themes_t *snap_themes = g_hash_table_lookup(index->snaps, snap_name);
+    GHashTableIter iter;
+    gpointer theme_name;
+
+    if (snap_themes == NULL) {
+        return;
+    }
+
+    /* Other snaps may provide the same themes, so only drop the themes
+     * this was the last provider of */
+    for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+        g_hash_table_iter_init(&iter, snap_themes->themes[kind]);
+        while (g_hash_table_iter_next(&iter, &theme_name, NULL)) {
+            guint count = GPOINTER_TO_UINT(g_hash_table_lookup(index->themes[kind], theme_name));
+
+            if (count <= 1) {
+                g_hash_table_remove(index->themes[kind], theme_name);
+            } else {
+                g_hash_table_replace(index->themes[kind], g_strdup(theme_name),
+                                     GUINT_TO_POINTER(count - 1));
+            }
+        }
+    }
+    g_hash_table_remove(index->snaps, snap_name);
+}
+
+gboolean
+ds_theme_index_contains(const DsThemeIndex *index, DsThemeKind kind, const char *theme_name)
+{
+    if (theme_name == NULL) {
+        return FALSE;
+    }
+    return g_hash_table_contains(index->themes[kind], theme_name);
+}
+
+static int
+compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* Returns the names in a set, sorted.  The strings are owned by the set. */
+static GPtrArray *
+get_sorted_names(GHashTable *set)
+{
+    GPtrArray *names = g_ptr_array_sized_new(g_hash_table_size(set));
+    GHashTableIter iter;
+    gpointer name;
+
+    g_hash_table_iter_init(&iter, set);
+    while (g_hash_table_iter_next(&iter, &name, NULL)) {
+        g_ptr_array_add(names, name);
+    }
+    g_ptr_array_sort(names, compare_names);
+    return names;
+}
+
+/* Returns the sorted list of theme names of the given kind */
+GPtrArray *
+ds_theme_index_get_themes(const DsThemeIndex *index, DsThemeKind kind)
+{
+    g_autoptr(GPtrArray) names = get_sorted_names(index->themes[kind]);
+    GPtrArray *themes = g_ptr_array_new_full(names->len, g_free);
+
+    for (guint i = 0; i < names->len; i++) {
+        g_ptr_array_add(themes, g_strdup(names->pdata[i]));
+    }
+    return themes;
+}
+
+DsThemeIndex *
+ds_theme_index_load(const char *path, GError **error)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_autofree char *revision = NULL;
+    g_auto(GStrv) groups = NULL;
+    g_autoptr(DsThemeIndex) index = NULL;
+
+    if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, error)) {
+        return NULL;
+    }
+
+    if (g_key_file_get_integer(key_file, INDEX_GROUP, "version", NULL) != INDEX_VERSION) {
+        g_set_error_literal(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                            "Unsupported index version");
+        return NULL;
+    }
+
+    revision = g_key_file_get_string(key_file, INDEX_GROUP, "revision", error);
+    if (revision == NULL) {
+        return NULL;
+    }
+
+    index = ds_theme_index_new(revision);
+    groups = g_key_file_get_groups(key_file, NULL);
+    for (guint i = 0; groups[i] != NULL; i++) {
+        const char *snap_name;
+
+        if (!g_str_has_prefix(groups[i], SNAP_GROUP_PREFIX)) {
+            continue;
+        }
+        snap_name = groups[i] + strlen(SNAP_GROUP_PREFIX);
+
+        for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+            g_auto(GStrv) names = g_key_file_get_string_list(
+                key_file, groups[i], theme_kind_keys[kind], NULL, NULL);
+
+            for (guint j = 0; names != NULL && names[j] != NULL; j++) {
+                ds_theme_index_add(index, snap_name, kind, names[j]);
+            }
+        }
+    }
+    return g_steal_pointer(&index);
+}
+
+gboolean
+ds_theme_index_save(const DsThemeIndex *index, const char *path, GError **error)
+{
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    g_autofree char *dir = g_path_get_dirname(path);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (index->revision == NULL) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                            "Cannot save an index without a revision");
+        return FALSE;
+    }
+
+    g_key_file_set_integer(key_file, INDEX_GROUP, "version", INDEX_VERSION);
+    g_key_file_set_string(key_file, INDEX_GROUP, "revision", index->revision);
+    g_hash_table_iter_init(&iter, index->snaps);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        snap_themes_t *snap_themes = value;
+        g_autofree char *group = g_strconcat(SNAP_GROUP_PREFIX, key, NULL);
+
+        for (int kind = 0; kind < DS_THEME_KIND_LAST; kind++) {
+            g_autoptr(GPtrArray) themes = NULL;
+
+            if (g_hash_table_size(snap_themes->themes[kind]) == 0) {
+                continue;
+            }
+            themes = get_sorted_names(snap_themes->themes[kind]);
+            g_key_file_set_string_list(key_file, group, theme_kind_keys[kind],
+                                       (const char * const *)themes->pdata, themes->len);
+        }
+    }
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Could not create %s: %s", dir, g_strerror(errsv));
+        return FALSE;
+    }
+    return g_key_file_save_to_file(key_file, path, error);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    DS_THEME_KIND_GTK,
+    DS_THEME_KIND_ICON,
+    DS_THEME_KIND_SOUND,
+    DS_THEME_KIND_GTK4,
+    DS_THEME_KIND_CURSOR,
+    DS_THEME_KIND_LAST,
+} DsThemeKind;
+
+#define DS_TYPE_THEME_INDEX (ds_theme_index_get_type())
+typedef struct _DsThemeIndex DsThemeIndex;
+
+GType ds_theme_index_get_type(void);
+
+gboolean ds_theme_index_get_content_kind(const char *content, DsThemeKind *kind);
+
+DsThemeIndex *ds_theme_index_new(const char *revision);
+DsThemeIndex *ds_theme_index_copy(const DsThemeIndex *index, const char *revision);
+DsThemeIndex *ds_theme_index_ref(DsThemeIndex *index);
+void ds_theme_index_unref(DsThemeIndex *index);
+
+const char *ds_theme_index_get_revision(const DsThemeIndex *index);
+
+void ds_theme_index_add(DsThemeIndex *index, const char *snap_name, DsThemeKind kind, const char *theme_name);
+void ds_theme_index_remove_snap(DsThemeIndex *index, const char *snap_name);
+
+gboolean ds_theme_index_contains(const DsThemeIndex *index, DsThemeKind kind, const char *theme_name);
+GPtrArray *ds_theme_index_get_themes(const DsThemeIndex *index, DsThemeKind kind);
+
+DsThemeIndex *ds_theme_index_load(const char *path, GError **error);
+gboolean ds_theme_index_save(const DsThemeIndex *index, const char *path, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DsThemeIndex, ds_theme_index_unref);
+
+G_END_DECLS
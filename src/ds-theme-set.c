@@ -1,47 +1,217 @@
+#include <string.h>
+
 #include "ds-theme-set.h"
 
-GType
-ds_theme_set_get_type(void) {
-    return g_boxed_type_register_static(
-        "DsThemeSet", (GBoxedCopyFunc)ds_theme_set_copy, (GBoxedFreeFunc)ds_theme_set_free);
+typedef struct {
+    DsThemeSet themes;
+    int ref_count;
+} interned_set_t;
+
+typedef struct {
+    guint ref_count;
+    char name[];
+} interned_name_t;
+
+/* Every live theme set, keyed by itself */
+static GHashTable *interned_sets = NULL;
+/* The names used by live sets, keyed by name and counting the sets
+ * using them.  Names can come from other processes through the broker,
+ * so they are freed with their last set rather than kept for good like
+ * g_intern_string() does */
+static GHashTable *interned_names = NULL;
+static GMutex interned_sets_lock;
+
+G_DEFINE_BOXED_TYPE(DsThemeSet, ds_theme_set, ds_theme_set_ref, ds_theme_set_unref);
+
+/* The names are interned, so sets are compared by name pointer */
+static guint
+names_hash(gconstpointer key)
+{
+    const DsThemeSet *themes = key;
+
+    return g_direct_hash(themes->gtk_theme_name) ^
+           (g_direct_hash(themes->icon_theme_name) * 31) ^
+           (g_direct_hash(themes->cursor_theme_name) * 961) ^
+           (g_direct_hash(themes->sound_theme_name) * 29791);
+}
+
+static gboolean
+names_equal(gconstpointer a, gconstpointer b)
+{
+    const DsThemeSet *themes_a = a, *themes_b = b;
+
+    return themes_a->gtk_theme_name == themes_b->gtk_theme_name &&
+           themes_a->icon_theme_name == themes_b->icon_theme_name &&
+           themes_a->cursor_theme_name == themes_b->cursor_theme_name &&
+           themes_a->sound_theme_name == themes_b->sound_theme_name;
+}
+
+/* Finds the interned copy of a name, returning FALSE if no live set
+ * uses it.  Called with the lock held. */
+static gboolean
+lookup_name(const char *name, const char **interned)
+{
+    interned_name_t *entry;
+
+    if (name == NULL) {
+        *interned = NULL;
+        return TRUE;
+    }
+    entry = g_hash_table_lookup(interned_names, name);
+    if (entry == NULL) {
+        return FALSE;
+    }
+    *interned = entry->name;
+    return TRUE;
+}
+
+static const char *
+acquire_name(const char *name)
+{
+    interned_name_t *entry;
+    size_t length;
+
+    if (name == NULL) {
+        return NULL;
+    }
+    entry = g_hash_table_lookup(interned_names, name);
+    if (entry == NULL) {
+        length = strlen(name);
+        entry = g_malloc(sizeof(interned_name_t) + length + 1);
+        entry->ref_count = 0;
+        memcpy(entry->name, name, length + 1);
+        g_hash_table_insert(interned_names, entry->name, entry);
+    }
+    entry->ref_count++;
+    return entry->name;
+}
+
+static void
+release_name(const char *name)
+{
+    interned_name_t *entry;
+
+    if (name == NULL) {
+        return;
+    }
+    entry = g_hash_table_lookup(interned_names, name);
+    if (--entry->ref_count == 0) {
+        g_hash_table_remove(interned_names, name);
+    }
+}
+
+/* Returns the set with the given theme names, creating it if no
+ * instance exists */
+DsThemeSet *
+ds_theme_set_new(const char *gtk_theme_name, const char *icon_theme_name, const char *cursor_theme_name, const char *sound_theme_name)
+{
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&interned_sets_lock);
+    DsThemeSet key;
+    interned_set_t *set;
+
+    if (interned_sets == NULL) {
+        interned_sets = g_hash_table_new(names_hash, names_equal);
+        interned_names = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    }
+
+    /* A set can only exist if all its names are interned */
+    if (lookup_name(gtk_theme_name, &key.gtk_theme_name) &&
+        lookup_name(icon_theme_name, &key.icon_theme_name) &&
+        lookup_name(cursor_theme_name, &key.cursor_theme_name) &&
+        lookup_name(sound_theme_name, &key.sound_theme_name)) {
+        set = g_hash_table_lookup(interned_sets, &key);
+        if (set != NULL) {
+            set->ref_count++;
+            return &set->themes;
+        }
+    }
+
+    set = g_new0(interned_set_t, 1);
+    set->themes.gtk_theme_name = acquire_name(gtk_theme_name);
+    set->themes.icon_theme_name = acquire_name(icon_theme_name);
+    set->themes.cursor_theme_name = acquire_name(cursor_theme_name);
+    set->themes.sound_theme_name = acquire_name(sound_theme_name);
+    set->ref_count = 1;
+    g_hash_table_add(interned_sets, &set->themes);
+    return &set->themes;
 }
 
 DsThemeSet *
-ds_theme_set_copy(const DsThemeSet *themes)
+ds_theme_set_ref(const DsThemeSet *themes)
 {
-    DsThemeSet *new = g_new0(DsThemeSet, 1);
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&interned_sets_lock);
+    interned_set_t *set = (interned_set_t *)themes;
 
-    new->gtk_theme_name = g_strdup(themes->gtk_theme_name);
-    new->icon_theme_name = g_strdup(themes->icon_theme_name);
-    new->cursor_theme_name = g_strdup(themes->cursor_theme_name);
-    new->sound_theme_name = g_strdup(themes->sound_theme_name);
-    return new;
+    set->ref_count++;
+    return &set->themes;
 }
 
 void
-ds_theme_set_free(DsThemeSet *themes)
+ds_theme_set_unref(DsThemeSet *themes)
 {
+    g_autoptr(GMutexLocker) locker = NULL;
+    interned_set_t *set = (interned_set_t *)themes;
+
     if (themes == NULL) {
         return;
     }
-    g_free(themes->gtk_theme_name);
-    g_free(themes->icon_theme_name);
-    g_free(themes->cursor_theme_name);
-    g_free(themes->sound_theme_name);
-    g_free(themes);
+
+    /* Lookups revive sets under the same lock */
+    locker = g_mutex_locker_new(&interned_sets_lock);
+    if (--set->ref_count > 0) {
+        return;
+    }
+    g_hash_table_remove(interned_sets, themes);
+    release_name(set->themes.gtk_theme_name);
+    release_name(set->themes.icon_theme_name);
+    release_name(set->themes.cursor_theme_name);
+    release_name(set->themes.sound_theme_name);
+    g_free(set);
+}
+
+const char *
+ds_theme_set_get_component(const DsThemeSet *themes, DsThemeComponent component)
+{
+    switch (component) {
+    case DS_THEME_COMPONENT_GTK:
+        return themes->gtk_theme_name;
+    case DS_THEME_COMPONENT_ICON:
+        return themes->icon_theme_name;
+    case DS_THEME_COMPONENT_CURSOR:
+        return themes->cursor_theme_name;
+    case DS_THEME_COMPONENT_SOUND:
+        return themes->sound_theme_name;
+    default:
+        g_return_val_if_reached(NULL);
+    }
 }
 
 gboolean
 ds_theme_set_equal(const DsThemeSet *a, const DsThemeSet *b)
 {
-    if (a == NULL && b == NULL) {
-        return TRUE;
-    }
+    return a == b;
+}
+
+guint
+ds_theme_set_hash(const DsThemeSet *themes)
+{
+    return g_direct_hash(themes);
+}
+
+/* Returns a mask of the components that differ between the two sets.
+ * If either set is missing, all components are considered changed. */
+guint
+ds_theme_set_diff(const DsThemeSet *a, const DsThemeSet *b)
+{
+    guint changed = 0;
+
     if (a == NULL || b == NULL) {
-        return FALSE;
+        return DS_THEME_COMPONENTS_ALL;
+    }
+    for (int component = 0; component < DS_THEME_COMPONENT_LAST; component++) {
+        if (ds_theme_set_get_component(a, component) != ds_theme_set_get_component(b, component)) {
+            changed |= DS_THEME_COMPONENT_MASK(component);
+        }
     }
-    return (!g_strcmp0(a->gtk_theme_name, b->gtk_theme_name) &&
-            !g_strcmp0(a->icon_theme_name, b->icon_theme_name) &&
-            !g_strcmp0(a->cursor_theme_name, b->cursor_theme_name) &&
-            !g_strcmp0(a->sound_theme_name, b->sound_theme_name));
+    return changed;
 }
@@ -7,18 +7,41 @@ G_BEGIN_DECLS
 #define DS_TYPE_THEME_SET (ds_theme_set_get_type())
 typedef struct _DsThemeSet DsThemeSet;
 
+/* Theme sets are interned: there is only ever one instance for a given
+ * combination of themes, so sets can be compared and hashed by pointer.
+ * The names are interned while any set uses them, so names from live
+ * sets can also be compared by pointer.  They must not be modified. */
 struct _DsThemeSet {
-    char *gtk_theme_name;
-    char *icon_theme_name;
-    char *cursor_theme_name;
-    char *sound_theme_name;
+    const char *gtk_theme_name;
+    const char *icon_theme_name;
+    const char *cursor_theme_name;
+    const char *sound_theme_name;
 };
 
+typedef enum {
+    DS_THEME_COMPONENT_GTK,
+    DS_THEME_COMPONENT_ICON,
+    DS_THEME_COMPONENT_CURSOR,
+    DS_THEME_COMPONENT_SOUND,
+    DS_THEME_COMPONENT_LAST,
+} DsThemeComponent;
+
+/* Bit masks of components, as reported by ds_theme_set_diff() */
+#define DS_THEME_COMPONENT_MASK(component) (1u << (component))
+#define DS_THEME_COMPONENTS_ALL ((1u << DS_THEME_COMPONENT_LAST) - 1)
+
 GType ds_theme_set_get_type(void);
 
-DsThemeSet *ds_theme_set_copy(const DsThemeSet *themes);
-void ds_theme_set_free(DsThemeSet *themes);
+DsThemeSet *ds_theme_set_new(const char *gtk_theme_name, const char *icon_theme_name, const char *cursor_theme_name, const char *sound_theme_name);
+DsThemeSet *ds_theme_set_ref(const DsThemeSet *themes);
+void ds_theme_set_unref(DsThemeSet *themes);
+
+const char *ds_theme_set_get_component(const DsThemeSet *themes, DsThemeComponent component);
 
 gboolean ds_theme_set_equal(const DsThemeSet *a, const DsThemeSet *b);
+guint ds_theme_set_hash(const DsThemeSet *themes);
+guint ds_theme_set_diff(const DsThemeSet *a, const DsThemeSet *b);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DsThemeSet, ds_theme_set_unref);
 
 G_END_DECLS
@@ -1,21 +1,45 @@
 #include "ds-theme-watcher.h"
 #include "ds-theme-set.h"
+#include "ds-metrics.h"
+#include "ds-trace.h"
 
 struct _DsThemeWatcher {
     GObject parent;
 
-    GtkSettings *settings;
+    /* Theme settings are read either from GtkSettings, or directly
+     * from GSettings, which doesn't need a display connection.  The
+     * GtkSettings are only used through their properties, so this
+     * doesn't depend on GTK. */
+    GObject *settings;
+    GSettings *interface_settings;
+    GSettings *sound_settings;
+    /* Debounce delays, in milliseconds */
     guint notify_timeout;
+    guint max_wait;
 
     guint timer_id;
+    /* Whether timer_id is an immediate check for an isolated change */
+    gboolean leading;
+    /* When the last check ran, and how many notifies it coalesced */
+    gint64 check_time;
+    guint coalesced;
     DsThemeSet *themes;
+
+    /* Trace ID of the latest check, when its first change arrived, and
+     * how long the check was then delayed */
+    guint trace_id;
+    gint64 queue_time;
+    gint64 debounce_time;
 };
 
 G_DEFINE_TYPE(DsThemeWatcher, ds_theme_watcher, G_TYPE_OBJECT);
 
 enum {
     PROP_SETTINGS = 1,
+    PROP_INTERFACE_SETTINGS,
+    PROP_SOUND_SETTINGS,
     PROP_NOTIFY_TIMEOUT,
+    PROP_MAX_WAIT,
     PROP_LAST,
 };
 
@@ -29,53 +53,119 @@ static guint watcher_signals[LAST_SIGNAL] = { 0 };
 static gboolean
 ds_theme_watcher_check(DsThemeWatcher *self)
 {
-    g_autofree DsThemeSet *new = g_new0(DsThemeSet, 1);
+    g_autofree char *gtk_theme_name = NULL;
+    g_autofree char *icon_theme_name = NULL;
+    g_autofree char *cursor_theme_name = NULL;
+    g_autofree char *sound_theme_name = NULL;
+    g_autoptr(DsThemeSet) new = NULL;
+    g_autofree char *detail = g_strdup_printf("(%u notifies coalesced)", self->coalesced);
+    guint changed;
 
     self->timer_id = 0;
-
-    g_object_get(self->settings,
-                 "gtk-theme-name", &new->gtk_theme_name,
-                 "gtk-icon-theme-name", &new->icon_theme_name,
-                 "gtk-cursor-theme-name", &new->cursor_theme_name,
-                 "gtk-sound-theme-name", &new->sound_theme_name,
-                 NULL);
+    self->leading = FALSE;
+    ds_trace_end(self->trace_id, "debounce", self->queue_time, detail);
+    self->check_time = g_get_monotonic_time();
+    self->debounce_time = self->check_time - self->queue_time;
+    self->queue_time = 0;
+    self->coalesced = 0;
+
+    if (self->settings != NULL) {
+        g_object_get(self->settings,
+                     "gtk-theme-name", &gtk_theme_name,
+                     "gtk-icon-theme-name", &icon_theme_name,
+                     "gtk-cursor-theme-name", &cursor_theme_name,
+                     "gtk-sound-theme-name", &sound_theme_name,
+                     NULL);
+    } else if (self->interface_settings != NULL) {
+        gtk_theme_name = g_settings_get_string(self->interface_settings, "gtk-theme");
+        icon_theme_name = g_settings_get_string(self->interface_settings, "icon-theme");
+        cursor_theme_name = g_settings_get_string(self->interface_settings, "cursor-theme");
+        /* Fall back to GTK's default sound theme */
+        if (self->sound_settings != NULL) {
+            sound_theme_name = g_settings_get_string(self->sound_settings, "theme-name");
+        } else {
+            sound_theme_name = g_strdup("freedesktop");
+        }
+    } else {
+        return G_SOURCE_REMOVE;
+    }
+    new = ds_theme_set_new(gtk_theme_name, icon_theme_name, cursor_theme_name, sound_theme_name);
 
     /* If nothing has changed, we're done */
-    if (ds_theme_set_equal(new, self->themes)) {
+    changed = ds_theme_set_diff(new, self->themes);
+    if (changed == 0) {
         return G_SOURCE_REMOVE;
     }
 
-    g_clear_pointer(&self->themes, ds_theme_set_free);
+    g_clear_pointer(&self->themes, ds_theme_set_unref);
     self->themes = g_steal_pointer(&new);
 
-    g_signal_emit(self, watcher_signals[THEME_CHANGED], 0, self->themes);
+    g_signal_emit(self, watcher_signals[THEME_CHANGED], 0, self->themes, changed);
 
     return G_SOURCE_REMOVE;
 }
 
+/* A change that follows a quiet period is checked straight away, on
+ * the next main loop iteration so notifies emitted together are still
+ * coalesced.  Otherwise the check waits until notifies have stopped for
+ * notify-timeout, but no longer than max-wait after the first one. */
 static void
 ds_theme_watcher_queue_check(DsThemeWatcher *self)
 {
+    gint64 now = g_get_monotonic_time();
+    gint64 deadline;
+
+    /* Further changes before the check join it */
+    if (self->queue_time == 0) {
+        self->trace_id = ds_trace_new_id();
+        self->queue_time = now;
+    } else {
+        self->coalesced++;
+        ds_metrics_increment("notifications-debounced");
+    }
+
+    if (self->leading) {
+        return;
+    }
+
+    if (self->timer_id == 0 && now - self->check_time >= (gint64)self->notify_timeout * 1000) {
+        self->leading = TRUE;
+        self->timer_id = g_idle_add(G_SOURCE_FUNC(ds_theme_watcher_check), self);
+        return;
+    }
+
+    deadline = MIN(now + (gint64)self->notify_timeout * 1000,
+                   self->queue_time + (gint64)self->max_wait * 1000);
     g_clear_handle_id(&self->timer_id, g_source_remove);
-    self->timer_id = g_timeout_add_seconds(
-        self->notify_timeout, G_SOURCE_FUNC(ds_theme_watcher_check), self);
+    self->timer_id = g_timeout_add(MAX(deadline - now, 0) / 1000,
+                                   G_SOURCE_FUNC(ds_theme_watcher_check), self);
 }
 
 static void
-ds_theme_watcher_notify_cb(GtkSettings *settings, GParamSpec *pspec, DsThemeWatcher *self)
+ds_theme_watcher_notify_cb(GObject *settings, GParamSpec *pspec, DsThemeWatcher *self)
 {
     ds_theme_watcher_queue_check(self);
 }
 
+/* Drops a pending check, and the changes it would have coalesced */
+static void
+ds_theme_watcher_cancel_check(DsThemeWatcher *self)
+{
+    g_clear_handle_id(&self->timer_id, g_source_remove);
+    self->leading = FALSE;
+    self->queue_time = 0;
+    self->coalesced = 0;
+}
+
 static void
-ds_theme_watcher_set_gtksettings(DsThemeWatcher *self, GtkSettings *settings)
+ds_theme_watcher_set_gtksettings(DsThemeWatcher *self, GObject *settings)
 {
     if (self->settings) {
         g_signal_handlers_disconnect_by_data(self->settings, self);
-        g_clear_handle_id(&self->timer_id, g_source_remove);
+        ds_theme_watcher_cancel_check(self);
     }
     g_clear_object(&self->settings);
-    g_clear_pointer(&self->themes, ds_theme_set_free);
+    g_clear_pointer(&self->themes, ds_theme_set_unref);
 
     if (settings == NULL) {
         return;
@@ -93,6 +183,36 @@ ds_theme_watcher_set_gtksettings(DsThemeWatcher *self, GtkSettings *settings)
     ds_theme_watcher_queue_check(self);
 }
 
+static void
+ds_theme_watcher_changed_cb(GSettings *settings, const char *key, DsThemeWatcher *self)
+{
+    ds_theme_watcher_queue_check(self);
+}
+
+static const char *interface_keys[] = { "gtk-theme", "icon-theme", "cursor-theme", NULL };
+static const char *sound_keys[] = { "theme-name", NULL };
+
+static void
+ds_theme_watcher_set_gsettings(DsThemeWatcher *self, GSettings **field, GSettings *settings, const char **keys)
+{
+    if (*field) {
+        g_signal_handlers_disconnect_by_data(*field, self);
+    }
+    g_clear_object(field);
+
+    if (settings == NULL) {
+        return;
+    }
+
+    *field = g_object_ref(settings);
+    for (guint i = 0; keys[i] != NULL; i++) {
+        g_autofree char *signal = g_strconcat("changed::", keys[i], NULL);
+        g_signal_connect(settings, signal,
+                         G_CALLBACK(ds_theme_watcher_changed_cb), self);
+    }
+    ds_theme_watcher_queue_check(self);
+}
+
 static void
 ds_theme_watcher_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
 {
@@ -102,9 +222,18 @@ ds_theme_watcher_get_property(GObject *object, guint prop_id, GValue *value, GPa
     case PROP_NOTIFY_TIMEOUT:
         g_value_set_uint(value, self->notify_timeout);
         break;
+    case PROP_MAX_WAIT:
+        g_value_set_uint(value, self->max_wait);
+        break;
     case PROP_SETTINGS:
         g_value_set_object(value, self->settings);
         break;
+    case PROP_INTERFACE_SETTINGS:
+        g_value_set_object(value, self->interface_settings);
+        break;
+    case PROP_SOUND_SETTINGS:
+        g_value_set_object(value, self->sound_settings);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -120,9 +249,20 @@ ds_theme_watcher_set_property(GObject *object, guint prop_id, const GValue *valu
     case PROP_NOTIFY_TIMEOUT:
         self->notify_timeout = g_value_get_uint(value);
         break;
+    case PROP_MAX_WAIT:
+        self->max_wait = g_value_get_uint(value);
+        break;
     case PROP_SETTINGS:
         ds_theme_watcher_set_gtksettings(self, g_value_get_object(value));
         break;
+    case PROP_INTERFACE_SETTINGS:
+        ds_theme_watcher_set_gsettings(self, &self->interface_settings, g_value_get_object(value),
+                                       interface_keys);
+        break;
+    case PROP_SOUND_SETTINGS:
+        ds_theme_watcher_set_gsettings(self, &self->sound_settings, g_value_get_object(value),
+                                       sound_keys);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -136,6 +276,10 @@ ds_theme_watcher_finalize(GObject *object)
     DsThemeWatcher *self = DS_THEME_WATCHER(object);
 
     ds_theme_watcher_set_gtksettings(self, NULL);
+    ds_theme_watcher_set_gsettings(self, &self->interface_settings, NULL, interface_keys);
+    ds_theme_watcher_set_gsettings(self, &self->sound_settings, NULL, sound_keys);
+    ds_theme_watcher_cancel_check(self);
+    g_clear_pointer(&self->themes, ds_theme_set_unref);
 
     G_OBJECT_CLASS(ds_theme_watcher_parent_class)->finalize(object);
 }
@@ -151,17 +295,29 @@ ds_theme_watcher_class_init(DsThemeWatcherClass *klass)
 
     g_object_class_install_property(
         gobject_class, PROP_NOTIFY_TIMEOUT,
-        g_param_spec_uint("notify-timeout", "notify timeout", "time to wait before ",
-                          0, G_MAXUINT, 1, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+        g_param_spec_uint("notify-timeout", "notify timeout", "milliseconds without changes to wait before checking themes",
+                          0, G_MAXUINT, 250, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+    g_object_class_install_property(
+        gobject_class, PROP_MAX_WAIT,
+        g_param_spec_uint("max-wait", "max wait", "most milliseconds to delay a check while changes continue",
+                          0, G_MAXUINT, 2000, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
     g_object_class_install_property(
         gobject_class, PROP_SETTINGS,
         g_param_spec_object("settings", "settings", "GtkSettings instance to watch",
-                            GTK_TYPE_SETTINGS, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+                            G_TYPE_OBJECT, G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+    g_object_class_install_property(
+        gobject_class, PROP_INTERFACE_SETTINGS,
+        g_param_spec_object("interface-settings", "interface settings", "org.gnome.desktop.interface settings to watch",
+                            G_TYPE_SETTINGS, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(
+        gobject_class, PROP_SOUND_SETTINGS,
+        g_param_spec_object("sound-settings", "sound settings", "org.gnome.desktop.sound settings to watch",
+                            G_TYPE_SETTINGS, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 
     watcher_signals[THEME_CHANGED] = g_signal_new(
         "theme-changed", G_TYPE_FROM_CLASS (gobject_class),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
-        G_TYPE_NONE, 1, DS_TYPE_THEME_SET);
+        G_TYPE_NONE, 2, DS_TYPE_THEME_SET, G_TYPE_UINT);
 }
 
 static void
@@ -169,8 +325,65 @@ ds_theme_watcher_init(DsThemeWatcher *self)
 {
 }
 
+/* Returns the trace ID of the check that last emitted theme-changed */
+guint
+ds_theme_watcher_get_trace_id(DsThemeWatcher *self)
+{
+    return self->trace_id;
+}
+
+/* Returns the monotonic time at which the first change coalesced into
+ * the check that last emitted theme-changed arrived */
+gint64
+ds_theme_watcher_get_change_time(DsThemeWatcher *self)
+{
+    return self->check_time - self->debounce_time;
+}
+
+/* Returns how many microseconds the check that last emitted
+ * theme-changed was delayed to coalesce changes */
+gint64
+ds_theme_watcher_get_debounce_time(DsThemeWatcher *self)
+{
+    return self->debounce_time;
+}
+
 DsThemeWatcher *
-ds_theme_watcher_new(GtkSettings *settings)
+ds_theme_watcher_new(GObject *settings)
 {
     return g_object_new(DS_TYPE_THEME_WATCHER, "settings", settings, NULL);
 }
+
+static GSettings *
+new_settings_if_installed(const char *schema_id)
+{
+    GSettingsSchemaSource *source = g_settings_schema_source_get_default();
+    g_autoptr(GSettingsSchema) schema = NULL;
+
+    if (source != NULL) {
+        schema = g_settings_schema_source_lookup(source, schema_id, TRUE);
+    }
+    if (schema == NULL) {
+        g_warning("GSettings schema %s is not installed", schema_id);
+        return NULL;
+    }
+    return g_settings_new_full(schema, NULL, NULL);
+}
+
+/* Creates a watcher that reads the GNOME desktop settings directly,
+ * without initialising GTK.  Returns NULL if the interface settings
+ * schema isn't installed. */
+DsThemeWatcher *
+ds_theme_watcher_new_for_gsettings(void)
+{
+    g_autoptr(GSettings) interface_settings = new_settings_if_installed("org.gnome.desktop.interface");
+    g_autoptr(GSettings) sound_settings = new_settings_if_installed("org.gnome.desktop.sound");
+
+    if (interface_settings == NULL) {
+        return NULL;
+    }
+    return g_object_new(DS_TYPE_THEME_WATCHER,
+                        "interface-settings", interface_settings,
+                        "sound-settings", sound_settings,
+                        NULL);
+}
@@ -1,12 +1,17 @@
 #pragma once
 
-#include <gtk/gtk.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
 #define DS_TYPE_THEME_WATCHER (ds_theme_watcher_get_type())
 G_DECLARE_FINAL_TYPE(DsThemeWatcher, ds_theme_watcher, DS, THEME_WATCHER, GObject);
 
-DsThemeWatcher *ds_theme_watcher_new(GtkSettings *settings);
+DsThemeWatcher *ds_theme_watcher_new(GObject *settings);
+DsThemeWatcher *ds_theme_watcher_new_for_gsettings(void);
+
+guint ds_theme_watcher_get_trace_id(DsThemeWatcher *self);
+gint64 ds_theme_watcher_get_change_time(DsThemeWatcher *self);
+gint64 ds_theme_watcher_get_debounce_time(DsThemeWatcher *self);
 
 G_END_DECLS
@@ -0,0 +1,48 @@
+#ifdef HAVE_SYSPROF
+#include <sysprof-capture.h>
+#endif
+
+#include "ds-metrics.h"
+#include "ds-trace.h"
+
+static guint next_id = 1;
+
+guint
+ds_trace_new_id(void)
+{
+    return next_id++;
+}
+
+/* Returns the time a span starts, to be passed to ds_trace_end() */
+gint64
+ds_trace_begin(void)
+{
+    return g_get_monotonic_time();
+}
+
+/* Ends a span, logging it with structured fields so it can be filtered
+ * from the journal, and marking it in any running sysprof capture. */
+void
+ds_trace_end(guint id, const char *span, gint64 begin_time, const char *detail)
+{
+    gint64 duration = g_get_monotonic_time() - begin_time;
+    g_autofree char *id_text = g_strdup_printf("%u", id);
+    g_autofree char *duration_text = g_strdup_printf("%" G_GINT64_FORMAT, duration);
+
+    ds_metrics_observe(span, duration);
+
+#ifdef HAVE_SYSPROF
+    /* The detail may contain theme names, so it isn't a format */
+    sysprof_collector_mark(begin_time * 1000, duration * 1000,
+                           "snapd-desktop-integration", span,
+                           "%s", detail != NULL ? detail : "");
+#endif
+
+    g_log_structured(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+                     "DS_TRACE_ID", id_text,
+                     "DS_TRACE_SPAN", span,
+                     "DS_TRACE_DURATION_US", duration_text,
+                     "MESSAGE", "Check %u: %s%s%s took %.1f ms", id, span,
+                     detail != NULL ? " " : "", detail != NULL ? detail : "",
+                     duration / 1000.0);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Timing spans for the stages of a theme check.  Spans sharing an ID
+ * belong to the same check. */
+
+guint ds_trace_new_id(void);
+
+gint64 ds_trace_begin(void);
+void ds_trace_end(guint id, const char *span, gint64 begin_time, const char *detail);
+
+G_END_DECLS
@@ -1,33 +1,87 @@
-#include <gtk/gtk.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
 #include <snapd-glib/snapd-glib.h>
 #include <libnotify/notify.h>
 
+#include "ds-gtk-backend.h"
 #include "ds-theme-watcher.h"
 #include "ds-theme-set.h"
 #include "ds-snapd-helper.h"
+#include "ds-broker.h"
+#include "ds-metrics.h"
+#include "ds-trace.h"
+
+/* Name owned on the session bus, so the metrics can be found */
+#define SESSION_BUS_NAME "io.snapcraft.SnapdDesktopIntegration"
+
+/* Maximum number of theme sets resolved at once in --check mode.  The
+ * helper separately limits how many store lookups are made at once. */
+#define CHECK_CONCURRENCY 32
+
+#define INSTALL_SUMMARY "Installing missing theme snaps:"
 
 static void
 install_snaps_cb(GObject *object, GAsyncResult *result, gpointer user_data)
 {
-    NotifyNotification *notification = NULL;
+    NotifyNotification *notification = user_data;
     GTask *task = G_TASK(result);
     g_autoptr(GError) error = NULL;
     gboolean success = g_task_propagate_boolean(task, &error);
 
+    notify_notification_clear_actions(notification);
     if (success) {
         g_print("Installation complete.\n");
-        notification = notify_notification_new("Installing missing theme snaps:", "Complete.", "dialog-information");
+        notify_notification_update(notification, INSTALL_SUMMARY, "Complete.", "dialog-information");
+    } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_print("Installation cancelled.\n");
+        notify_notification_update(notification, INSTALL_SUMMARY, "Cancelled.", "dialog-information");
+    } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_PENDING)) {
+        /* The notification for the earlier install reports its progress */
+        g_print("%s\n", error->message);
+        notify_notification_update(notification, INSTALL_SUMMARY, "Already in progress.", "dialog-information");
     } else {
         g_print("Installation failed: %s\n", error->message);
-        notification = notify_notification_new("Installing missing theme snaps:", "Failed.", "dialog-information");
+        notify_notification_update(notification, INSTALL_SUMMARY, "Failed.", "dialog-information");
     }
 
+    notify_notification_set_hint(notification, "value", NULL);
     notify_notification_show(notification, NULL);
     g_object_unref(notification);
 }
 
+/* Updates the install notification in place.  The helper limits how
+ * often this is called. */
+static void
+install_progress(DsSnapdHelper *helper, const DsInstallProgress *progress, gpointer user_data)
+{
+    NotifyNotification *notification = user_data;
+    g_autofree char *body = NULL;
+    int percent;
+
+    if (progress->bytes_total > 0 && progress->bytes_done < progress->bytes_total) {
+        g_autofree char *done = g_format_size(progress->bytes_done);
+        g_autofree char *total = g_format_size(progress->bytes_total);
+
+        body = g_strdup_printf("Downloaded %s of %s", done, total);
+        percent = progress->bytes_done * 100 / progress->bytes_total;
+    } else if (progress->tasks_total > 0) {
+        body = g_strdup_printf("Step %u of %u", progress->tasks_done, progress->tasks_total);
+        percent = progress->tasks_done * 100 / progress->tasks_total;
+    } else {
+        return;
+    }
+
+    notify_notification_update(notification, INSTALL_SUMMARY, body, "dialog-information");
+    notify_notification_set_hint(notification, "value", g_variant_new_int32(percent));
+    notify_notification_show(notification, NULL);
+}
+
 typedef struct {
     DsSnapdHelper *helper;
+    DsThemeSet *themes;
     GPtrArray *missing_snaps;
 } install_info_t;
 
@@ -35,38 +89,94 @@ static void
 install_info_free(install_info_t *data)
 {
     g_clear_object(&data->helper);
+    g_clear_pointer(&data->themes, ds_theme_set_unref);
     g_clear_pointer(&data->missing_snaps, g_ptr_array_unref);
     g_free(data);
 }
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC(install_info_t, install_info_free);
+static void
+cancel_install(NotifyNotification *notification, char *action, gpointer user_data)
+{
+    GCancellable *cancellable = user_data;
+
+    g_print("Cancelling installation of missing theme snaps\n");
+    g_cancellable_cancel(cancellable);
+}
 
+/* The info is shared by both actions, and freed with the notification */
 static void
 install_snaps(NotifyNotification *notification, char *action, gpointer user_data) {
+    install_info_t *info = user_data;
+
     if (strcmp(action, "yes") == 0) {
-        g_autoptr(install_info_t) info = user_data;
+        NotifyNotification *progress_notification = notify_notification_new(INSTALL_SUMMARY, "...", "dialog-information");
+        g_autoptr(GCancellable) cancellable = g_cancellable_new();
 
         g_print("Installing missing theme snaps...\n");
-        NotifyNotification *notification = notify_notification_new("Installing missing theme snaps:", "...", "dialog-information");
-        notify_notification_show(notification, NULL);
-        g_object_unref(notification);
+        /* Installs can wait a long time for a suitable network, so the
+         * user can give up on them */
+        notify_notification_add_action(progress_notification, "cancel", "Cancel", cancel_install,
+                                       g_object_ref(cancellable), g_object_unref);
+        notify_notification_show(progress_notification, NULL);
 
-        ds_snapd_helper_install_snaps(info->helper, info->missing_snaps, NULL, install_snaps_cb, NULL);
+        /* The one notification is updated as the install progresses */
+        ds_snapd_helper_install_snaps(info->helper, info->missing_snaps,
+                                      install_progress, progress_notification, cancellable,
+                                      install_snaps_cb, progress_notification);
+    } else if (strcmp(action, "no") == 0) {
+        g_print("Not installing missing theme snaps\n");
+        ds_snapd_helper_decline_snaps(info->helper, info->themes, info->missing_snaps);
     }
     g_object_unref(notification);
 }
 
+/* When the change that caused a check arrived, used to report how long
+ * the check took including the debounce delay */
+typedef struct {
+    DsThemeSet *themes;
+    gint64 start_time;
+    guint snapd_requests;
+} check_info_t;
+
+static check_info_t *
+check_info_new(DsSnapdHelper *helper, const DsThemeSet *themes, gint64 start_time)
+{
+    check_info_t *info = g_new0(check_info_t, 1);
+
+    info->themes = ds_theme_set_ref(themes);
+    info->start_time = start_time;
+    info->snapd_requests = ds_snapd_helper_get_snapd_requests(helper);
+    return info;
+}
+
+static void
+check_info_free(check_info_t *info)
+{
+    g_clear_pointer(&info->themes, ds_theme_set_unref);
+    g_free(info);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(check_info_t, check_info_free);
+
 static void
 missing_snaps_ready(GObject *object, GAsyncResult *result, gpointer user_data)
 {
     DsSnapdHelper *helper = DS_SNAPD_HELPER(object);
+    g_autoptr(check_info_t) info = user_data;
     g_autoptr(GError) error = NULL;
     g_autoptr(GPtrArray) missing_snaps = NULL;
     guint i;
 
     missing_snaps = ds_snapd_helper_find_missing_snaps_finish(helper, result, &error);
+    g_message("Theme check finished in %.1f ms after %u snapd requests",
+              (g_get_monotonic_time() - info->start_time) / 1000.0,
+              ds_snapd_helper_get_snapd_requests(helper) - info->snapd_requests);
 
     if (!missing_snaps) {
+        /* Superseded by a newer theme change */
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            return;
+        }
         g_warning("Could not get installed themes: %s", error->message);
         return;
     }
@@ -85,19 +195,20 @@ missing_snaps_ready(GObject *object, GAsyncResult *result, gpointer user_data)
 
     NotifyNotification *notification = notify_notification_new("Some required theme snaps are missing.", "Would you like to install them now?", "dialog-question");
 
-    g_autoptr(install_info_t) find_data = g_new0(install_info_t, 1);
+    install_info_t *find_data = g_new0(install_info_t, 1);
     find_data->helper = g_object_ref(helper);
+    find_data->themes = ds_theme_set_ref(info->themes);
     find_data->missing_snaps = g_ptr_array_ref(missing_snaps);
 
-    notify_notification_add_action(g_object_ref(notification), "yes", "Yes", install_snaps, g_steal_pointer(&find_data), NULL);
-    notify_notification_add_action(g_object_ref(notification), "no", "No", install_snaps, NULL, NULL);
+    notify_notification_add_action(g_object_ref(notification), "yes", "Yes", install_snaps, find_data, (GFreeFunc)install_info_free);
+    notify_notification_add_action(g_object_ref(notification), "no", "No", install_snaps, find_data, NULL);
 
     notify_notification_show(notification, NULL);
     g_object_unref(notification);
 }
 
 static void
-theme_changed(DsThemeWatcher *watcher, const DsThemeSet *themes, DsSnapdHelper *snapd)
+theme_changed(DsThemeWatcher *watcher, const DsThemeSet *themes, guint changed, DsSnapdHelper *snapd)
 {
     g_message("New theme: gtk=%s icon=%s cursor=%s, sound=%s",
               themes->gtk_theme_name,
@@ -105,7 +216,425 @@ theme_changed(DsThemeWatcher *watcher, const DsThemeSet *themes, DsSnapdHelper *
               themes->cursor_theme_name,
               themes->sound_theme_name);
 
-    ds_snapd_helper_find_missing_snaps(snapd, themes, NULL, missing_snaps_ready, NULL);
+    ds_snapd_helper_find_missing_snaps(snapd, themes, changed, ds_theme_watcher_get_trace_id(watcher),
+                                       NULL, missing_snaps_ready,
+                                       check_info_new(snapd, themes, ds_theme_watcher_get_change_time(watcher)));
+}
+
+static void
+needed_themes_installed(DsSnapdHelper *snapd, const DsThemeSet *themes, gpointer user_data)
+{
+    g_message("Theme snaps were installed, checking again");
+    ds_snapd_helper_find_missing_snaps(snapd, themes, 0, ds_trace_new_id(),
+                                       NULL, missing_snaps_ready,
+                                       check_info_new(snapd, themes, g_get_monotonic_time()));
+}
+
+/* Resident set size of this process in KiB */
+static gulong
+get_rss(void)
+{
+    g_autofree char *contents = NULL;
+    unsigned long size, resident;
+
+    if (!g_file_get_contents("/proc/self/statm", &contents, NULL, NULL) ||
+        sscanf(contents, "%lu %lu", &size, &resident) != 2) {
+        return 0;
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+typedef struct {
+    const char *backend;
+    gint64 start_time;
+    gulong handler_id;
+    /* Set to exit once startup has been reported */
+    GMainLoop *main_loop;
+} startup_info_t;
+
+/* Reports how long reading the initial theme took.  The debounce delay
+ * isn't counted, so the backends can be compared. */
+static void
+report_startup(DsThemeWatcher *watcher, const DsThemeSet *themes, guint changed, startup_info_t *info)
+{
+    gint64 startup_time = g_get_monotonic_time() - info->start_time - ds_theme_watcher_get_debounce_time(watcher);
+
+    g_message("Read initial theme using %s backend in %.1f ms, RSS %lu KiB",
+              info->backend, startup_time / 1000.0, get_rss());
+    g_signal_handler_disconnect(watcher, info->handler_id);
+
+    if (info->main_loop != NULL) {
+        g_print("{\"backend\":\"%s\",\"startup-ms\":%.1f,\"rss-kib\":%lu}\n",
+                info->backend, startup_time / 1000.0, get_rss());
+        g_main_loop_quit(info->main_loop);
+    }
+}
+
+static char *backend = NULL;
+static gboolean run_broker = FALSE;
+static gboolean use_broker = FALSE;
+static char *snapd_socket = NULL;
+static gboolean store_catalog = FALSE;
+static char *check_path = NULL;
+static gboolean report_startup_only = FALSE;
+
+static GOptionEntry entries[] = {
+    { "backend", 0, 0, G_OPTION_ARG_STRING, &backend,
+      "Where to read theme settings from: gtk (default) or gsettings", "BACKEND" },
+    { "broker", 0, 0, G_OPTION_ARG_NONE, &run_broker,
+      "Resolve theme snaps for all sessions on the system bus", NULL },
+    { "use-broker", 0, 0, G_OPTION_ARG_NONE, &use_broker,
+      "Ask the system broker which theme snaps are missing", NULL },
+    { "snapd-socket", 0, 0, G_OPTION_ARG_FILENAME, &snapd_socket,
+      "Connect to snapd on PATH, e.g. a stand-in used for profiling", "PATH" },
+    { "store-catalog", 0, 0, G_OPTION_ARG_NONE, &store_catalog,
+      "Resolve theme snaps from a periodically fetched catalog of the store", NULL },
+    { "report-startup", 0, 0, G_OPTION_ARG_NONE, &report_startup_only,
+      "Print the startup time and resident memory of the backend as JSON once the initial theme is read, then exit", NULL },
+    { "check", 0, 0, G_OPTION_ARG_FILENAME, &check_path,
+      "Report the missing theme snaps for each line of tab separated gtk, icon, cursor and sound themes in FILE (- for stdin) as JSON, then exit", "FILE" },
+    { NULL }
+};
+
+/* SIGUSR1 logs the metrics collected so far */
+static gboolean
+log_metrics_summary(gpointer user_data)
+{
+    ds_metrics_log_summary();
+    return G_SOURCE_CONTINUE;
+}
+
+/* Makes the metrics available on the session bus, so they can be
+ * collected locally.  Returns the bus name owner ID, or 0. */
+static guint
+export_session_metrics(void)
+{
+    g_autoptr(GDBusConnection) connection = NULL;
+    g_autoptr(GError) error = NULL;
+
+    connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    if (connection == NULL) {
+        g_warning("Could not connect to session bus: %s", error->message);
+        return 0;
+    }
+    if (ds_metrics_register(connection, &error) == 0) {
+        g_warning("Could not export metrics: %s", error->message);
+        return 0;
+    }
+    return g_bus_own_name_on_connection(connection, SESSION_BUS_NAME,
+                                        G_BUS_NAME_OWNER_FLAGS_NONE,
+                                        NULL, NULL, NULL, NULL);
+}
+
+static SnapdClient *
+new_snapd_client(void)
+{
+    SnapdClient *client = snapd_client_new();
+
+    if (snapd_socket != NULL) {
+        snapd_client_set_socket_path(client, snapd_socket);
+    }
+    return client;
+}
+
+static void
+append_json_string(GString *json, const char *value)
+{
+    g_string_append_c(json, '"');
+    for (const char *c = value != NULL ? value : ""; *c != '\0'; c++) {
+        switch (*c) {
+        case '"':
+            g_string_append(json, "\\\"");
+            break;
+        case '\\':
+            g_string_append(json, "\\\\");
+            break;
+        case '\n':
+            g_string_append(json, "\\n");
+            break;
+        case '\t':
+            g_string_append(json, "\\t");
+            break;
+        default:
+            if ((guchar)*c < 0x20) {
+                g_string_append_printf(json, "\\u%04x", (guchar)*c);
+            } else {
+                g_string_append_c(json, *c);
+            }
+            break;
+        }
+    }
+    g_string_append_c(json, '"');
+}
+
+/* A batch of theme sets being checked, reported in input order */
+typedef struct {
+    GMainLoop *main_loop;
+    DsSnapdHelper *helper;
+    GPtrArray *themes;
+    /* JSON line for each theme set, NULL until resolved */
+    GPtrArray *results;
+    guint next_query;
+    guint next_result;
+    guint running;
+    gboolean failed;
+} batch_t;
+
+typedef struct {
+    batch_t *batch;
+    guint index;
+} batch_query_t;
+
+static void batch_start_queries(batch_t *batch);
+
+static void
+batch_query_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+    DsSnapdHelper *helper = DS_SNAPD_HELPER(object);
+    g_autofree batch_query_t *query = user_data;
+    batch_t *batch = query->batch;
+    DsThemeSet *themes = batch->themes->pdata[query->index];
+    g_autoptr(GPtrArray) missing_snaps = NULL;
+    g_autoptr(GError) error = NULL;
+    GString *json = g_string_new("{\"gtk-theme\":");
+
+    missing_snaps = ds_snapd_helper_query_missing_snaps_finish(helper, result, &error);
+    append_json_string(json, themes->gtk_theme_name);
+    g_string_append(json, ",\"icon-theme\":");
+    append_json_string(json, themes->icon_theme_name);
+    g_string_append(json, ",\"cursor-theme\":");
+    append_json_string(json, themes->cursor_theme_name);
+    g_string_append(json, ",\"sound-theme\":");
+    append_json_string(json, themes->sound_theme_name);
+    if (missing_snaps != NULL) {
+        g_string_append(json, ",\"missing-snaps\":[");
+        for (guint i = 0; i < missing_snaps->len; i++) {
+            if (i > 0) {
+                g_string_append_c(json, ',');
+            }
+            append_json_string(json, snapd_snap_get_name(missing_snaps->pdata[i]));
+        }
+        g_string_append_c(json, ']');
+    } else {
+        g_string_append(json, ",\"error\":");
+        append_json_string(json, error->message);
+        batch->failed = TRUE;
+    }
+    g_string_append_c(json, '}');
+    batch->results->pdata[query->index] = g_string_free(json, FALSE);
+
+    while (batch->next_result < batch->results->len &&
+           batch->results->pdata[batch->next_result] != NULL) {
+        printf("%s\n", (char *)batch->results->pdata[batch->next_result]);
+        batch->next_result++;
+    }
+
+    batch->running--;
+    batch_start_queries(batch);
+}
+
+static void
+batch_start_queries(batch_t *batch)
+{
+    while (batch->running < CHECK_CONCURRENCY && batch->next_query < batch->themes->len) {
+        batch_query_t *query = g_new0(batch_query_t, 1);
+
+        query->batch = batch;
+        query->index = batch->next_query++;
+        batch->running++;
+        ds_snapd_helper_query_missing_snaps(batch->helper, batch->themes->pdata[query->index], NULL,
+                                            batch_query_cb, query);
+    }
+    if (batch->running == 0) {
+        g_main_loop_quit(batch->main_loop);
+    }
+}
+
+/* Reads theme sets, one per line as tab separated gtk, icon, cursor
+ * and sound theme names.  Blank lines and lines starting with # are
+ * skipped. */
+static GPtrArray *
+read_theme_sets(const char *path, GError **error)
+{
+    g_autoptr(GIOChannel) channel = NULL;
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    g_autoptr(GPtrArray) themes = g_ptr_array_new_with_free_func((GDestroyNotify)ds_theme_set_unref);
+
+    if (g_strcmp0(path, "-") == 0) {
+        channel = g_io_channel_unix_new(STDIN_FILENO);
+    } else {
+        channel = g_io_channel_new_file(path, "r", error);
+        if (channel == NULL) {
+            return NULL;
+        }
+    }
+    if (g_io_channel_read_to_end(channel, &contents, NULL, error) != G_IO_STATUS_NORMAL) {
+        return NULL;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = NULL;
+
+        if (g_str_has_suffix(lines[i], "\r")) {
+            lines[i][strlen(lines[i]) - 1] = '\0';
+        }
+        if (lines[i][0] == '\0' || lines[i][0] == '#') {
+            continue;
+        }
+        fields = g_strsplit(lines[i], "\t", -1);
+        if (g_strv_length(fields) != 4) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "Line %u: expected 4 tab separated theme names", i + 1);
+            return NULL;
+        }
+        g_ptr_array_add(themes, ds_theme_set_new(fields[0], fields[1], fields[2], fields[3]));
+    }
+    return g_steal_pointer(&themes);
+}
+
+/* Keeps stdout for the results */
+static void
+print_to_stderr(const char *string)
+{
+    fputs(string, stderr);
+}
+
+/* Checks a batch of theme sets without a session: no GTK,
+ * notifications or theme watcher.  Returns the exit status. */
+static int
+run_check(void)
+{
+    g_autoptr(GMainLoop) main_loop = g_main_loop_new(NULL, FALSE);
+    g_autoptr(SnapdClient) client = NULL;
+    g_autoptr(DsSnapdHelper) snapd = NULL;
+    g_autoptr(GPtrArray) themes = NULL;
+    g_autoptr(GPtrArray) results = NULL;
+    g_autoptr(GError) error = NULL;
+    batch_t batch = { 0 };
+    gint64 start_time = g_get_monotonic_time();
+
+    g_set_print_handler(print_to_stderr);
+
+    themes = read_theme_sets(check_path, &error);
+    if (themes == NULL) {
+        g_printerr("Could not read theme sets: %s\n", error->message);
+        return 1;
+    }
+
+    client = new_snapd_client();
+    snapd = ds_snapd_helper_new(client);
+    if (store_catalog) {
+        ds_snapd_helper_use_store_catalog(snapd);
+    }
+
+    results = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_set_size(results, themes->len);
+    batch.main_loop = main_loop;
+    batch.helper = snapd;
+    batch.themes = themes;
+    batch.results = results;
+    batch_start_queries(&batch);
+    if (batch.running > 0) {
+        g_main_loop_run(main_loop);
+    }
+
+    g_message("Checked %u theme sets in %.1f ms after %u snapd requests",
+              themes->len, (g_get_monotonic_time() - start_time) / 1000.0,
+              ds_snapd_helper_get_snapd_requests(snapd));
+
+    return batch.failed ? 1 : 0;
+}
+
+typedef struct {
+    GMainLoop *main_loop;
+    gboolean name_acquired;
+    /* Set if the service stopped because of an error */
+    gboolean failed;
+} broker_service_t;
+
+static void
+broker_name_acquired(GDBusConnection *connection, const char *name, gpointer user_data)
+{
+    broker_service_t *service = user_data;
+
+    service->name_acquired = TRUE;
+}
+
+static void
+broker_name_lost(GDBusConnection *connection, const char *name, gpointer user_data)
+{
+    broker_service_t *service = user_data;
+
+    if (service->name_acquired) {
+        g_printerr("Lost bus name %s\n", name);
+    } else {
+        g_printerr("Could not acquire bus name %s\n", name);
+    }
+    service->failed = TRUE;
+    g_main_loop_quit(service->main_loop);
+}
+
+static gboolean
+broker_quit(gpointer user_data)
+{
+    broker_service_t *service = user_data;
+
+    g_main_loop_quit(service->main_loop);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Runs without a session: no GTK, notifications or theme watcher */
+static int
+run_broker_service(void)
+{
+    g_autoptr(GMainLoop) main_loop = g_main_loop_new(NULL, FALSE);
+    broker_service_t service = { main_loop, FALSE, FALSE };
+    g_autoptr(GDBusConnection) connection = NULL;
+    g_autoptr(SnapdClient) client = NULL;
+    g_autoptr(DsSnapdHelper) snapd = NULL;
+    g_autoptr(DsBroker) broker = NULL;
+    g_autoptr(GError) error = NULL;
+    guint owner_id;
+
+    connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+    if (connection == NULL) {
+        g_printerr("Could not connect to system bus: %s\n", error->message);
+        return 1;
+    }
+
+    client = new_snapd_client();
+    snapd = ds_snapd_helper_new(client);
+    if (store_catalog) {
+        ds_snapd_helper_use_store_catalog(snapd);
+    }
+    broker = ds_broker_new(snapd);
+    if (!ds_broker_register(broker, connection, &error)) {
+        g_printerr("Could not register broker: %s\n", error->message);
+        return 1;
+    }
+    if (ds_metrics_register(connection, &error) == 0) {
+        g_warning("Could not export metrics: %s", error->message);
+        g_clear_error(&error);
+    }
+
+    owner_id = g_bus_own_name_on_connection(connection, DS_BROKER_BUS_NAME,
+                                            G_BUS_NAME_OWNER_FLAGS_NONE,
+                                            broker_name_acquired, broker_name_lost, &service, NULL);
+    g_unix_signal_add(SIGUSR1, log_metrics_summary, NULL);
+    g_unix_signal_add(SIGTERM, broker_quit, &service);
+    g_unix_signal_add(SIGINT, broker_quit, &service);
+    g_main_loop_run(main_loop);
+    g_bus_unown_name(owner_id);
+
+    return service.failed ? 1 : 0;
+}
+
+static void
+broker_find_missing_snaps(GObject *connection, const DsThemeSet *themes, GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+    ds_broker_find_missing_snaps(G_DBUS_CONNECTION(connection), themes, cancellable, callback, user_data);
 }
 
 int
@@ -114,22 +643,97 @@ main(int argc, char **argv)
     g_autoptr(GMainLoop) main_loop = NULL;
     g_autoptr(SnapdClient) client = NULL;
     g_autoptr(DsSnapdHelper) snapd = NULL;
-    g_autoptr(GtkSettings) settings = NULL;
+    g_autoptr(DsHostThemes) host_themes = NULL;
+    g_autoptr(GObject) settings = NULL;
     g_autoptr(DsThemeWatcher) watcher = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GError) error = NULL;
+    startup_info_t startup_info = { 0 };
+    guint owner_id;
+
+    startup_info.start_time = g_get_monotonic_time();
 
-    gtk_init(&argc, &argv);
+    /* GTK options are left for the GTK backend */
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_set_ignore_unknown_options(context, TRUE);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    startup_info.backend = backend != NULL ? backend : "gtk";
+
+    if (run_broker) {
+        return run_broker_service();
+    }
+    if (check_path != NULL) {
+        return run_check();
+    }
+
+    /* The GSettings backend avoids loading GTK and connecting to the
+     * display */
+    if (g_strcmp0(startup_info.backend, "gtk") == 0) {
+        settings = ds_gtk_backend_get_settings(&argc, &argv, &error);
+        if (settings == NULL) {
+            g_printerr("%s\n", error->message);
+            return 1;
+        }
+    } else if (g_strcmp0(startup_info.backend, "gsettings") != 0) {
+        g_printerr("Unknown backend %s\n", startup_info.backend);
+        return 1;
+    }
     notify_init("snapd-desktop-integration");
 
     main_loop = g_main_loop_new(NULL, FALSE);
+    if (report_startup_only) {
+        startup_info.main_loop = main_loop;
+    }
 
-    client = snapd_client_new();
+    client = new_snapd_client();
     snapd = ds_snapd_helper_new(client);
+    if (store_catalog) {
+        ds_snapd_helper_use_store_catalog(snapd);
+    }
+    g_signal_connect(snapd, "needed-themes-installed", G_CALLBACK(needed_themes_installed), NULL);
+
+    if (use_broker) {
+        g_autoptr(GDBusConnection) connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+
+        if (connection == NULL) {
+            g_warning("Could not connect to system bus, resolving themes locally: %s", error->message);
+            g_clear_error(&error);
+        } else {
+            ds_snapd_helper_set_resolver(snapd, G_OBJECT(connection), broker_find_missing_snaps,
+                                         ds_broker_find_missing_snaps_finish);
+        }
+    }
+
+    host_themes = ds_host_themes_new();
+    ds_snapd_helper_set_host_themes(snapd, host_themes);
 
-    settings = gtk_settings_get_default();
-    watcher = ds_theme_watcher_new(settings);
+    /* The broker keeps its own lookup cache */
+    if (!use_broker) {
+        ds_snapd_helper_prefetch_host_themes(snapd);
+    }
+
+    if (g_strcmp0(startup_info.backend, "gsettings") == 0) {
+        watcher = ds_theme_watcher_new_for_gsettings();
+        if (watcher == NULL) {
+            g_printerr("GNOME desktop settings are not available\n");
+            return 1;
+        }
+    } else {
+        watcher = ds_theme_watcher_new(settings);
+    }
     g_signal_connect(watcher, "theme-changed", G_CALLBACK(theme_changed), snapd);
+    startup_info.handler_id = g_signal_connect(watcher, "theme-changed", G_CALLBACK(report_startup), &startup_info);
 
+    owner_id = export_session_metrics();
+    g_unix_signal_add(SIGUSR1, log_metrics_summary, NULL);
     g_main_loop_run(main_loop);
+    if (owner_id != 0) {
+        g_bus_unown_name(owner_id);
+    }
 
     notify_uninit();
     return 0;